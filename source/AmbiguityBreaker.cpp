@@ -18,6 +18,7 @@
 //    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "AmbiguityBreaker.h"
+#include <float.h>
 #include <algorithm>
 #include <boost/make_shared.hpp>
 #include <vector>
@@ -30,82 +31,6 @@
 #include "StatisticsManager.h"
 #include "misc.h"
 
-/*
-double AmbiguityBreaker::dotProduct(int imageNumI, int imageNumJ)
-{
-    int arrayStartI = imageNumI * ambiguityCount;
-    int arrayStartJ = imageNumJ * ambiguityCount;
-
-    double fx = 0;
-
-    for (int i = 0; i < ambiguityCount; i++)
-    {
-        double a = x[arrayStartI + i];
-        double b = x[arrayStartJ + i];
-
-        double addition = a * b;
-
-        fx += addition;
-    }
-
-    return fx;
-}
-
-double AmbiguityBreaker::evaluation()
-{
-    double fx = 0;
-
-    int imageCount = (int)mtzs.size();
-
-    for (int i = 0; i < imageCount - 1; i++)
-    {
-        for (int j = i + 1; j < imageCount; j++)
-        {
-            double correl = gridCorrelation(i, j);
-
-            if (correl == -1)
-                continue;
-
-            double dot = dotProduct(i, j);
-
-            fx += pow(correl - dot, 2);
-        }
-    }
-
-    return fx;
-}
-
-double AmbiguityBreaker::gradientForImage(int imageNum, int axis)
-{
-    double g = 0;
-
-    for (int j = 0; j < mtzs.size(); j++)
-    {
-        if (j == imageNum)
-            continue;
-
-        double correl = gridCorrelation(imageNum, j);
-
-        if (correl == -1)
-            continue;
-
-        int arrayStartJ = j * ambiguityCount;
-
-        double dot = dotProduct(imageNum, j);
-
-        double jAxis = x[arrayStartJ + axis];
-
-        g += (-2) * jAxis * (correl - dot);
-    }
-
-    return g;
-}
-
-double AmbiguityBreaker::gridCorrelation(int imageNumI, int imageNumJ)
-{
-    return statsManager->gridCorrelation(imageNumI, imageNumJ);
-}*/
-
 bool compare(MtzPtr a, MtzPtr b) {
   return (a->getFilename() > b->getFilename());
 }
@@ -245,36 +170,194 @@ void AmbiguityBreaker::plotDifferences(bool oneChip) {
   png->writeImageOutput();
 }
 
-void AmbiguityBreaker::calculateCorrelations(AmbiguityBreaker *me, int offset) {
-  int maxThreads = 1;  // FileParser::getMaxThreads();
-  std::ostringstream logged;
+typedef struct {
+  double x;
+  double y;
+  double weight;
+} CorrelationPoint;
+
+static bool entryBefore(const CorrelationEntry &one,
+                        const CorrelationEntry &two) {
+  return one.reflId < two.reflId;
+}
+
+void AmbiguityBreaker::makeCorrelationRows(AmbiguityBreaker *me, int offset) {
+  int maxThreads = FileParser::getMaxThreads();
 
   for (int i = offset; i < me->mtzs.size(); i += maxThreads) {
-    MtzPtr iMtz = me->mtzs[i];
-    iMtz->setActiveAmbiguity(0);
+    MtzPtr mtz = me->mtzs[i];
 
-    for (int j = 0; j < i; j++) {
-      MtzPtr jMtz = me->mtzs[j];
+    for (int k = 0; k < me->ambiguityCount; k++) {
+      CorrelationRow &row = me->correlationRow(i, k);
+      row.reserve(mtz->reflectionCount());
 
-      for (int k = 0; k < me->ambiguityCount; k++) {
-        int hits = 0;
-        double cc = StatisticsManager::cc_pearson(&*iMtz, &*jMtz, true, &hits);
+      for (int j = 0; j < mtz->reflectionCount(); j++) {
+        ReflectionPtr refl = mtz->reflection(j);
 
-        me->correlationMaps[k][iMtz][jMtz] = cc;
-        me->correlationMaps[k][jMtz][iMtz] = cc;
-        iMtz->incrementActiveAmbiguity();
+        if (refl->millerCount() == 0) continue;
+
+        CorrelationEntry entry;
+        entry.reflId = (unsigned int)refl->getReflId(k);
+        entry.accepted = (refl->acceptedCount() > 0);
+        entry.intensity = refl->meanIntensity();
+        entry.weight = refl->meanPartiality();
+        entry.resolution = refl->getResolution();
+        row.push_back(entry);
       }
 
-      iMtz->setActiveAmbiguity(0);
+      /* Reflection order only follows the IDs of the original indexing */
+      if (k > 0) {
+        std::sort(row.begin(), row.end(), entryBefore);
+      }
     }
   }
+}
+
+/* Same as StatisticsManager::cc_pearson of the first crystal (under the
+ * given ambiguity) against the second, but walks both sorted rows at once
+ * instead of searching the second crystal for every reflection. */
+
+double AmbiguityBreaker::pairCorrelation(int first, int ambiguity,
+                                         int second) {
+  static thread_local std::vector<CorrelationPoint> matched;
+  CorrelationRow &row1 = correlationRow(first, ambiguity);
+  CorrelationRow &row2 = correlationRow(second, 0);
+
+  matched.clear();
+  int common = 0;
+  int j = 0;
+
+  for (int i = 0; i < row1.size() && j < row2.size(); i++) {
+    if (!row1[i].accepted) continue;
+
+    while (j < row2.size() && row2[j].reflId < row1[i].reflId) j++;
 
-  if (offset == 0) {
-    logged << std::endl;
-    Logger::log(logged);
+    if (j == row2.size() || row2[j].reflId != row1[i].reflId) continue;
+
+    common++;
+
+    if (!(row1[i].resolution > 0 && row1[i].resolution < FLT_MAX)) continue;
+
+    CorrelationPoint point;
+    point.x = row1[i].intensity;
+    point.y = row2[j].intensity;
+    point.weight = row1[i].weight * row2[j].weight;
+
+    if (point.weight < 0) continue;
+
+    if (point.x != point.x || point.y != point.y ||
+        point.weight != point.weight)
+      continue;
+
+    matched.push_back(point);
+  }
+
+  if (common <= 2) {
+    return -1;
+  }
+
+  double sum_x = 0;
+  double sum_y = 0;
+  double weight_counted = 0;
+
+  for (int i = 0; i < matched.size(); i++) {
+    sum_x += matched[i].x * matched[i].weight;
+    sum_y += matched[i].y * matched[i].weight;
+    weight_counted += matched[i].weight;
+  }
+
+  double mean_x = sum_x / weight_counted;
+  double mean_y = sum_y / weight_counted;
+
+  double sum_x_y_minus_mean_x_y = 0;
+  double sum_x_minus_mean_x_sq = 0;
+  double sum_y_minus_mean_y_sq = 0;
+
+  for (int i = 0; i < matched.size(); i++) {
+    double weight = matched[i].weight;
+    double amp_x = matched[i].x - mean_x;
+    double amp_y = matched[i].y - mean_y;
+
+    sum_x_y_minus_mean_x_y += weight * amp_x * amp_y;
+    sum_x_minus_mean_x_sq += weight * amp_x * amp_x;
+    sum_y_minus_mean_y_sq += weight * amp_y * amp_y;
+  }
+
+  double r = sum_x_y_minus_mean_x_y /
+             (sqrt(sum_x_minus_mean_x_sq * sum_y_minus_mean_y_sq));
+
+  if (r < 0) r = 0;
+  if (r != r) r = -1;
+
+  return r;
+}
+
+void AmbiguityBreaker::calculateCorrelations(AmbiguityBreaker *me, int offset) {
+  int maxThreads = FileParser::getMaxThreads();
+
+  /* Pairs are sorted by their first crystal, so neighbouring threads work
+   * on the same few rows at any time */
+  for (size_t p = offset; p < me->crystalPairs.size(); p += maxThreads) {
+    int first = me->crystalPairs[p].first;
+    int second = me->crystalPairs[p].second;
+
+    for (int k = 0; k < me->ambiguityCount; k++) {
+      me->pairCorrelations[p * me->ambiguityCount + k] =
+          me->pairCorrelation(first, k, second);
+    }
   }
 }
 
+void AmbiguityBreaker::chooseCrystalPairs() {
+  int crystals = (int)mtzs.size();
+  int partners = FileParser::getKey("AMBIGUITY_PARTNERS", 0);
+
+  crystalPairs.clear();
+
+  if (partners <= 0 || partners >= crystals - 1) {
+    crystalPairs.reserve((size_t)crystals * (crystals - 1) / 2);
+
+    for (int i = 0; i < crystals; i++) {
+      for (int j = 0; j < i; j++) {
+        crystalPairs.push_back(std::make_pair(i, j));
+      }
+    }
+  } else {
+    /* Random partners for each crystal, as in Brehm & Diederichs */
+    crystalPairs.reserve((size_t)crystals * partners);
+
+    for (int i = 0; i < crystals; i++) {
+      for (int n = 0; n < partners; n++) {
+        int j = rand() % (crystals - 1);
+        if (j >= i) j++;
+
+        crystalPairs.push_back(std::make_pair(std::max(i, j), std::min(i, j)));
+      }
+    }
+
+    std::sort(crystalPairs.begin(), crystalPairs.end());
+    crystalPairs.erase(std::unique(crystalPairs.begin(), crystalPairs.end()),
+                       crystalPairs.end());
+  }
+
+  pairsForCrystal.clear();
+  pairsForCrystal.resize(crystals);
+
+  for (int p = 0; p < crystalPairs.size(); p++) {
+    pairsForCrystal[crystalPairs[p].first].push_back(p);
+    pairsForCrystal[crystalPairs[p].second].push_back(p);
+  }
+
+  logged << "Correlating " << crystalPairs.size() << " pairs of crystals";
+
+  if (partners > 0 && partners < crystals - 1) {
+    logged << " (" << partners << " random partners per crystal)";
+  }
+
+  logged << "." << std::endl;
+  sendLog();
+}
+
 void AmbiguityBreaker::makeCorrelationGrid() {
   logged << "************************************" << std::endl;
   logged << "****  Calculating correlations  ****" << std::endl;
@@ -282,25 +365,31 @@ void AmbiguityBreaker::makeCorrelationGrid() {
   logged << "There are " << mtzs.size() << " mtz files." << std::endl;
   sendLog();
 
-  // int maxThreads = FileParser::getMaxThreads();
+  int maxThreads = FileParser::getMaxThreads();
 
-  for (int j = 0; j < ambiguityCount; j++) {
-    correlationMaps.push_back(CorrelationMap());
-  }
+  correlationRows.clear();
+  correlationRows.resize(mtzs.size() * ambiguityCount);
 
-  for (int i = 0; i < mtzs.size(); i++) {
-    for (int j = 0; j < ambiguityCount; j++) {
-      correlationMaps[j][mtzs[i]] = CrystalCorrelation();
-    }
+  boost::thread_group rowThreads;
+  for (int i = 0; i < maxThreads; i++) {
+    boost::thread *thr = new boost::thread(makeCorrelationRows, this, i);
+    rowThreads.add_thread(thr);
   }
 
+  rowThreads.join_all();
+
+  chooseCrystalPairs();
+  pairCorrelations.resize(crystalPairs.size() * ambiguityCount);
+
   boost::thread_group threads;
-  for (int i = 0; i < 1; i++) {
+  for (int i = 0; i < maxThreads; i++) {
     boost::thread *thr = new boost::thread(calculateCorrelations, this, i);
     threads.add_thread(thr);
   }
 
   threads.join_all();
+
+  correlationRows.clear();
 }
 
 // Call constructor and then run()
@@ -353,6 +442,270 @@ void AmbiguityBreaker::merge() {
   merged = merger.getMergedMtz();
 }
 
+// MARK: embedding
+
+/* Each crystal has one coordinate per ambiguity. The predicted correlation
+ * of the first crystal of a pair (under ambiguity k) with the second is the
+ * dot product of their coordinates, with the first cycled by k. Crystals
+ * whose real ambiguities differ by k therefore end up with coordinates
+ * pointing along axes k apart. */
+
+double AmbiguityBreaker::dotProduct(const std::vector<double> &x, int first,
+                                    int second, int ambiguity) {
+  const double *a = &x[first * ambiguityCount];
+  const double *b = &x[second * ambiguityCount];
+  double dot = 0;
+
+  for (int c = 0; c < ambiguityCount; c++) {
+    dot += a[(c + ambiguity) % ambiguityCount] * b[c];
+  }
+
+  return dot;
+}
+
+void AmbiguityBreaker::embeddingThread(AmbiguityBreaker *me, int offset,
+                                       const std::vector<double> *x,
+                                       std::vector<double> *gradient,
+                                       std::vector<double> *scores) {
+  int maxThreads = FileParser::getMaxThreads();
+  int count = me->ambiguityCount;
+
+  /* Every crystal sums its own terms in a fixed order, so the result does
+   * not depend on the number of threads */
+  for (int i = offset; i < me->mtzs.size(); i += maxThreads) {
+    double *g = &(*gradient)[i * count];
+    double score = 0;
+
+    for (int a = 0; a < count; a++) {
+      g[a] = 0;
+    }
+
+    for (int p = 0; p < me->pairsForCrystal[i].size(); p++) {
+      int pair = me->pairsForCrystal[i][p];
+      int first = me->crystalPairs[pair].first;
+      int second = me->crystalPairs[pair].second;
+      const double *xFirst = &(*x)[first * count];
+      const double *xSecond = &(*x)[second * count];
+
+      for (int k = 0; k < count; k++) {
+        double cc = me->pairCorrelations[pair * count + k];
+
+        if (cc < 0) continue;
+
+        double diff = cc - me->dotProduct(*x, first, second, k);
+
+        if (i == first) {
+          score += diff * diff;
+
+          for (int c = 0; c < count; c++) {
+            g[(c + k) % count] -= 2 * diff * xSecond[c];
+          }
+        } else {
+          for (int c = 0; c < count; c++) {
+            g[c] -= 2 * diff * xFirst[(c + k) % count];
+          }
+        }
+      }
+    }
+
+    (*scores)[i] = score;
+  }
+}
+
+double AmbiguityBreaker::evaluation(const std::vector<double> &x,
+                                    std::vector<double> *gradient) {
+  int maxThreads = FileParser::getMaxThreads();
+  std::vector<double> scores(mtzs.size());
+  gradient->resize(x.size());
+
+  boost::thread_group threads;
+  for (int i = 0; i < maxThreads; i++) {
+    boost::thread *thr =
+        new boost::thread(embeddingThread, this, i, &x, gradient, &scores);
+    threads.add_thread(thr);
+  }
+
+  threads.join_all();
+
+  double fx = 0;
+
+  for (int i = 0; i < scores.size(); i++) {
+    fx += scores[i];
+  }
+
+  return fx;
+}
+
+static double dotVectors(const std::vector<double> &a,
+                         const std::vector<double> &b) {
+  double sum = 0;
+
+  for (int i = 0; i < a.size(); i++) {
+    sum += a[i] * b[i];
+  }
+
+  return sum;
+}
+
+/* L-BFGS with a backtracking line search on the embedding score */
+
+void AmbiguityBreaker::embedCrystals() {
+  const int history = 5;
+  const int maxIterations = 500;
+  const double tolerance = 1e-7;
+
+  int n = (int)mtzs.size() * ambiguityCount;
+  std::vector<double> x(n), g, xNew, gNew, direction(n);
+  std::vector<std::vector<double> > sList, yList;
+  std::vector<double> rhoList;
+
+  for (int i = 0; i < n; i++) {
+    x[i] = (double)rand() / RAND_MAX;
+  }
+
+  double fx = evaluation(x, &g);
+  double startScore = fx;
+  int iteration = 0;
+  std::string reason = "reached maximum iterations";
+
+  for (iteration = 0; iteration < maxIterations; iteration++) {
+    double gradNorm = sqrt(dotVectors(g, g));
+
+    if (gradNorm < tolerance) {
+      reason = "gradient vanished";
+      break;
+    }
+
+    /* Two-loop recursion for the search direction */
+    direction = g;
+    std::vector<double> alphas(sList.size());
+
+    for (int m = (int)sList.size() - 1; m >= 0; m--) {
+      alphas[m] = rhoList[m] * dotVectors(sList[m], direction);
+
+      for (int i = 0; i < n; i++) {
+        direction[i] -= alphas[m] * yList[m][i];
+      }
+    }
+
+    double gamma = 1 / gradNorm;
+
+    if (sList.size()) {
+      gamma = dotVectors(sList.back(), yList.back()) /
+              dotVectors(yList.back(), yList.back());
+    }
+
+    for (int i = 0; i < n; i++) {
+      direction[i] *= gamma;
+    }
+
+    for (int m = 0; m < sList.size(); m++) {
+      double beta = rhoList[m] * dotVectors(yList[m], direction);
+
+      for (int i = 0; i < n; i++) {
+        direction[i] += (alphas[m] - beta) * sList[m][i];
+      }
+    }
+
+    for (int i = 0; i < n; i++) {
+      direction[i] = -direction[i];
+    }
+
+    double slope = dotVectors(g, direction);
+
+    if (slope >= 0) {
+      for (int i = 0; i < n; i++) {
+        direction[i] = -g[i] / gradNorm;
+      }
+
+      slope = -gradNorm;
+      sList.clear();
+      yList.clear();
+      rhoList.clear();
+    }
+
+    double step = 1;
+    double fNew = fx;
+    bool accepted = false;
+    xNew.resize(n);
+
+    for (int attempt = 0; attempt < 30; attempt++) {
+      for (int i = 0; i < n; i++) {
+        xNew[i] = x[i] + step * direction[i];
+      }
+
+      fNew = evaluation(xNew, &gNew);
+
+      if (fNew <= fx + 1e-4 * step * slope) {
+        accepted = true;
+        break;
+      }
+
+      step /= 2;
+    }
+
+    if (!accepted) {
+      reason = "line search failed";
+      break;
+    }
+
+    std::vector<double> s(n), y(n);
+
+    for (int i = 0; i < n; i++) {
+      s[i] = xNew[i] - x[i];
+      y[i] = gNew[i] - g[i];
+    }
+
+    double sy = dotVectors(s, y);
+
+    if (sy > 1e-10) {
+      sList.push_back(s);
+      yList.push_back(y);
+      rhoList.push_back(1 / sy);
+
+      if (sList.size() > history) {
+        sList.erase(sList.begin());
+        yList.erase(yList.begin());
+        rhoList.erase(rhoList.begin());
+      }
+    }
+
+    double change = fx - fNew;
+    x.swap(xNew);
+    g.swap(gNew);
+    fx = fNew;
+
+    if ((iteration + 1) % 10 == 0) {
+      logged << "Embedding iteration " << iteration + 1 << " - score " << fx
+             << ", gradient " << sqrt(dotVectors(g, g)) << std::endl;
+      sendLog(LogLevelDetailed);
+    }
+
+    if (change <= tolerance * std::max(1., fabs(fx))) {
+      iteration++;
+      reason = "score converged";
+      break;
+    }
+  }
+
+  logged << "Embedding of " << mtzs.size() << " crystals: score " << startScore
+         << " to " << fx << " after " << iteration << " iterations ("
+         << reason << ")." << std::endl;
+  sendLog();
+
+  for (int i = 0; i < mtzs.size(); i++) {
+    int best = 0;
+
+    for (int a = 1; a < ambiguityCount; a++) {
+      if (x[i * ambiguityCount + a] > x[i * ambiguityCount + best]) {
+        best = a;
+      }
+    }
+
+    mtzs[i]->setActiveAmbiguity(best);
+  }
+}
+
 void AmbiguityBreaker::printResults() {
   int ambiguityNums[8];
   memset(ambiguityNums, 0, sizeof(int) * 8);
@@ -380,10 +733,14 @@ void AmbiguityBreaker::breakAmbiguity() {
   logged << "***********************************" << std::endl << std::endl;
   sendLog();
 
-  for (int i = 0; i < mtzs.size(); i++) {
-    int random = rand() % (ambiguityCount);
+  if (FileParser::getKey("AMBIGUITY_EMBEDDING", false)) {
+    embedCrystals();
+  } else {
+    for (int i = 0; i < mtzs.size(); i++) {
+      int random = rand() % (ambiguityCount);
 
-    mtzs[i]->setActiveAmbiguity(random);
+      mtzs[i]->setActiveAmbiguity(random);
+    }
   }
 
   bool unchanged = false;
@@ -404,11 +761,14 @@ void AmbiguityBreaker::breakAmbiguity() {
       memset(ccSums, 0, sizeof(double) * 8);
       memset(ccCounts, 0, sizeof(int) * 8);
 
-      for (int j = 0; j < mtzs.size(); j++) {
-        if (i == j) continue;
+      for (int p = 0; p < pairsForCrystal[i].size(); p++) {
+        int pair = pairsForCrystal[i][p];
+        int j = crystalPairs[pair].first;
+        if (j == i) j = crystalPairs[pair].second;
 
         int theirAmbiguity = mtzs[j]->getActiveAmbiguity();
-        double chosenCC = correlationMaps[theirAmbiguity][mtzs[i]][mtzs[j]];
+        double chosenCC =
+            pairCorrelations[pair * ambiguityCount + theirAmbiguity];
 
         if (chosenCC < 0) continue;
 
@@ -444,86 +804,4 @@ void AmbiguityBreaker::breakAmbiguity() {
            << std::endl;
     sendLog();
   }
-
-  /*
-  int n = ambiguityCount * (int)mtzs.size();
-
-  scitbx::af::shared<int> nbd(n);
-  scitbx::af::shared<double> lowerLims(n);
-  scitbx::af::shared<double> upperLims(n);
-
-  x = scitbx::af::shared<double>(n);
-
-  logged << "Number of variables: " << x.size() << std::endl;
-
-  for (int i = 0; i < n; i++)
-      nbd[i] = 0;
-
-  double factr = 1.e+7;
-  double pgtol = 0;
-  int iprint = 0;
-
-  scitbx::lbfgsb::minimizer<double> *minimizer =
-  new scitbx::lbfgsb::minimizer<double>(n, 5, lowerLims, upperLims,
-                                        nbd, false, factr, pgtol, iprint);
-
-  scitbx::lbfgs::traditional_convergence_test<double, int> is_converged(n);
-
-  scitbx::af::ref<double> xb(x.begin(), n);
-
-  for (int i = 0; i < n; i++)
-      x[i] = 1;
-
-  for (int i = 0; i < x.size(); i++)
-  {
-      double random = (double)rand() / RAND_MAX;
-      x[i] = random;
-  }
-
-  sendLog();
-
-  scitbx::af::shared<double> g(n);
-  scitbx::af::ref<double> gb(g.begin(), n);
-
-  for (int i = 0; i < n; i++)
-      g[i] = 0;
-
-  try
-  {
-      for (int num = 0;; num++)
-      {
-          float fx = evaluation(); // calculate fx
-
-          // gradient values (set to 0 initially, then populate arrays)
-
-          for (int i = 0; i < n; i++)
-          {
-              g[i] = 0;
-          }
-
-          for (int i = 0; i < mtzs.size(); i++)
-          {
-              for (int j = 0; j < ambiguityCount; j++)
-              {
-                  g[i * ambiguityCount + j] = gradientForImage(i, j);
-              }
-          }
-
-          std::cout << "fx: " << fx << std::endl;
-
-          minimizer->process(xb, fx, gb);
-
-          if (minimizer->is_terminated())
-              break;
-
-          if (minimizer->n_iteration() > 50)
-              break;
-      }
-  } catch (scitbx::lbfgs::error &e)
-  {
-      std::cout << e.what() << std::endl;
-  } catch (void *e)
-  {
-      std::cout << "Unknown error!" << std::endl;
-  }*/
 }
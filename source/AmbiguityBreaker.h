@@ -25,25 +25,46 @@
 #include "parameters.h"
 
 class StatisticsManager;
-typedef std::map<MtzPtr, double> CrystalCorrelation;
-typedef std::map<MtzPtr, CrystalCorrelation> CorrelationMap;
+
+/* One reflection of a crystal under one indexing ambiguity: an element of
+ * the sparse crystal x reflection matrix which correlations are taken over */
+typedef struct {
+  unsigned int reflId;
+  bool accepted;
+  double intensity;
+  double weight;
+  double resolution;
+} CorrelationEntry;
+
+typedef std::vector<CorrelationEntry> CorrelationRow;
 
 class AmbiguityBreaker : public LoggableObject {
  private:
-  std::vector<CorrelationMap> correlationMaps;
+  /* Rows for each crystal and ambiguity, sorted by reflection ID */
+  std::vector<CorrelationRow> correlationRows;
+  /* Crystal pairs (higher index first), their correlations for each
+   * ambiguity of the first crystal and the pairs each crystal is in */
+  std::vector<std::pair<int, int> > crystalPairs;
+  std::vector<double> pairCorrelations;
+  std::vector<std::vector<int> > pairsForCrystal;
   vector<MtzPtr> mtzs;
   int ambiguityCount;
   StatisticsManager *statsManager;
-  double gridCorrelation(int imageNumI, int imageNumJ);
-  double evaluation();
-  double gradientForImage(int imageNum, int axis);
+  double evaluation(const std::vector<double> &x,
+                    std::vector<double> *gradient);
+  static void embeddingThread(AmbiguityBreaker *me, int offset,
+                              const std::vector<double> *x,
+                              std::vector<double> *gradient,
+                              std::vector<double> *scores);
+  void embedCrystals();
 
   double distance(int vectorNum, int centreNum);
   double toggleValue(int slowCloud, int fastCloud);
   double evaluationCloudCluster();
   double gradientCloudCluster(int centre, int axis);
 
-  double dotProduct(int imageNumI, int imageNumJ);
+  double dotProduct(const std::vector<double> &x, int first, int second,
+                    int ambiguity);
 
   static void plotDiffOneChipThread(AmbiguityBreaker *me, int offset,
                                     PNGFilePtr png);
@@ -51,6 +72,13 @@ class AmbiguityBreaker : public LoggableObject {
                                    PNGFilePtr png);
   void assignPartialities();
   void breakAmbiguity();
+  CorrelationRow &correlationRow(int crystal, int ambiguity) {
+    return correlationRows[crystal * ambiguityCount + ambiguity];
+  }
+
+  void chooseCrystalPairs();
+  double pairCorrelation(int first, int ambiguity, int second);
+  static void makeCorrelationRows(AmbiguityBreaker *me, int offset);
   static void calculateCorrelations(AmbiguityBreaker *me, int offset);
   void makeCorrelationGrid();
   void printResults();
@@ -0,0 +1,262 @@
+//
+//  BatchScaler.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "BatchScaler.h"
+#include <algorithm>
+#include <boost/thread/thread.hpp>
+#include "FileParser.h"
+#include "Miller.h"
+#include "MtzManager.h"
+#include "Reflection.h"
+#include "StatisticsManager.h"
+#include "Vector.h"
+
+static bool referenceBefore(const ReferenceIntensity &one,
+                            const ReferenceIntensity &two) {
+  return one.first < two.first;
+}
+
+BatchScaler::BatchScaler(MtzManager *referenceMtz, ScalingType type) {
+  scalingType = type;
+  resolutionBins = FileParser::getKey("SCALING_RESOLUTION_BINS", 10);
+
+  if (referenceMtz == NULL) {
+    return;
+  }
+
+  /* Reference reflections are already sorted by ID */
+  reference.reserve(referenceMtz->reflectionCount());
+
+  for (int i = 0; i < referenceMtz->reflectionCount(); i++) {
+    ReflectionPtr refl = referenceMtz->reflection(i);
+
+    if (refl->millerCount() == 0) {
+      continue;
+    }
+
+    reference.push_back(
+        std::make_pair(refl->getReflId(), refl->meanIntensity()));
+  }
+
+  std::sort(reference.begin(), reference.end(), referenceBefore);
+}
+
+bool BatchScaler::referenceIntensity(ReflectionPtr refl, double *intensity) {
+  ReferenceIntensity key = std::make_pair(refl->getReflId(), 0.);
+  std::vector<ReferenceIntensity>::iterator it =
+      std::lower_bound(reference.begin(), reference.end(), key,
+                       referenceBefore);
+
+  if (it == reference.end() || it->first != key.first) {
+    return false;
+  }
+
+  *intensity = it->second;
+  return true;
+}
+
+void BatchScaler::scaleToReference(MtzPtr mtz) {
+  double minD, maxD;
+  StatisticsManager::convertResolutions(0, 0, &minD, &maxD);
+
+  double x_squared = 0;
+  double x_y = 0;
+  int num = 0;
+
+  for (int i = 0; i < mtz->reflectionCount(); i++) {
+    ReflectionPtr refl = mtz->reflection(i);
+    double int2 = 0;
+
+    if (!refl->acceptedCount() || !referenceIntensity(refl, &int2)) {
+      continue;
+    }
+
+    num++;
+
+    double resolution = refl->getResolution();
+
+    if (resolution > maxD || resolution < minD) {
+      continue;
+    }
+
+    for (int j = 0; j < refl->millerCount(); j++) {
+      MillerPtr miller = refl->miller(j);
+
+      if (miller->isFree()) continue;
+
+      if (!miller->accepted()) continue;
+
+      double int1 = miller->intensity();
+      double weight = miller->getPartiality();
+
+      if ((int1 != int1) || (int2 != int2) || (weight != weight)) continue;
+
+      x_squared += int1 * int2 * weight;
+      x_y += int2 * int2 * weight;
+    }
+  }
+
+  if (num <= 1) return;
+
+  double grad = (x_y / x_squared);
+
+  if (grad < 0) grad = -1;
+
+  mtz->applyScaleFactor(grad);
+}
+
+void BatchScaler::bFactorAndScale(MtzPtr mtz) {
+  mtz->applyScaleFactor(1, 0, 0, true);
+  mtz->applyBFactor(0);
+
+  vector<boost::tuple<double, double, double> > pointsToFit;
+
+  for (int i = 0; i < mtz->reflectionCount(); i++) {
+    ReflectionPtr imgRef = mtz->reflection(i);
+    double refMean = 0;
+
+    if (!referenceIntensity(imgRef, &refMean)) continue;
+
+    if (!imgRef->anyAccepted()) continue;
+
+    double imgMean = imgRef->meanIntensity();
+    double imgWeight = imgRef->meanPartiality();
+    imgWeight *= log(1 / imgRef->getResolution());
+
+    double ratio = imgMean / refMean;
+
+    if (ratio != ratio) continue;
+
+    double resolution = 1 / imgRef->getResolution();
+    double right_exp = 1 / (4 * pow(resolution, 2));
+    double logIntensityRatio = log(ratio);
+
+    if (logIntensityRatio != logIntensityRatio) continue;
+
+    pointsToFit.push_back(
+        boost::make_tuple(right_exp, logIntensityRatio, imgWeight));
+  }
+
+  double gradient = 0;
+  double intercept = 0;
+
+  regression_line(pointsToFit, intercept, gradient);
+
+  double k = 1 / exp(intercept);
+  double b = gradient / -2;
+
+  if (b != b) b = 0;
+
+  mtz->applyScaleFactor(k);
+  mtz->applyBFactor(b);
+}
+
+void BatchScaler::scaleResolutionBins(MtzPtr mtz) {
+  vector<double> bins;
+  StatisticsManager::generateResolutionBins(0, mtz->maxResolution(),
+                                            resolutionBins, &bins);
+
+  int shells = (int)bins.size() - 1;
+  std::vector<double> minDs(shells), maxDs(shells);
+  std::vector<double> refSums(shells, 0), imgSums(shells, 0);
+
+  for (int shell = 0; shell < shells; shell++) {
+    StatisticsManager::convertResolutions(bins[shell], bins[shell + 1],
+                                          &minDs[shell], &maxDs[shell]);
+  }
+
+  /* One pass for all shells instead of one pass per shell */
+  for (int i = 0; i < mtz->reflectionCount(); i++) {
+    ReflectionPtr refl = mtz->reflection(i);
+    double refIntensity = 0;
+
+    if (!referenceIntensity(refl, &refIntensity)) continue;
+
+    if (!refl->anyAccepted()) continue;
+
+    double imgIntensity = refl->meanIntensity();
+
+    if (refIntensity != refIntensity || imgIntensity != imgIntensity) continue;
+
+    double resolution = refl->getResolution();
+
+    for (int shell = 0; shell < shells; shell++) {
+      if (resolution > maxDs[shell] || resolution < minDs[shell]) continue;
+
+      refSums[shell] += refIntensity;
+      imgSums[shell] += imgIntensity;
+    }
+  }
+
+  for (int shell = 0; shell < shells; shell++) {
+    double ratio = refSums[shell] / imgSums[shell];
+    mtz->applyScaleFactor(ratio, bins[shell], bins[shell + 1], true);
+  }
+}
+
+void BatchScaler::scale(MtzPtr mtz) {
+  if (scalingType == ScalingTypeAverage) {
+    mtz->applyScaleFactor(1000 / mtz->averageIntensity());
+    return;
+  }
+
+  if (!hasReference()) {
+    return;
+  }
+
+  if (scalingType == ScalingTypeReference) {
+    scaleToReference(mtz);
+  } else if (scalingType == ScalingTypeBFactor) {
+    bFactorAndScale(mtz);
+  } else if (scalingType == ScalingTypeResolutionShells) {
+    scaleResolutionBins(mtz);
+  }
+}
+
+void BatchScaler::scaleBatchThread(int offset) {
+  int maxThreads = FileParser::getMaxThreads();
+
+  for (int i = offset; i < batch.size(); i += maxThreads) {
+    scale(batch[i]);
+  }
+}
+
+void BatchScaler::scaleBatchThreadWrapper(BatchScaler *me, int offset) {
+  me->scaleBatchThread(offset);
+}
+
+void BatchScaler::scaleAll(std::vector<MtzPtr> mtzs) {
+  batch = mtzs;
+
+  boost::thread_group threads;
+  int maxThreads = FileParser::getMaxThreads();
+
+  for (int i = 0; i < maxThreads; i++) {
+    boost::thread *thr = new boost::thread(scaleBatchThreadWrapper, this, i);
+    threads.add_thread(thr);
+  }
+
+  threads.join_all();
+
+  logged << "Scaled " << batch.size() << " crystals against "
+         << reference.size() << " reference reflections." << std::endl;
+  sendLog(LogLevelDetailed);
+
+  batch.clear();
+}
@@ -0,0 +1,59 @@
+//
+//  BatchScaler.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __cppxfel__BatchScaler__
+#define __cppxfel__BatchScaler__
+
+#include <stdio.h>
+#include <vector>
+#include "LoggableObject.h"
+#include "parameters.h"
+
+typedef std::pair<long unsigned int, double> ReferenceIntensity;
+
+/* Scales many crystals against one reference. The reference's mean
+ * intensities are looked up once, so each crystal is scaled in a single
+ * pass over its own reflections (closed-form least squares, as in
+ * MtzManager::scaleToMtz, bFactorAndScale and applyScaleFactorsForBins),
+ * and crystals are scaled in parallel. */
+
+class BatchScaler : public LoggableObject {
+ private:
+  std::vector<ReferenceIntensity> reference;
+  std::vector<MtzPtr> batch;
+  ScalingType scalingType;
+  int resolutionBins;
+
+  bool referenceIntensity(ReflectionPtr refl, double *intensity);
+  void scaleToReference(MtzPtr mtz);
+  void bFactorAndScale(MtzPtr mtz);
+  void scaleResolutionBins(MtzPtr mtz);
+  void scaleBatchThread(int offset);
+  static void scaleBatchThreadWrapper(BatchScaler *me, int offset);
+
+ public:
+  BatchScaler(MtzManager *referenceMtz, ScalingType type);
+
+  bool hasReference() { return reference.size() > 0; }
+
+  void scale(MtzPtr mtz);
+  void scaleAll(std::vector<MtzPtr> mtzs);
+};
+
+#endif /* defined(__cppxfel__BatchScaler__) */
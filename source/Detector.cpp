@@ -229,6 +229,122 @@ Detector::Detector(DetectorPtr parent) {
   setParent(parent);
 }
 
+static MatrixPtr copyOrNull(MatrixPtr mat) {
+  if (!mat) {
+    return MatrixPtr();
+  }
+
+  return mat->copy();
+}
+
+/* Does not call initialiseZeros, which would reset the static nudge
+ * state for every other detector */
+Detector::Detector(const Detector &other)
+    : LoggableObject(other), boost::enable_shared_from_this<Detector>() {
+  gain = other.gain;
+  _refinable = other._refinable;
+  _changed = other._changed;
+  _cycleNum = other._cycleNum;
+  mustUpdateMidPoint = other.mustUpdateMidPoint;
+
+  unarrangedTopLeftX = other.unarrangedTopLeftX;
+  unarrangedTopLeftY = other.unarrangedTopLeftY;
+  unarrangedBottomRightX = other.unarrangedBottomRightX;
+  unarrangedBottomRightY = other.unarrangedBottomRightY;
+  unarrangedMidPointX = other.unarrangedMidPointX;
+  unarrangedMidPointY = other.unarrangedMidPointY;
+
+  arrangedTopLeft = other.arrangedTopLeft;
+  arrangedMidPoint = other.arrangedMidPoint;
+  quickMidPoint = other.quickMidPoint;
+  quickAngles = other.quickAngles;
+  nudgeTranslation = other.nudgeTranslation;
+  poke = other.poke;
+  pokeLateralAxis = other.pokeLateralAxis;
+  pokeLongitudinalAxis = other.pokeLongitudinalAxis;
+  pokePerpendicularAxis = other.pokePerpendicularAxis;
+  interNudge = other.interNudge;
+  nudgeRotation = other.nudgeRotation;
+  slowDirection = other.slowDirection;
+  slowRotated = other.slowRotated;
+  fastDirection = other.fastDirection;
+  fastRotated = other.fastRotated;
+  cross = other.cross;
+  rotationAngles = other.rotationAngles;
+  originalNudgePosition = other.originalNudgePosition;
+  requiredRotToOrigin = other.requiredRotToOrigin;
+
+  for (int i = 0; i < 4; i++) {
+    originalCorners[i] = other.originalCorners[i];
+  }
+
+  tag = other.tag;
+
+  rotMat = MatrixPtr(new Matrix());
+  changeOfBasisMat = copyOrNull(other.changeOfBasisMat);
+  workingBasisMat = copyOrNull(other.workingBasisMat);
+  invWorkingBasisMat = copyOrNull(other.invWorkingBasisMat);
+  fixedBasis = copyOrNull(other.fixedBasis);
+  originalNudgeMat = copyOrNull(other.originalNudgeMat);
+  interRotation = copyOrNull(other.interRotation);
+
+  nudgeStep = other.nudgeStep;
+  nudgeTiltX = other.nudgeTiltX;
+  nudgeTiltY = other.nudgeTiltY;
+  smartRatio = other.smartRatio;
+
+  addPixelOffsetX = other.addPixelOffsetX;
+  addPixelOffsetY = other.addPixelOffsetY;
+}
+
+DetectorPtr Detector::cloneTree(CloneMap *cloneMap, DetectorPtr newParent) {
+  DetectorPtr clone;
+
+  {
+    std::lock_guard<std::mutex> lg(threadMutex);
+    clone = DetectorPtr(new Detector(*this));
+  }
+
+  clone->setParent(newParent);
+  (*cloneMap)[this] = clone;
+
+  for (int i = 0; i < childrenCount(); i++) {
+    DetectorPtr childClone = getChild(i)->cloneTree(cloneMap, clone);
+    clone->children.push_back(childClone);
+  }
+
+  return clone;
+}
+
+DetectorPtr Detector::cloneAncestry(CloneMap *cloneMap, DetectorPtr child) {
+  DetectorPtr clone;
+
+  {
+    std::lock_guard<std::mutex> lg(threadMutex);
+    clone = DetectorPtr(new Detector(*this));
+  }
+
+  (*cloneMap)[this] = clone;
+  clone->children.push_back(child);
+  child->setParent(clone);
+
+  if (isLUCA()) {
+    return clone;
+  }
+
+  return getParent()->cloneAncestry(cloneMap, clone);
+}
+
+DetectorPtr Detector::cloneBranch(CloneMap *cloneMap) {
+  DetectorPtr clone = cloneTree(cloneMap);
+
+  if (isLUCA()) {
+    return clone;
+  }
+
+  return getParent()->cloneAncestry(cloneMap, clone);
+}
+
 void Detector::initialise(Coord unarrangedTopLeft, Coord unarrangedBottomRight,
                           vec slowDir, vec fastDir, vec _arrangedTopLeft,
                           bool lastIsMiddle, bool ghost) {
@@ -1104,6 +1220,69 @@ double Detector::millerScoreWrapper(void *object) {
   return static_cast<Detector *>(object)->millerScore();
 }
 
+typedef struct {
+  DetectorPtr master;
+  std::vector<MillerPtr> millers;
+} DetectorSnapshot;
+
+typedef boost::shared_ptr<DetectorSnapshot> DetectorSnapshotPtr;
+
+bool Detector::makeMillerContext(void *evaluatedObject,
+                                 std::vector<void *> objects,
+                                 EvaluationContext *context) {
+  Detector *me = static_cast<Detector *>(evaluatedObject);
+  DetectorSnapshotPtr snapshot = DetectorSnapshotPtr(new DetectorSnapshot());
+  CloneMap cloneMap;
+
+  snapshot->master = me->cloneBranch(&cloneMap);
+
+  if (!cloneMap.count(me)) {
+    return false;
+  }
+
+  DetectorPtr myClone = cloneMap[me];
+
+  {
+    std::lock_guard<std::mutex> lg(me->millerMutex);
+
+    for (int i = 0; i < me->millerCount(); i++) {
+      MillerPtr original = me->miller(i);
+
+      if (!original) {
+        continue;
+      }
+
+      DetectorPtr originalDetector = original->getDetector();
+
+      /* Millers without a panel would be positioned on the live master */
+      if (!originalDetector || !cloneMap.count(&*originalDetector)) {
+        return false;
+      }
+
+      MillerPtr copy = original->copyForDetector(cloneMap[&*originalDetector]);
+      snapshot->millers.push_back(copy);
+      myClone->millers.push_back(copy);
+    }
+  }
+
+  context->objects.clear();
+
+  for (int i = 0; i < objects.size(); i++) {
+    Detector *object = static_cast<Detector *>(objects[i]);
+
+    if (!cloneMap.count(object)) {
+      return false;
+    }
+
+    context->objects.push_back(&*cloneMap[object]);
+  }
+
+  context->evaluateObject = &*myClone;
+  context->owner = snapshot;
+
+  return true;
+}
+
 double Detector::millerScore(bool ascii, bool stdev, int number) {
   if (!millers.size()) {
     return 0;
@@ -23,6 +23,7 @@ typedef enum {
 } DetectorType;
 
 typedef std::map<DetectorPtr, bool> AncestorMap;
+typedef std::map<Detector *, DetectorPtr> CloneMap;
 
 class Detector : public LoggableObject,
                  public boost::enable_shared_from_this<Detector> {
@@ -204,6 +205,11 @@ class Detector : public LoggableObject,
   void addToBasisChange(vec angles, MatrixPtr chosenMat = MatrixPtr());
   void fixBasisChange();
 
+  /* Copies geometry only - no children, Millers or index managers. Use
+   * cloneTree to get a working copy of a detector hierarchy. */
+  Detector(const Detector &other);
+  DetectorPtr cloneAncestry(CloneMap *cloneMap, DetectorPtr child);
+
  public:
   /* Initialise all variables to zero */
   Detector();
@@ -228,6 +234,17 @@ class Detector : public LoggableObject,
   /* For detectors who have children and are not the master */
   Detector(DetectorPtr parent, vec arrangedMiddle, std::string tag);
 
+  /* Independent copy of this detector and all its children, for
+   * evaluating geometry away from the live hierarchy. Fills cloneMap
+   * with the copy of each original panel. */
+  DetectorPtr cloneTree(CloneMap *cloneMap,
+                        DetectorPtr newParent = DetectorPtr());
+
+  /* As cloneTree, but above this detector only its ancestors are copied
+   * and not their other children, which play no part in where this
+   * detector sits. Returns the copy of the master, which owns the rest. */
+  DetectorPtr cloneBranch(CloneMap *cloneMap);
+
   static void fullDescription();
   void description(bool propogate = false);
 
@@ -266,6 +283,14 @@ class Detector : public LoggableObject,
     updateUnarrangedMidPoint();
   }
 
+  void getUnarrangedBounds(int *topLeftX, int *topLeftY, int *bottomRightX,
+                           int *bottomRightY) {
+    *topLeftX = unarrangedTopLeftX;
+    *topLeftY = unarrangedTopLeftY;
+    *bottomRightX = unarrangedBottomRightX;
+    *bottomRightY = unarrangedBottomRightY;
+  }
+
   void setSlowDirection(double newX, double newY, double newZ) {
     slowDirection.h = newX;
     slowDirection.k = newY;
@@ -620,6 +645,9 @@ class Detector : public LoggableObject,
   double millerScore(bool ascii = false, bool stdev = false, int number = -1);
   static double millerScoreWrapper(void *object);
   static double millerStdevScoreWrapper(void *object);
+  static bool makeMillerContext(void *evaluatedObject,
+                                std::vector<void *> objects,
+                                EvaluationContext *context);
 
   double peakScore();
   static double peakScoreWrapper(void *object);
@@ -0,0 +1,314 @@
+//
+//  DifferentialEvolution.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "DifferentialEvolution.h"
+#include <float.h>
+#include <boost/thread/thread.hpp>
+#include "FileParser.h"
+
+double DifferentialEvolution::randomUnit() {
+  return std::uniform_real_distribution<double>(0, 1)(generator);
+}
+
+int DifferentialEvolution::randomIndex(int count) {
+  return std::uniform_int_distribution<int>(0, count - 1)(generator);
+}
+
+/* Seeded from RANDOM_SEED and the job name rather than the shared rand(),
+ * so that strategies refining concurrently neither race on its state nor
+ * depend on the order in which they happen to draw from it. */
+void DifferentialEvolution::seedGenerator() {
+  unsigned int seed = FileParser::getKey("RANDOM_SEED", 0);
+
+  for (int i = 0; i < jobName.length(); i++) {
+    seed = seed * 31 + (unsigned char)jobName[i];
+  }
+
+  generator.seed(seed);
+}
+
+static bool candidateBetterThanCandidate(Candidate &one, Candidate &two) {
+  if (one.second != one.second) {
+    return false;
+  }
+
+  if (two.second != two.second) {
+    return true;
+  }
+
+  return one.second <= two.second;
+}
+
+void DifferentialEvolution::init() {
+  mutationScale = 0.6;
+  crossoverRate = 0.9;
+  spreadScale = 2;
+  minPopulation = 8;
+  maxPopulation = 40;
+  triedContexts = false;
+}
+
+void DifferentialEvolution::clearParameters() {
+  RefinementStrategy::clearParameters();
+
+  population.clear();
+  contexts.clear();
+}
+
+int DifferentialEvolution::populationSize() {
+  int size = 10 * (int)tags.size();
+  size = std::max(size, minPopulation);
+  size = std::min(size, maxPopulation);
+
+  return size;
+}
+
+void DifferentialEvolution::setCandidateParameters(Candidate *candidate) {
+  for (int i = 0; i < tags.size(); i++) {
+    (*setters[i])(objects[i], candidate->first[i]);
+  }
+}
+
+bool DifferentialEvolution::makeContexts(int threads) {
+  if (triedContexts) {
+    return (contexts.size() >= threads);
+  }
+
+  triedContexts = true;
+
+  if (threads <= 1 || contextMaker == NULL) {
+    return false;
+  }
+
+  /* Made once per refinement from the untouched live objects, as every
+   * candidate sets all parameters before it is scored */
+  contexts.resize(threads);
+
+  for (int i = 0; i < threads; i++) {
+    if (!makeContext(&contexts[i])) {
+      logged << "Could not make evaluation context for " << jobName
+             << ", evaluating population serially." << std::endl;
+      sendLog(LogLevelDebug);
+      contexts.clear();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void DifferentialEvolution::evaluateCandidatesWrapper(
+    DifferentialEvolution *me, EvaluationContext *context,
+    std::vector<Candidate> *candidates, int offset, int threads) {
+  for (int j = offset; j < candidates->size(); j += threads) {
+    Candidate &candidate = (*candidates)[j];
+
+    for (int i = 0; i < candidate.first.size(); i++) {
+      Setter setter = me->setters[i];
+      (*setter)(context->objects[i], candidate.first[i]);
+    }
+
+    candidate.second = (*me->evaluationFunction)(context->evaluateObject);
+  }
+}
+
+void DifferentialEvolution::evaluateCandidates(
+    std::vector<Candidate> *candidates) {
+  int threads = std::min(batchThreads, (int)candidates->size());
+
+  if (!makeContexts(threads)) {
+    for (int i = 0; i < candidates->size(); i++) {
+      setCandidateParameters(&(*candidates)[i]);
+      (*candidates)[i].second = evaluate();
+    }
+
+    return;
+  }
+
+  boost::thread_group workers;
+
+  for (int i = 0; i < threads; i++) {
+    boost::thread *thr =
+        new boost::thread(evaluateCandidatesWrapper, this, &contexts[i],
+                          candidates, i, threads);
+    workers.add_thread(thr);
+  }
+
+  workers.join_all();
+
+  for (int i = 0; i < candidates->size(); i++) {
+    cacheEvaluation(&(*candidates)[i].first, (*candidates)[i].second);
+  }
+}
+
+void DifferentialEvolution::initialisePopulation() {
+  population.clear();
+  population.resize(populationSize());
+
+  for (int i = 0; i < population.size(); i++) {
+    population[i].first.resize(tags.size());
+    population[i].second = 0;
+
+    for (int j = 0; j < tags.size(); j++) {
+      double start = (*getters[j])(objects[j]);
+
+      if (i == 0) {
+        population[i].first[j] = start;
+        continue;
+      }
+
+      double shift = (2 * randomUnit() - 1) * spreadScale * stepSizes[j];
+      population[i].first[j] = start + shift;
+    }
+  }
+
+  /* The starting point has already been scored by the base class */
+  population[0].second = startingScore;
+
+  std::vector<Candidate> others(population.begin() + 1, population.end());
+  evaluateCandidates(&others);
+
+  for (int i = 0; i < others.size(); i++) {
+    population[i + 1] = others[i];
+  }
+}
+
+int DifferentialEvolution::bestCandidate() {
+  int best = 0;
+
+  for (int i = 1; i < population.size(); i++) {
+    if (!candidateBetterThanCandidate(population[best], population[i])) {
+      best = i;
+    }
+  }
+
+  return best;
+}
+
+Candidate DifferentialEvolution::trialCandidate(int num, int best) {
+  int count = (int)population.size();
+  int r1 = num;
+  int r2 = num;
+
+  while (r1 == num) {
+    r1 = randomIndex(count);
+  }
+
+  while (r2 == num || r2 == r1) {
+    r2 = randomIndex(count);
+  }
+
+  std::vector<double> &current = population[num].first;
+  std::vector<double> &leader = population[best].first;
+  std::vector<double> &diff1 = population[r1].first;
+  std::vector<double> &diff2 = population[r2].first;
+
+  /* At least one parameter always comes from the mutant */
+  int forced = randomIndex((int)tags.size());
+
+  Candidate trial = std::make_pair(current, 0);
+
+  for (int j = 0; j < tags.size(); j++) {
+    if (j != forced && randomUnit() > crossoverRate) {
+      continue;
+    }
+
+    trial.first[j] = current[j] + mutationScale * (leader[j] - current[j]) +
+                     mutationScale * (diff1[j] - diff2[j]);
+  }
+
+  return trial;
+}
+
+bool DifferentialEvolution::converged() {
+  bool anyCriterion = false;
+
+  for (int j = 0; j < tags.size(); j++) {
+    if (stepConvergences[j] <= 0) {
+      continue;
+    }
+
+    anyCriterion = true;
+    double minValue = FLT_MAX;
+    double maxValue = -FLT_MAX;
+
+    for (int i = 0; i < population.size(); i++) {
+      minValue = std::min(minValue, population[i].first[j]);
+      maxValue = std::max(maxValue, population[i].first[j]);
+    }
+
+    if (maxValue - minValue > stepConvergences[j]) {
+      return false;
+    }
+  }
+
+  return anyCriterion;
+}
+
+void DifferentialEvolution::refine() {
+  RefinementStrategy::refine();
+
+  if (tags.size() == 0) return;
+
+  triedContexts = false;
+  contexts.clear();
+
+  seedGenerator();
+  initialisePopulation();
+
+  int best = bestCandidate();
+  int count = 0;
+
+  while (!converged() && count < maxCycles) {
+    count++;
+
+    reportProgress(population[best].second, &population[best].first);
+
+    /* Trials are drawn on this thread in a fixed order, so the result
+     * does not depend on the number of threads */
+    std::vector<Candidate> trials;
+
+    for (int i = 0; i < population.size(); i++) {
+      trials.push_back(trialCandidate(i, best));
+    }
+
+    evaluateCandidates(&trials);
+
+    for (int i = 0; i < population.size(); i++) {
+      if (candidateBetterThanCandidate(trials[i], population[i])) {
+        population[i] = trials[i];
+      }
+    }
+
+    best = bestCandidate();
+  }
+
+  logged << "Differential evolution for " << jobName << " finished after "
+         << count << " generations of " << population.size() << " ("
+         << (contexts.size() ? contexts.size() : 1) << " threads)."
+         << std::endl;
+  sendLog(LogLevelDebug);
+
+  contexts.clear();
+
+  reportProgress(population[best].second, &population[best].first);
+  setCandidateParameters(&population[best]);
+
+  finish();
+}
@@ -0,0 +1,73 @@
+//
+//  DifferentialEvolution.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __cppxfel__DifferentialEvolution__
+#define __cppxfel__DifferentialEvolution__
+
+#include <stdio.h>
+#include <random>
+#include "RefinementStrategy.h"
+#include "parameters.h"
+
+typedef std::pair<std::vector<double>, double> Candidate;
+
+/* Population-based minimiser (DE/current-to-best/1/bin). Each generation
+ * of trial candidates is scored in one batch, which runs in parallel on
+ * independent evaluation contexts if a context maker has been set. */
+
+class DifferentialEvolution : public RefinementStrategy {
+ private:
+  double mutationScale;
+  double crossoverRate;
+  double spreadScale;
+  int minPopulation;
+  int maxPopulation;
+
+  std::vector<Candidate> population;
+  std::vector<EvaluationContext> contexts;
+  bool triedContexts;
+  std::mt19937 generator;
+
+  double randomUnit();
+  int randomIndex(int count);
+  void seedGenerator();
+
+  int populationSize();
+  void initialisePopulation();
+  Candidate trialCandidate(int num, int best);
+  int bestCandidate();
+  bool converged();
+
+  bool makeContexts(int threads);
+  void evaluateCandidates(std::vector<Candidate> *candidates);
+  void setCandidateParameters(Candidate *candidate);
+  static void evaluateCandidatesWrapper(DifferentialEvolution *me,
+                                        EvaluationContext *context,
+                                        std::vector<Candidate> *candidates,
+                                        int offset, int threads);
+
+ public:
+  void init();
+  DifferentialEvolution() : RefinementStrategy() { init(); };
+  virtual void refine();
+
+  virtual void clearParameters();
+};
+
+#endif /* defined(__cppxfel__DifferentialEvolution__) */
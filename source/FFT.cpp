@@ -0,0 +1,142 @@
+//
+//  FFT.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "FFT.h"
+#include <math.h>
+#include <algorithm>
+
+int FFT::nextPowerOfTwo(int value) {
+  int power = 1;
+
+  while (power < value) {
+    power *= 2;
+  }
+
+  return power;
+}
+
+FFT::FFT(int minX, int minY) {
+  nx = nextPowerOfTwo(std::max(minX, 1));
+  ny = nextPowerOfTwo(std::max(minY, 1));
+
+  values.resize((size_t)nx * ny);
+  column.resize(ny);
+
+  /* Twiddle factors for the longest side serve the shorter one too */
+  int longest = std::max(nx, ny);
+  twiddles.resize(longest / 2);
+
+  for (int i = 0; i < longest / 2; i++) {
+    double angle = -2 * M_PI * i / longest;
+    twiddles[i] = Complex(cos(angle), sin(angle));
+  }
+}
+
+void FFT::clear() { std::fill(values.begin(), values.end(), Complex(0, 0)); }
+
+void FFT::transform(Complex *data, int length, bool inverse) {
+  /* Bit-reversal permutation */
+  for (int i = 1, j = 0; i < length; i++) {
+    int bit = length >> 1;
+
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+
+    j ^= bit;
+
+    if (i < j) {
+      std::swap(data[i], data[j]);
+    }
+  }
+
+  int longest = (int)twiddles.size() * 2;
+
+  for (int size = 2; size <= length; size *= 2) {
+    int half = size / 2;
+    int step = longest / size;
+
+    for (int start = 0; start < length; start += size) {
+      for (int k = 0; k < half; k++) {
+        Complex twiddle = twiddles[k * step];
+
+        if (inverse) {
+          twiddle = std::conj(twiddle);
+        }
+
+        Complex &even = data[start + k];
+        Complex &odd = data[start + k + half];
+        Complex product = odd * twiddle;
+
+        odd = even - product;
+        even += product;
+      }
+    }
+  }
+}
+
+void FFT::forward() {
+  for (int y = 0; y < ny; y++) {
+    transform(&values[(size_t)y * nx], nx, false);
+  }
+
+  /* Columns are copied out so that the butterflies run on contiguous data */
+  for (int x = 0; x < nx; x++) {
+    for (int y = 0; y < ny; y++) {
+      column[y] = values[(size_t)y * nx + x];
+    }
+
+    transform(&column[0], ny, false);
+
+    for (int y = 0; y < ny; y++) {
+      values[(size_t)y * nx + x] = column[y];
+    }
+  }
+}
+
+void FFT::inverse() {
+  for (int x = 0; x < nx; x++) {
+    for (int y = 0; y < ny; y++) {
+      column[y] = values[(size_t)y * nx + x];
+    }
+
+    transform(&column[0], ny, true);
+
+    for (int y = 0; y < ny; y++) {
+      values[(size_t)y * nx + x] = column[y];
+    }
+  }
+
+  double scale = 1 / ((double)nx * ny);
+
+  for (int y = 0; y < ny; y++) {
+    Complex *row = &values[(size_t)y * nx];
+    transform(row, nx, true);
+
+    for (int x = 0; x < nx; x++) {
+      row[x] *= scale;
+    }
+  }
+}
+
+void FFT::multiplyConjugate(const FFT &other) {
+  for (size_t i = 0; i < values.size(); i++) {
+    values[i] *= std::conj(other.values[i]);
+  }
+}
@@ -0,0 +1,58 @@
+//
+//  FFT.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __cppxfel__FFT__
+#define __cppxfel__FFT__
+
+#include <complex>
+#include <vector>
+
+typedef std::complex<double> Complex;
+
+/* Two-dimensional radix-2 complex FFT, in place, on a grid whose sides are
+ * rounded up to powers of two. Values are stored row by row, x fastest. */
+
+class FFT {
+ private:
+  int nx;
+  int ny;
+  std::vector<Complex> values;
+  std::vector<Complex> column;
+  std::vector<Complex> twiddles;
+
+  void transform(Complex *data, int length, bool inverse);
+
+ public:
+  FFT(int minX, int minY);
+
+  static int nextPowerOfTwo(int value);
+
+  int getNx() { return nx; }
+
+  int getNy() { return ny; }
+
+  Complex &element(int x, int y) { return values[(size_t)y * nx + x]; }
+
+  void clear();
+  void forward();
+  void inverse();
+  void multiplyConjugate(const FFT &other);
+};
+
+#endif /* defined(__cppxfel__FFT__) */
@@ -481,6 +481,7 @@ void FileParser::generateCodeList() {
     codeMap["step_search"] = 0;
     codeMap["nelder_mead"] = 1;
     codeMap["grid_search"] = 2;
+    codeMap["differential_evolution"] = 3;
     codeMaps["MINIMIZATION_METHOD"] = codeMap;
   }
   {
@@ -488,6 +489,7 @@ void FileParser::generateCodeList() {
     codeMap["average"] = 0;
     codeMap["reference"] = 1;
     codeMap["b_factor"] = 2;
+    codeMap["resolution_shells"] = 5;
     codeMaps["SCALING_STRATEGY"] = codeMap;
   }
   {
@@ -525,6 +527,7 @@ void FileParser::generateCodeList() {
     codeMap["blob"] = 0;
     codeMap["peakfinder6"] = 1;
     codeMap["none"] = 2;
+    codeMap["dispersion"] = 3;
     codeMaps["SPOT_FINDING_ALGORITHM"] = codeMap;
   }
 }
@@ -561,6 +564,7 @@ void FileParser::generateCategories() {
   easyIndexingParameters.push_back("INDEXING_RLP_SIZE");
   easyIndexingParameters.push_back("MAX_RECIPROCAL_DISTANCE");
   easyIndexingParameters.push_back("INDEXING_TIME_LIMIT");
+  easyIndexingParameters.push_back("INDEXING_SEED_THREADS");
   easyIndexingParameters.push_back("SOLUTION_ATTEMPTS");
 
   std::vector<std::string> hardIndexingParameters;
@@ -696,6 +700,7 @@ void FileParser::generateCategories() {
   postRefGeneral.push_back("REFINEMENT_INTENSITY_THRESHOLD");
   postRefGeneral.push_back("PARTIALITY_CUTOFF");
   postRefGeneral.push_back("OUTPUT_INDIVIDUAL_CYCLES");
+  postRefGeneral.push_back("REFINED_MTZ_FINAL_CYCLE");
   postRefGeneral.push_back("DEFAULT_TARGET_FUNCTION");
   postRefGeneral.push_back("BINARY_PARTIALITY");
   postRefGeneral.push_back("INITIAL_MTZ");
@@ -793,13 +798,36 @@ void FileParser::generateHelpList() {
 
   helpMap["STOP_REFINEMENT"] =
       "If set to OFF, post-refinement will continue indefinitely. Default ON.";
+  helpMap["SKIP_CONVERGED_CRYSTALS"] =
+      "Track convergence of each crystal across post-refinement cycles. A "
+      "crystal has converged once a cycle moves every parameter by less than "
+      "its tolerance and changes the score by less than "
+      "CONVERGENCE_SCORE_TOLERANCE. Converged crystals are then skipped, "
+      "apart from a short verification pass every CONVERGED_VERIFY_INTERVAL "
+      "cycles. Default OFF.";
+  helpMap["CONVERGED_VERIFY_INTERVAL"] =
+      "Integer x – converged crystals get a short verification refinement "
+      "every x cycles and are skipped otherwise. If the verification moves "
+      "the crystal, it returns to full refinement. Set to 0 to never verify. "
+      "Default 2.";
+  helpMap["CONVERGENCE_SCORE_TOLERANCE"] =
+      "Largest fractional change in a crystal's refinement score for which "
+      "the crystal is considered converged. Default 0.01.";
   helpMap["MINIMIZATION_METHOD"] =
       "Minimization method used for various minimization events throughout the "
       "software. Grid search NOT recommended for normal use but for debugging "
-      "purposes.";
+      "purposes. Differential evolution scores a population of trial "
+      "parameters each generation, which is evaluated in parallel during "
+      "geometry refinement (see PARALLEL_GRID_SEARCH).";
   helpMap["NELDER_MEAD_CYCLES"] =
       "If using Nelder Mead, specify how many cycles are carried out "
-      "(convergence criteria not implemented).";
+      "(convergence criteria not implemented). For differential evolution, "
+      "the maximum number of generations.";
+  helpMap["CACHE_EVALUATIONS"] =
+      "Remember the score for each set of parameter values tested during a "
+      "minimization, so that revisited points (common in step and grid "
+      "searches) are not evaluated again. Hit rates are reported in the "
+      "progress log. Default OFF.";
   helpMap["MEDIAN_WAVELENGTH"] =
       "Calculate starting X-ray beam wavelength for post-refinement of an "
       "image using the median excitation wavelength of all strong reflections. "
@@ -819,6 +847,14 @@ void FileParser::generateHelpList() {
       "Do not attempt to check alternative indexing solutions if set to ON. "
       "Good if the indexing ambiguity has been resolved by some other means. "
       "Default OFF.";
+  helpMap["AMBIGUITY_PARTNERS"] =
+      "Number of randomly chosen crystals each crystal is correlated with "
+      "when breaking the indexing ambiguity, instead of every other crystal. "
+      "Useful for large data sets. Default 0 (all pairs).";
+  helpMap["AMBIGUITY_EMBEDDING"] =
+      "Start breaking the indexing ambiguity from an embedding of the crystals "
+      "fitted to their pairwise correlations (as in Brehm & Diederichs) "
+      "instead of from random choices. Default OFF.";
   helpMap["PARTIALITY_CUTOFF"] =
       "If reflections are calculated with a cutoff below a certain partiality "
       "they are not included in target function calculation or merging. "
@@ -826,6 +862,42 @@ void FileParser::generateHelpList() {
   helpMap["SCALING_STRATEGY"] =
       "number representing the strategy for scaling individual crystals on "
       "each merging cycle. Default reference.";
+  helpMap["SCALING_RESOLUTION_BINS"] =
+      "Number of resolution shells given their own scale factor against the "
+      "reference when SCALING_STRATEGY is 5 (resolution_shells). Default 10.";
+  helpMap["MERGE_MEMORY_LIMIT"] =
+      "If set, merging runs out of core: observations are written to spill "
+      "files on disk as crystals are grouped, then read back and merged a "
+      "range of reflections at a time, keeping roughly x MB of observations "
+      "in memory. Gives the same result as an in-memory merge. Default 0 "
+      "(merge in memory).";
+  helpMap["MERGE_SPILL_DIRECTORY"] =
+      "Directory (ideally on local disk) for the spill files written when "
+      "MERGE_MEMORY_LIMIT is set. Default is the working directory.";
+  helpMap["MERGE_INCREMENTAL"] =
+      "For the MERGE command: keep the scaled observations of every merged "
+      "crystal in MERGE_STATE_FILE, and on the next MERGE only load, scale "
+      "and group crystals which are not in it yet (matched by filename). "
+      "Reflections without new observations keep their merged value and are "
+      "not outlier-rejected again. Half sets alternate by the order in which "
+      "crystals were added. Intended for merging continuously during data "
+      "collection; delete the state file if crystals are reprocessed. Default "
+      "OFF.";
+  helpMap["MERGE_STATE_FILE"] =
+      "File holding the merge state for MERGE_INCREMENTAL. Default "
+      "merge_state.dat in the output directory.";
+  helpMap["MERGE_SHARD"] =
+      "Integer x – with MERGE_SHARD_COUNT, the MERGE command only reads and "
+      "groups every crystal whose position in the list (sorted by MTZ "
+      "filename) is x modulo the shard count (from 0), and writes the scaled "
+      "observations to a shard file in the output directory instead of "
+      "merging. Run one process per shard on a shared filesystem, then "
+      "REDUCE_MERGE_SHARDS, which reads only the shard files and stops if "
+      "any crystal is missing or duplicated. Default -1 (no sharding).";
+  helpMap["MERGE_SHARD_COUNT"] =
+      "Number of shards the crystal list is split into for MERGE_SHARD and "
+      "REDUCE_MERGE_SHARDS. All shards and the reduce must use the same "
+      "image list and settings. Default 0.";
   helpMap["MINIMUM_REFLECTION_CUTOFF"] =
       "If a crystal refines to have fewer than x reflections then it is not "
       "included in the final merge. Default 30.";
@@ -1134,6 +1206,9 @@ void FileParser::generateHelpList() {
   helpMap["BINARY_PARTIALITY"] =
       "If a varying partiality between 0 and 1 is not working for you, maybe a "
       "BINARY_PARTIALITY would work better.";
+  helpMap["REFINED_MTZ_FINAL_CYCLE"] =
+      "Only write out the refined ref-*.mtz file of each crystal once "
+      "refinement has finished, rather than after every cycle. Default OFF.";
   helpMap["DETECTOR_LIST"] =
       "Path to a file containing detector information. Should use one of the "
       "formats specified in GEOMETRY_FORMAT.";
@@ -1160,7 +1235,26 @@ void FileParser::generateHelpList() {
 
   helpMap["SPOT_FINDING_ALGORITHM"] =
       "Choose which algorithm is used for spot-finding. Blob-finding is highly "
-      "recommended.";
+      "recommended. Dispersion uses the local mean and variance of the "
+      "background, as in DIALS.";
+  helpMap["SPOT_FINDING_PANEL_THREADS"] =
+      "Number of threads searching the panels of each image for spots. "
+      "Images are already spread over MAX_THREADS, so only raise this when "
+      "there are fewer images than threads. Default 1.";
+  helpMap["SPOT_FINDING_INTEGRAL_BACKGROUND"] =
+      "For the quick spot finder: take the background mean and variance "
+      "around each candidate pixel from running-sum (integral) tables built "
+      "once per image, instead of looping over the background pixels of "
+      "each candidate. Faster for large probe sizes. Default OFF.";
+  helpMap["SPOT_FINDING_KERNEL_SIZE"] =
+      "Half-width of the window around each pixel used to measure the local "
+      "background for dispersion spot-finding.";
+  helpMap["SPOT_FINDING_SIGMA_BACKGROUND"] =
+      "Dispersion spot-finding: sigma above Poisson noise which the local "
+      "variance/mean ratio must reach for a pixel to be signal.";
+  helpMap["SPOT_FINDING_SIGMA_STRONG"] =
+      "Dispersion spot-finding: sigma above the local mean which a pixel must "
+      "reach to be signal.";
   helpMap["IMAGE_MIN_SPOT_INTENSITY"] =
       "Do not attempt to perform spot-finding calculation on a pixel intensity "
       "below this value.";
@@ -1187,6 +1281,11 @@ void FileParser::generateHelpList() {
   helpMap["INDEXING_TIME_LIMIT"] =
       "Maximum number of seconds after which cppxfel will give up on indexing "
       "a lattice.";
+  helpMap["INDEXING_SEED_THREADS"] =
+      "Number of threads exploring seed pairs within each image during TakeTwo "
+      "indexing, on top of MAX_THREADS images at once. Pairs are still tried "
+      "in the serial order, so results do not depend on this number. "
+      "Default 1 (serial search).";
   helpMap["MAX_RECIPROCAL_DISTANCE"] =
       "Maximum distance between two potential reciprocal lattice points used "
       "for TakeTwo indexing.";
@@ -1213,6 +1312,12 @@ void FileParser::generateHelpList() {
       "continuing with geometry refinement. At the moment it will refine "
       "against the pseudo-powder pattern. Not completely tested, default is "
       "not to be set.";
+  helpMap["PARALLEL_GRID_SEARCH"] =
+      "During geometry refinement, evaluate grid search points (and "
+      "differential evolution populations) in parallel "
+      "on copies of the detector and its reflections, sharing the threads "
+      "between the panels being refined. Results do not depend on the number "
+      "of threads. Default ON.";
   helpMap["EXPECTED_GEOMETRY_MOVEMENT"] =
       "Default increment for geometry refinement. The default is 0.02, but if "
       "you suspect convergence is too slow or you are driving into a local "
@@ -1232,14 +1337,19 @@ void FileParser::generateFunctionList() {
   parserMap["MINIMUM_CYCLES"] = simpleInt;
   parserMap["MAXIMUM_CYCLES"] = simpleInt;
   parserMap["STOP_REFINEMENT"] = simpleBool;
+  parserMap["SKIP_CONVERGED_CRYSTALS"] = simpleBool;
+  parserMap["CONVERGED_VERIFY_INTERVAL"] = simpleInt;
+  parserMap["CONVERGENCE_SCORE_TOLERANCE"] = simpleFloat;
   // parserMap["MERGE_MEDIAN"] = simpleBool;
   parserMap["READ_REFINED_MTZS"] = simpleBool;
 
   parserMap["SET_SIGMA_TO_UNITY"] = simpleBool;
   parserMap["APPLY_UNREFINED_PARTIALITY"] = simpleBool;
   parserMap["BINARY_PARTIALITY"] = simpleBool;
+  parserMap["REFINED_MTZ_FINAL_CYCLE"] = simpleBool;
   parserMap["MINIMIZATION_METHOD"] = simpleInt;
   parserMap["NELDER_MEAD_CYCLES"] = simpleInt;
+  parserMap["CACHE_EVALUATIONS"] = simpleBool;
   parserMap["MEDIAN_WAVELENGTH"] = simpleBool;
   parserMap["WAVELENGTH_RANGE"] = doubleVector;
   parserMap["ALLOW_TRUST"] = simpleBool;
@@ -1264,6 +1374,8 @@ void FileParser::generateFunctionList() {
   parserMap["REFINEMENT_INTENSITY_THRESHOLD"] =
       simpleFloat;  // merge with intensity threshold?
   parserMap["TRUST_INDEXING_SOLUTION"] = simpleBool;
+  parserMap["AMBIGUITY_PARTNERS"] = simpleInt;
+  parserMap["AMBIGUITY_EMBEDDING"] = simpleBool;
   parserMap["CUSTOM_AMBIGUITY"] = doubleVector;
   parserMap["R_FACTOR_THRESHOLD"] = simpleFloat;
   parserMap["REINITIALISE_WAVELENGTH"] = simpleBool;
@@ -1334,9 +1446,16 @@ void FileParser::generateFunctionList() {
   parserMap["RECALCULATE_WAVELENGTHS"] = simpleBool;
   parserMap["MERGE_ANOMALOUS"] = simpleBool;
   parserMap["SCALING_STRATEGY"] = simpleInt;
+  parserMap["SCALING_RESOLUTION_BINS"] = simpleInt;
   parserMap["MINIMUM_REFLECTION_CUTOFF"] = simpleInt;
   parserMap["MINIMUM_MULTIPLICITY"] = simpleInt;
   parserMap["REJECT_BELOW_SCALE"] = simpleFloat;
+  parserMap["MERGE_MEMORY_LIMIT"] = simpleFloat;
+  parserMap["MERGE_SPILL_DIRECTORY"] = simpleString;
+  parserMap["MERGE_INCREMENTAL"] = simpleBool;
+  parserMap["MERGE_STATE_FILE"] = simpleString;
+  parserMap["MERGE_SHARD"] = simpleInt;
+  parserMap["MERGE_SHARD_COUNT"] = simpleInt;
 
   // Indexing parameters
 
@@ -1406,6 +1525,7 @@ void FileParser::generateFunctionList() {
   parserMap["MINIMUM_SOLUTION_NETWORK_COUNT"] = simpleInt;
   parserMap["NETWORK_TRIAL_LIMIT"] = simpleInt;
   parserMap["INDEXING_TIME_LIMIT"] = simpleInt;
+  parserMap["INDEXING_SEED_THREADS"] = simpleInt;
   parserMap["MAX_LATTICES_PER_IMAGE"] = simpleInt;
   parserMap["CHECKING_COMMON_SPOTS"] = simpleBool;
   parserMap["EXCLUDE_WEAKEST_SPOT_FRACTION"] = simpleFloat;
@@ -1433,7 +1553,13 @@ void FileParser::generateFunctionList() {
   parserMap["SPOT_FINDING_MIN_PIXELS"] = simpleInt;
   parserMap["SPOT_FINDING_SIGNAL_TO_NOISE"] = simpleFloat;
   parserMap["SPOT_FINDING_MAX_PIXELS"] = simpleInt;
+  parserMap["SPOT_FINDING_INTEGRAL_BACKGROUND"] = simpleBool;
+  parserMap["SPOT_FINDING_MAX_HITS"] = simpleInt;
+  parserMap["SPOT_FINDING_PANEL_THREADS"] = simpleInt;
   parserMap["SPOT_FINDING_ALGORITHM"] = simpleInt;
+  parserMap["SPOT_FINDING_KERNEL_SIZE"] = simpleInt;
+  parserMap["SPOT_FINDING_SIGMA_BACKGROUND"] = simpleFloat;
+  parserMap["SPOT_FINDING_SIGMA_STRONG"] = simpleFloat;
   //   parserMap["SPOTS_ARE_RECIPROCAL_COORDINATES"] = simpleBool;
 
   parserMap["IGNORE_MISSING_IMAGES"] = simpleBool;
@@ -1449,6 +1575,7 @@ void FileParser::generateFunctionList() {
   parserMap["PNG_HEIGHT"] = simpleInt;
   parserMap["DRAW_GEOMETRY_PNGS"] = simpleBool;
   parserMap["SWEEP_DETECTOR_DISTANCE"] = doubleVector;
+  parserMap["PARALLEL_GRID_SEARCH"] = simpleBool;
   parserMap["ENABLE_IMAGE_CSVS"] = simpleBool;
 
   parserMap["TRUST_GLOBAL_GEOMETRY"] = simpleBool;
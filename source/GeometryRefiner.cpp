@@ -56,12 +56,25 @@ std::string stringForScoreType(GeometryScoreType type) {
   return typeString;
 }
 
+int GeometryRefiner::gridSearchThreads() {
+  if (!FileParser::getKey("PARALLEL_GRID_SEARCH", true)) {
+    return 1;
+  }
+
+  /* Share the cores between the detectors being refined at once */
+  int maxThreads = FileParser::getMaxThreads();
+  int threads = maxThreads / std::max(activeWorkers, 1);
+
+  return std::max(threads, 1);
+}
+
 RefinementGridSearchPtr GeometryRefiner::makeGridRefiner(
     DetectorPtr detector, GeometryScoreType type) {
   RefinementGridSearchPtr strategy =
       RefinementGridSearchPtr(new RefinementGridSearch());
   strategy->setGridLength(31);
   strategy->setVerbose(false);
+  strategy->setBatchThreads(gridSearchThreads());
 
   if (type == GeometryScoreTypePeakSearch) {
     strategy->setEvaluationFunction(Detector::peakScoreWrapper, &*detector);
@@ -83,6 +96,7 @@ RefinementGridSearchPtr GeometryRefiner::makeGridRefiner(
     }
 
     strategy->setEvaluationFunction(IndexManager::pseudoAngleScore, &*aManager);
+    strategy->setContextMaker(IndexManager::makeEvaluationContext);
 
     return strategy;
   } else {
@@ -90,10 +104,12 @@ RefinementGridSearchPtr GeometryRefiner::makeGridRefiner(
       case GeometryScoreTypeInterMiller:
         strategy->setEvaluationFunction(Detector::millerScoreWrapper,
                                         &*detector);
+        strategy->setContextMaker(Detector::makeMillerContext);
         break;
       case GeometryScoreTypeIntraMiller:
         strategy->setEvaluationFunction(Detector::millerStdevScoreWrapper,
                                         &*detector);
+        strategy->setContextMaker(Detector::makeMillerContext);
         break;
       default:
         break;
@@ -113,6 +129,7 @@ RefinementStrategyPtr GeometryRefiner::makeRefiner(DetectorPtr detector,
                        ")");
 
   strategy->setVerbose(false);
+  strategy->setBatchThreads(gridSearchThreads());
 
   IndexManagerPtr aManager = IndexManagerPtr(new IndexManager(images));
 
@@ -128,22 +145,27 @@ RefinementStrategyPtr GeometryRefiner::makeRefiner(DetectorPtr detector,
   switch (type) {
     case GeometryScoreTypeInterMiller:
       strategy->setEvaluationFunction(Detector::millerScoreWrapper, &*detector);
+      strategy->setContextMaker(Detector::makeMillerContext);
       break;
     case GeometryScoreTypeIntraMiller:
       strategy->setEvaluationFunction(Detector::millerStdevScoreWrapper,
                                       &*detector);
+      strategy->setContextMaker(Detector::makeMillerContext);
       break;
     case GeometryScoreTypeInterpanel:
       aManager->setPseudoScoreType(PseudoScoreTypeInterPanel);
       strategy->setEvaluationFunction(IndexManager::pseudoScore, &*aManager);
+      strategy->setContextMaker(IndexManager::makeEvaluationContext);
       break;
     case GeometryScoreTypeBeamCentre:
       aManager->setPseudoScoreType(PseudoScoreTypeBeamCentre);
       strategy->setEvaluationFunction(IndexManager::pseudoScore, &*aManager);
+      strategy->setContextMaker(IndexManager::makeEvaluationContext);
       break;
     case GeometryScoreTypeIntrapanel:
       aManager->setPseudoScoreType(PseudoScoreTypeIntraPanel);
       strategy->setEvaluationFunction(IndexManager::pseudoScore, &*aManager);
+      strategy->setContextMaker(IndexManager::makeEvaluationContext);
       break;
     default:
       break;
@@ -155,6 +177,7 @@ RefinementStrategyPtr GeometryRefiner::makeRefiner(DetectorPtr detector,
 GeometryRefiner::GeometryRefiner() {
   refinementEvent = 0;
   cycleNum = 0;
+  activeWorkers = 1;
   lastIntraScore = 0;
   lastInterScore = 0;
   lastInterAngleScore = 0;
@@ -465,6 +488,7 @@ void GeometryRefiner::refineDetectorStrategyWrapper(GeometryRefiner *me,
                                                     GeometryScoreType type,
                                                     int strategyType) {
   int maxThreads = FileParser::getMaxThreads();
+  me->activeWorkers = std::min(maxThreads, (int)me->refineQueue.size());
 
   boost::thread_group threads;
 
@@ -475,6 +499,7 @@ void GeometryRefiner::refineDetectorStrategyWrapper(GeometryRefiner *me,
   }
 
   threads.join_all();
+  me->activeWorkers = 1;
 
   std::ostringstream logged;
   logged << "Finished a round." << std::endl;
@@ -798,11 +823,13 @@ void GeometryRefiner::gridSearchDetectorDistance(DetectorPtr detector,
   strategy->setGridLength(confidence * 2 + 1);
   strategy->setVerbose(true);
   strategy->setJobName("Wide sweep detector " + detector->getTag());
+  strategy->setBatchThreads(gridSearchThreads());
 
   IndexManagerPtr aManager = IndexManagerPtr(new IndexManager(images));
   aManager->setActiveDetector(detector, GeometryScoreTypeIntrapanel);
   aManager->setPseudoScoreType(PseudoScoreTypeIntraPanel);
   strategy->setEvaluationFunction(IndexManager::pseudoScore, &*aManager);
+  strategy->setContextMaker(IndexManager::makeEvaluationContext);
 
   strategy->refine();
 }
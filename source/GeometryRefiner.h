@@ -20,6 +20,7 @@ class GeometryRefiner : public LoggableObject {
   IndexManagerPtr manager;
   int refinementEvent;
   int cycleNum;
+  int activeWorkers;
   bool firstCycle;
   bool refineDetectorStrategy(DetectorPtr detector, GeometryScoreType type,
                               int strategyType);
@@ -50,6 +51,7 @@ class GeometryRefiner : public LoggableObject {
   bool intraPanelMillerSearch(DetectorPtr detector, GeometryScoreType type);
   void peakSearchDetector(DetectorPtr detector);
 
+  int gridSearchThreads();
   RefinementGridSearchPtr makeGridRefiner(DetectorPtr detector,
                                           GeometryScoreType type);
   RefinementStrategyPtr makeRefiner(DetectorPtr detector,
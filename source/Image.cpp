@@ -6,6 +6,7 @@
  */
 
 #include "Image.h"
+#include <boost/thread/thread.hpp>
 #include <cmath>
 #include <fstream>
 #include <iostream>
@@ -17,11 +18,14 @@
 #include "Logger.h"
 #include "Miller.h"
 #include "PNGFile.h"
+#include "ScratchArena.h"
 #include "Shoebox.h"
 #include "SolventMask.h"
 #include "Spot.h"
 #include "SpotFinderCorrelation.h"
+#include "SpotFinderDispersion.h"
 #include "SpotFinderQuick.h"
+#include "SpotHash.h"
 #include "StatisticsManager.h"
 #include "Vector.h"
 #include "misc.h"
@@ -634,7 +638,13 @@ double Image::integrateFitBackgroundPlane(int x, int y, ShoeboxPtr shoebox,
 
   shoebox->sideLengths(&slowSide, &fastSide);
 
-  std::vector<double> xxs, xys, xs, yys, ys, xzs, yzs, zs, allXs, allYs, allZs;
+  /* Background pixels go into buffers kept between reflections */
+  ScratchArena *arena = ScratchArena::forThread();
+  size_t maxPixels = (size_t)slowSide * fastSide;
+  std::vector<double> &allXs = arena->doubles(0, maxPixels);
+  std::vector<double> &allYs = arena->doubles(1, maxPixels);
+  std::vector<double> &allZs = arena->doubles(2, maxPixels);
+  size_t count = 0;
 
   for (int i = 0; i < slowSide; i++) {
     int panelPixelX = (i - centreX) + x;
@@ -650,60 +660,56 @@ double Image::integrateFitBackgroundPlane(int x, int y, ShoeboxPtr shoebox,
 
       if (flag == MaskForeground || flag == MaskNeither) continue;
 
-      double newX = panelPixelX;
-      double newY = panelPixelY;
-      double newZ = valueAt(panelPixelX, panelPixelY);
-
-      allXs.push_back(newX);
-      allYs.push_back(newY);
-      allZs.push_back(newZ);
+      allXs[count] = panelPixelX;
+      allYs[count] = panelPixelY;
+      allZs[count] = valueAt(panelPixelX, panelPixelY);
+      count++;
     }
   }
 
+  allXs.resize(count);
+  allYs.resize(count);
+  allZs.resize(count);
+
   double meanZ = weighted_mean(&allZs);
   double stdevZ = standard_deviation(&allZs);
   int rejected = 0;
 
+  double xxSum = 0;
+  double yySum = 0;
+  double xySum = 0;
+  double xSum = 0;
+  double ySum = 0;
+  double zSum = 0;
+  double xzSum = 0;
+  double yzSum = 0;
+  int kept = 0;
+
   for (int i = 0; i < allZs.size(); i++) {
+    double newX = allXs[i];
+    double newY = allYs[i];
     double newZ = allZs[i];
     double diffZ = fabs(newZ - meanZ);
 
     if (diffZ > stdevZ * 2.2) {
-      allXs.erase(allXs.begin() + i);
-      allYs.erase(allYs.begin() + i);
-      allZs.erase(allZs.begin() + i);
-      i--;
       rejected++;
+      continue;
     }
+
+    xxSum += newX * newX;
+    yySum += newY * newY;
+    xySum += newX * newY;
+    xSum += newX;
+    ySum += newY;
+    zSum += newZ;
+    xzSum += newX * newZ;
+    yzSum += newY * newZ;
+    kept++;
   }
 
   logged << "Rejected background pixels: " << rejected << std::endl;
   sendLog(LogLevelDebug);
 
-  for (int i = 0; i < allZs.size(); i++) {
-    double newX = allXs[i];
-    double newY = allYs[i];
-    double newZ = allZs[i];
-
-    xxs.push_back(newX * newX);
-    yys.push_back(newY * newY);
-    xys.push_back(newX * newY);
-    xs.push_back(newX);
-    ys.push_back(newY);
-    xzs.push_back(newX * newZ);
-    yzs.push_back(newY * newZ);
-    zs.push_back(newZ);
-  }
-
-  double xxSum = sum(xxs);
-  double yySum = sum(yys);
-  double xySum = sum(xys);
-  double xSum = sum(xs);
-  double ySum = sum(ys);
-  double zSum = sum(zs);
-  double xzSum = sum(xzs);
-  double yzSum = sum(yzs);
-
   MatrixPtr matrix = MatrixPtr(new Matrix());
 
   matrix->components[0] = xxSum;
@@ -716,7 +722,7 @@ double Image::integrateFitBackgroundPlane(int x, int y, ShoeboxPtr shoebox,
 
   matrix->components[8] = xSum;
   matrix->components[9] = ySum;
-  matrix->components[10] = xs.size();
+  matrix->components[10] = kept;
 
   vec b = new_vector(xzSum, yzSum, zSum);
 
@@ -1113,6 +1119,8 @@ void Image::findSpots() {
     spotFinder = SpotFinderPtr(new SpotFinderQuick(shared_from_this()));
   } else if (algorithm == 0) {
     spotFinder = SpotFinderPtr(new SpotFinderCorrelation(shared_from_this()));
+  } else if (algorithm == 3) {
+    spotFinder = SpotFinderPtr(new SpotFinderDispersion(shared_from_this()));
   } else {
     return;
   }
@@ -1150,56 +1158,55 @@ void Image::weedOutCloseSpots() {
     return;
   }
 
-  std::vector<size_t> indicesToDelete;
   double tooCloseDistance = IndexingSolution::getMinDistance() * 0.8;
 
-  for (int i = 0; i < spotCount() - 1; i++) {
-    bool keepGoingI = true;
+  if (tooCloseDistance <= 0) {
+    return;
+  }
 
-    SpotPtr firstSpot = spot(i);
+  std::vector<vec> positions(spots.size());
 
-    for (int j = i + 1; j < spotCount(); j++) {
-      bool keepGoingJ = true;
+  for (int i = 0; i < spots.size(); i++) {
+    positions[i] = spots[i]->estimatedVector();
+  }
 
-      for (int check = 0; check < indicesToDelete.size(); check++) {
-        if (indicesToDelete[check] == i) {
-          keepGoingI = false;
-        }
+  /* Each spot is paired off with the first later spot still standing
+   * which is too close to it, and both are struck off */
+  SpotHash hash(positions, tooCloseDistance);
+  std::vector<int> near;
+  int rejected = 0;
 
-        if (indicesToDelete[check] == j) {
-          keepGoingJ = false;
-        }
-      }
+  for (int i = 0; i < positions.size(); i++) {
+    if (!hash.isKept(i)) continue;
 
-      if (!keepGoingI) {
-        break;
-      }
+    hash.findNear(positions[i], tooCloseDistance, &near);
+    int partner = -1;
 
-      if (!keepGoingJ) {
-        continue;
-      }
+    for (int k = 0; k < near.size(); k++) {
+      int j = near[k];
 
-      SpotPtr secondSpot = spot(j);
+      if (j <= i || (partner >= 0 && j > partner)) continue;
 
-      vec firstVec = firstSpot->estimatedVector();
-      vec secondVec = secondSpot->estimatedVector();
-      take_vector_away_from_vector(firstVec, &secondVec);
+      vec difference = positions[j];
+      take_vector_away_from_vector(positions[i], &difference);
 
-      double distance = length_of_vector(secondVec);
-      if (distance < tooCloseDistance) {
-        indicesToDelete.push_back(i);
-        indicesToDelete.push_back(j);
+      if (length_of_vector(difference) < tooCloseDistance) {
+        partner = j;
       }
     }
+
+    if (partner >= 0) {
+      hash.remove(i);
+      hash.remove(partner);
+      rejected += 2;
+    }
   }
 
-  logged << "Rejected " << indicesToDelete.size()
-         << " spots for being too close." << std::endl;
+  logged << "Rejected " << rejected << " spots for being too close."
+         << std::endl;
   sendLog();
 
-  for (int i = (int)indicesToDelete.size() - 1; i >= 0; i--) {
-    spots.erase(spots.begin() + i);
-  }
+  hash.compact(&spots);
 }
 
 void Image::processSpotList() {
@@ -1372,37 +1379,38 @@ void Image::compileDistancesFromSpots(double maxReciprocalDistance,
 
   if (spots.size() == 0) return;
 
-  for (int i = 0; i < spots.size() - 1; i++) {
-    vec spotPos1 = spots[i]->estimatedVector();
+  /* Reciprocal positions are worked out once per spot, not once per pair.
+   * Only the first spot of a pair has to pass the resolution limits. */
+  std::vector<vec> positions(spots.size());
+  std::vector<char> usable(spots.size());
 
-    if (minResolution != 0) {
-      if (length_of_vector(spotPos1) < 1 / minResolution) continue;
-    }
+  for (int i = 0; i < spots.size(); i++) {
+    positions[i] = spots[i]->estimatedVector();
+    double length = length_of_vector(positions[i]);
 
-    if (maxResolution > 0) {
-      if (length_of_vector(spotPos1) > 1 / maxResolution) continue;
-    }
+    usable[i] = !((minResolution != 0 && length < 1 / minResolution) ||
+                  (maxResolution > 0 && length > 1 / maxResolution));
+  }
 
-    for (int j = i + 1; j < spots.size(); j++) {
-      vec spotPos2 = spots[j]->estimatedVector();
+  std::vector<std::pair<int, int> > pairs;
+  findClosePairs(positions, usable, maxReciprocalDistance, &pairs);
 
-      bool close = within_vicinity(spotPos1, spotPos2, maxReciprocalDistance);
+  spotVectors.reserve(pairs.size());
 
-      if (close) {
-        SpotVectorPtr newVec =
-            SpotVectorPtr(new SpotVector(spots[i], spots[j]));
+  for (int i = 0; i < pairs.size(); i++) {
+    int first = pairs[i].first;
+    int second = pairs[i].second;
 
-        double distance = newVec->distance();
+    SpotVectorPtr newVec =
+        SpotVectorPtr(new SpotVector(spots[first], spots[second]));
 
-        if (distance == 0) continue;
+    double distance = newVec->distance();
 
-        if (distance > maxReciprocalDistance) continue;
+    if (distance == 0) continue;
 
-        spotVectors.push_back(newVec);
-      }
-    }
+    if (distance > maxReciprocalDistance) continue;
 
-    sendLog(LogLevelDetailed);
+    spotVectors.push_back(newVec);
   }
 
   if (filter) {
@@ -1416,6 +1424,40 @@ void Image::compileDistancesFromSpots(double maxReciprocalDistance,
   sendLog();
 }
 
+void Image::findClosePairs(std::vector<vec> &positions,
+                           std::vector<char> &usable, double maxDistance,
+                           std::vector<std::pair<int, int> > *pairs) {
+  pairs->clear();
+
+  if (positions.size() < 2 || maxDistance <= 0) {
+    return;
+  }
+
+  /* Cells as wide as the largest distance, so that a spot's partners can
+   * only be in its own or the 26 neighbouring cells */
+  SpotHash hash(positions, maxDistance);
+  std::vector<int> near;
+
+  for (int i = 0; i < positions.size(); i++) {
+    if (!usable[i]) continue;
+
+    hash.findNear(positions[i], maxDistance, &near);
+
+    for (int k = 0; k < near.size(); k++) {
+      int j = near[k];
+
+      if (j <= i) continue;
+
+      if (within_vicinity(positions[i], positions[j], maxDistance)) {
+        pairs->push_back(std::make_pair(i, j));
+      }
+    }
+  }
+
+  /* Same order as comparing every pair in turn */
+  std::sort(pairs->begin(), pairs->end());
+}
+
 bool solutionBetterThanSolution(IndexingSolutionPtr one,
                                 IndexingSolutionPtr two) {
   return (one->spotVectorCount() > two->spotVectorCount());
@@ -1673,9 +1715,27 @@ IndexingSolutionStatus Image::tryIndexingSolution(
 }
 
 IndexingSolutionStatus Image::extendIndexingSolution(
-    IndexingSolutionPtr solutionPtr, std::vector<SpotVectorPtr> existingVectors,
-    int *failures, int added) {
+    IndexingSolutionPtr solutionPtr,
+    std::vector<SpotVectorPtr> existingVectors) {
+  SeedGrowth growth = SeedGrowth();
+  bool grown = growIndexingSolution(solutionPtr, existingVectors, &growth);
+  keepBiggestFailedSolution(&growth);
+
+  if (!grown) {
+    return IndexingSolutionBranchFailure;
+  }
+
+  return tryIndexingSolution(growth.network);
+}
+
+/* Touches nothing on the image itself, so seeds may be grown on worker
+ * threads while the image is left alone */
+bool Image::growIndexingSolution(IndexingSolutionPtr solutionPtr,
+                                 std::vector<SpotVectorPtr> existingVectors,
+                                 SeedGrowth *growth, int *failures,
+                                 int added) {
   int newFailures = 0;
+  std::ostringstream growthLog;
 
   if (failures == NULL) {
     failures = &newFailures;
@@ -1684,9 +1744,9 @@ IndexingSolutionStatus Image::extendIndexingSolution(
   std::vector<SpotVectorPtr> newVectors = existingVectors;
 
   if (!solutionPtr) {
-    logged << "Solution pointer not pointing" << std::endl;
-    sendLog();
-    return IndexingSolutionBranchFailure;
+    growthLog << "Solution pointer not pointing" << std::endl;
+    Logger::mainLogger->addStream(&growthLog);
+    return false;
   }
   int newlyAdded = 1;
   int trials = 0;
@@ -1701,62 +1761,68 @@ IndexingSolutionStatus Image::extendIndexingSolution(
       trials++;
 
       if (Logger::getPriorityLevel() >= LogLevelDetailed) {
-        logged << "Starting new branch with " << added + newlyAdded
-               << " additions (trial " << trials << ")." << std::endl;
-        sendLog(LogLevelDetailed);
+        growthLog << "Starting new branch with " << added + newlyAdded
+                  << " additions (trial " << trials << ")." << std::endl;
+        Logger::mainLogger->addStream(&growthLog, LogLevelDetailed);
+        growthLog.str("");
       }
 
-      IndexingSolutionStatus success = extendIndexingSolution(
-          copyPtr, newVectors, failures, added + newlyAdded);
+      bool grown = growIndexingSolution(copyPtr, newVectors, growth, failures,
+                                        added + newlyAdded);
 
-      if (success == IndexingSolutionBranchFailure) {
-        if (!biggestFailedSolution ||
-            copyPtr->spotVectorCount() >
-                biggestFailedSolution->spotVectorCount()) {
-          biggestFailedSolution = copyPtr;
-          biggestFailedSolutionVectors = newVectors;
-        }
+      if (grown) {
+        return true;
       }
 
-      if (success != IndexingSolutionBranchFailure) {
-        return success;
-      } else {
-        if (trials >= trialLimit) {
-          (*failures)++;
-          if (Logger::getPriorityLevel() >= LogLevelDetailed) {
-            logged << "Given up this branch, too many failures." << std::endl;
-            sendLog(LogLevelDetailed);
-          }
+      if (!growth->biggestFailure ||
+          copyPtr->spotVectorCount() >
+              growth->biggestFailure->spotVectorCount()) {
+        growth->biggestFailure = copyPtr;
+        growth->biggestFailureVectors = newVectors;
+      }
 
-          return success;
+      if (trials >= trialLimit) {
+        (*failures)++;
+        if (Logger::getPriorityLevel() >= LogLevelDetailed) {
+          growthLog << "Given up this branch, too many failures." << std::endl;
+          Logger::mainLogger->addStream(&growthLog, LogLevelDetailed);
         }
+
+        return false;
       }
     }
 
     if (*failures > 3) {
-      logged << "Giving up on this thread, too many failures" << std::endl;
-      sendLog(LogLevelDetailed);
-      return IndexingSolutionBranchFailure;
+      growthLog << "Giving up on this thread, too many failures" << std::endl;
+      Logger::mainLogger->addStream(&growthLog, LogLevelDetailed);
+      return false;
     }
   }
 
   if (added >= minimumSolutionNetworkCount) {
-    IndexingSolutionStatus success = tryIndexingSolution(solutionPtr);
+    growth->network = solutionPtr;
 
-    return success;
+    return true;
   }
 
-  if (added < minimumSolutionNetworkCount) {
-    if (Logger::getPriorityLevel() >= LogLevelDetailed) {
-      logged << "Didn't go anywhere..." << std::endl;
-      sendLog(LogLevelDetailed);
-    }
+  if (Logger::getPriorityLevel() >= LogLevelDetailed) {
+    growthLog << "Didn't go anywhere..." << std::endl;
+    Logger::mainLogger->addStream(&growthLog, LogLevelDetailed);
   }
 
-  existingVectors.clear();
-  std::vector<SpotVectorPtr>().swap(existingVectors);
+  return false;
+}
+
+void Image::keepBiggestFailedSolution(SeedGrowth *growth) {
+  if (!growth->biggestFailure) {
+    return;
+  }
 
-  return IndexingSolutionBranchFailure;
+  if (!biggestFailedSolution || growth->biggestFailure->spotVectorCount() >
+                                    biggestFailedSolution->spotVectorCount()) {
+    biggestFailedSolution = growth->biggestFailure;
+    biggestFailedSolutionVectors = growth->biggestFailureVectors;
+  }
 }
 
 std::vector<double> Image::anglesBetweenVectorDistances(double distance1,
@@ -1815,23 +1881,27 @@ std::vector<double> Image::anglesBetweenVectorDistances(double distance1,
   return angles;
 }
 
-IndexingSolutionStatus Image::testSeedSolution(
-    IndexingSolutionPtr newSolution, std::vector<SpotVectorPtr> &prunedVectors,
-    int *successes) {
+bool Image::seedSolutionIsDuplicate(IndexingSolutionPtr newSolution) {
   bool similar =
       checkIndexingSolutionDuplicates(newSolution->createSolution(), false);
 
   if (similar) {
     logged << "Solution too similar to another. Continuing..." << std::endl;
     sendLog(LogLevelDetailed);
-    return IndexingSolutionTrialDuplicate;
   }
 
-  logged << "Starting a new solution..." << std::endl;
-  sendLog(LogLevelDetailed);
+  return similar;
+}
+
+IndexingSolutionStatus Image::commitSeedGrowth(SeedGrowth *growth,
+                                               int *successes) {
+  keepBiggestFailedSolution(growth);
+
+  if (!growth->network) {
+    return IndexingSolutionBranchFailure;
+  }
 
-  IndexingSolutionStatus success =
-      extendIndexingSolution(newSolution, prunedVectors);
+  IndexingSolutionStatus success = tryIndexingSolution(growth->network);
 
   if (success == IndexingSolutionTrialSuccess) {
     logged << "(" << getFilename() << ") indexing solution trial success."
@@ -1848,6 +1918,232 @@ IndexingSolutionStatus Image::testSeedSolution(
   return success;
 }
 
+IndexingSolutionStatus Image::testSeedSolution(
+    IndexingSolutionPtr newSolution, std::vector<SpotVectorPtr> &prunedVectors,
+    int *successes) {
+  if (seedSolutionIsDuplicate(newSolution)) {
+    return IndexingSolutionTrialDuplicate;
+  }
+
+  logged << "Starting a new solution..." << std::endl;
+  sendLog(LogLevelDetailed);
+
+  SeedGrowth growth = SeedGrowth();
+  growIndexingSolution(newSolution, prunedVectors, &growth);
+
+  return commitSeedGrowth(&growth, successes);
+}
+
+void Image::seedPairThread(Image *me, SeedPairQueue *queue) {
+  std::unique_lock<std::mutex> lock(queue->mutex);
+
+  while (true) {
+    while (!queue->finished && queue->next >= (int)queue->trials->size()) {
+      queue->changed.wait(lock);
+    }
+
+    if (queue->finished) {
+      return;
+    }
+
+    SeedPairTrial *trial = &(*queue->trials)[queue->next];
+    std::vector<SpotVectorPtr> *vectors = queue->vectors;
+    queue->next++;
+    lock.unlock();
+
+    trial->seeds = IndexingSolution::startingSolutionsForVectors(
+        trial->firstVector, trial->secondVector);
+    trial->growths.resize(trial->seeds.size());
+
+    for (int j = 0; j < trial->seeds.size(); j++) {
+      me->growIndexingSolution(trial->seeds[j], *vectors, &trial->growths[j]);
+    }
+
+    trial->grown = true;
+
+    lock.lock();
+    queue->done++;
+    queue->changed.notify_all();
+  }
+}
+
+/* The seed pairs which the serial search will take from (first, second)
+ * onwards, as long as the spot vectors do not change */
+void Image::planSeedPairs(int first, int second, SpotVectorPtr firstVector,
+                          int batchSize, int maxSearch,
+                          std::vector<SeedPairTrial> *trials) {
+  trials->clear();
+
+  while (trials->size() < batchSize) {
+    if (second >= first || second >= spotVectors.size()) {
+      first++;
+      second = 0;
+
+      if (first >= spotVectors.size() || first >= maxSearch) {
+        break;
+      }
+
+      firstVector = spotVectors[first];
+    }
+
+    SeedPairTrial trial = SeedPairTrial();
+    trial.first = first;
+    trial.second = second;
+    trial.firstVector = firstVector;
+    trial.secondVector = spotVectors[second];
+    trial.grown = false;
+    trials->push_back(trial);
+
+    second++;
+  }
+}
+
+void Image::growSeedPairs(SeedPairQueue *queue, int seedThreads,
+                          std::vector<SeedPairTrial> *trials,
+                          std::vector<SpotVectorPtr> *vectors) {
+  if (seedThreads <= 1) {
+    /* Grown when tried, as they always were */
+    for (int i = 0; i < trials->size(); i++) {
+      SeedPairTrial *trial = &(*trials)[i];
+      trial->seeds = IndexingSolution::startingSolutionsForVectors(
+          trial->firstVector, trial->secondVector);
+    }
+
+    return;
+  }
+
+  /* Workers share these vectors, so nothing may be left to cache */
+  for (int i = 0; i < vectors->size(); i++) {
+    (*vectors)[i]->fillCaches();
+  }
+
+  for (int i = 0; i < trials->size(); i++) {
+    (*trials)[i].firstVector->fillCaches();
+    (*trials)[i].secondVector->fillCaches();
+  }
+
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  queue->trials = trials;
+  queue->vectors = vectors;
+  queue->next = 0;
+  queue->done = 0;
+  queue->changed.notify_all();
+
+  while (queue->done < trials->size()) {
+    queue->changed.wait(lock);
+  }
+}
+
+/* Walks the seed pairs exactly as the serial search always has. Worker
+ * threads grow the seeds of the next few pairs ahead of time against the
+ * spot vectors as they stand; a growth is only used if the spot vectors
+ * are unchanged when its seed comes up, otherwise the seed is grown again
+ * here and the pairs after it are planned afresh. The outcome therefore
+ * does not depend on the number of threads. */
+void Image::exploreSeedPairs(int seedThreads, int maxSearch, int maxSuccesses,
+                             int maxLattices, int timeLimit, time_t startTime,
+                             int *successes, bool *continuing,
+                             bool *reachedTime) {
+  int batchSize = (seedThreads > 1) ? seedThreads * 4 : 1;
+  SeedPairQueue queue;
+  queue.trials = NULL;
+  queue.vectors = NULL;
+  queue.next = 0;
+  queue.done = 0;
+  queue.finished = false;
+
+  boost::thread_group threads;
+
+  for (int i = 0; i < seedThreads && seedThreads > 1; i++) {
+    boost::thread *thr = new boost::thread(seedPairThread, this, &queue);
+    threads.add_thread(thr);
+  }
+
+  std::vector<SeedPairTrial> trials;
+  std::vector<SpotVectorPtr> vectors;
+  int nextTrial = 0;
+
+  for (int i = 1; i < spotVectors.size() && i < maxSearch && *continuing;
+       i++) {
+    SpotVectorPtr spotVector1 = spotVectors[i];
+
+    for (int j = 0; j < i && j < spotVectors.size() && *continuing; j++) {
+      SpotVectorPtr spotVector2 = spotVectors[j];
+
+      bool planned = (nextTrial < trials.size() &&
+                      trials[nextTrial].firstVector == spotVector1 &&
+                      trials[nextTrial].secondVector == spotVector2 &&
+                      spotVectors == vectors);
+
+      if (!planned) {
+        vectors = spotVectors;
+        planSeedPairs(i, j, spotVector1, batchSize, maxSearch, &trials);
+        growSeedPairs(&queue, seedThreads, &trials, &vectors);
+        nextTrial = 0;
+      }
+
+      SeedPairTrial *trial = &trials[nextTrial];
+      nextTrial++;
+
+      for (int k = 0; k < trial->seeds.size(); k++) {
+        IndexingSolutionStatus status = IndexingSolutionTrialDuplicate;
+
+        if (!trial->grown || spotVectors != vectors) {
+          status = testSeedSolution(trial->seeds[k], spotVectors, successes);
+        } else if (!seedSolutionIsDuplicate(trial->seeds[k])) {
+          logged << "Starting a new solution..." << std::endl;
+          sendLog(LogLevelDetailed);
+
+          status = commitSeedGrowth(&trial->growths[k], successes);
+        }
+
+        if (status == IndexingSolutionTrialSuccess ||
+            status == IndexingSolutionTrialDuplicate) {
+          if (spotVectors.size() == 0) {
+            *continuing = false;
+            break;
+          }
+
+          logged << "(" << getFilename() << ") now on " << spotVectors.size()
+                 << " vectors." << std::endl;
+
+          if (status == IndexingSolutionTrialSuccess) {
+            i = 1;
+            j = 0;
+            (*successes)++;
+          }
+        }
+
+        if (*successes >= maxSuccesses || mtzCount() >= maxLattices) {
+          logged << "(" << getFilename()
+                 << ") - Reached maximum solution attempts." << std::endl;
+          sendLog();
+          *continuing = false;
+          break;
+        }
+      }
+    }
+
+    time_t middlecputime;
+    time(&middlecputime);
+
+    double seconds = middlecputime - startTime;
+
+    if (seconds > timeLimit) {
+      *reachedTime = true;
+      break;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.finished = true;
+    queue.changed.notify_all();
+  }
+
+  threads.join_all();
+}
+
 void Image::findIndexingSolutions() {
   if (!loadedSpots) {
     processSpotList();
@@ -1897,6 +2193,7 @@ void Image::findIndexingSolutions() {
   if (mtzCount() >= maxLattices) return;
 
   int indexingTimeLimit = FileParser::getKey("INDEXING_TIME_LIMIT", 1200);
+  int seedThreads = FileParser::getKey("INDEXING_SEED_THREADS", 1);
 
   IndexingSolution::calculateSimilarStandardVectorsForImageVectors(spotVectors);
 
@@ -1912,62 +2209,9 @@ void Image::findIndexingSolutions() {
   bool lastWasSuccessful = true;
 
   while (lastWasSuccessful) {
-    for (int i = 1; i < spotVectors.size() && i < maxSearch && continuing;
-         i++) {
-      SpotVectorPtr spotVector1 = spotVectors[i];
-
-      for (int j = 0; j < i && j < spotVectors.size() && continuing; j++) {
-        SpotVectorPtr spotVector2 = spotVectors[j];
-
-        std::vector<IndexingSolutionPtr> moreSolutions =
-            IndexingSolution::startingSolutionsForVectors(spotVector1,
-                                                          spotVector2);
-
-        for (int k = 0; k < moreSolutions.size(); k++) {
-          IndexingSolutionStatus status =
-              testSeedSolution(moreSolutions[k], spotVectors, &successes);
-
-          if (status == IndexingSolutionTrialSuccess ||
-              status == IndexingSolutionTrialDuplicate) {
-            if (spotVectors.size() == 0) {
-              continuing = false;
-              break;
-            }
-
-            logged << "(" << getFilename() << ") now on " << spotVectors.size()
-                   << " vectors." << std::endl;
-
-            if (status == IndexingSolutionTrialSuccess) {
-              i = 1;
-              j = 0;
-              successes++;
-            }
-          }
-
-          if (successes >= maxSuccesses || mtzCount() >= maxLattices) {
-            logged << "(" << getFilename()
-                   << ") - Reached maximum solution attempts." << std::endl;
-            sendLog();
-            continuing = false;
-            break;
-          }
-        }
-
-        moreSolutions.clear();
-        std::vector<IndexingSolutionPtr>().swap(moreSolutions);
-      }
-
-      time_t middlecputime;
-      time(&middlecputime);
-
-      clock_t difference = middlecputime - startcputime;
-      double seconds = difference;
-
-      if (seconds > indexingTimeLimit) {
-        reachedTime = true;
-        break;
-      }
-    }
+    exploreSeedPairs(seedThreads, maxSearch, maxSuccesses, maxLattices,
+                     indexingTimeLimit, startcputime, &successes, &continuing,
+                     &reachedTime);
 
     if (continuing && allowBiggestSolution) {
       if (!biggestFailedSolution) {
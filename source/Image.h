@@ -8,6 +8,8 @@
 #ifndef IMAGE_H_
 #define IMAGE_H_
 
+#include <condition_variable>
+#include <mutex>
 #include "LoggableObject.h"
 #include "Logger.h"
 #include "Matrix.h"
@@ -31,6 +33,38 @@ typedef enum {
   IndexingSolutionBranchFailure,
 } IndexingSolutionStatus;
 
+/* Network grown from one seed solution, ready to be tried, and the largest
+ * network which fell short on the way */
+typedef struct {
+  IndexingSolutionPtr network;
+  IndexingSolutionPtr biggestFailure;
+  std::vector<SpotVectorPtr> biggestFailureVectors;
+} SeedGrowth;
+
+/* Seed pair (first, second) of the serial search, with its spot vectors,
+ * starting solutions and, if grown by a worker thread, their growths */
+typedef struct {
+  int first;
+  int second;
+  SpotVectorPtr firstVector;
+  SpotVectorPtr secondVector;
+  bool grown;
+  std::vector<IndexingSolutionPtr> seeds;
+  std::vector<SeedGrowth> growths;
+} SeedPairTrial;
+
+/* Batch of seed pairs shared with the worker threads of one image, which
+ * wait for each batch for as long as the search runs */
+typedef struct {
+  std::vector<SeedPairTrial> *trials;
+  std::vector<SpotVectorPtr> *vectors;
+  int next;
+  int done;
+  bool finished;
+  std::mutex mutex;
+  std::condition_variable changed;
+} SeedPairQueue;
+
 class Image : protected LoggableObject,
               public hasFilename,
               public boost::enable_shared_from_this<Image> {
@@ -53,8 +87,11 @@ class Image : protected LoggableObject,
   std::string spotsFile;
   IndexingSolutionStatus extendIndexingSolution(
       IndexingSolutionPtr solutionPtr,
-      std::vector<SpotVectorPtr> existingVectors, int *failures = NULL,
-      int added = 0);
+      std::vector<SpotVectorPtr> existingVectors);
+  bool growIndexingSolution(IndexingSolutionPtr solutionPtr,
+                            std::vector<SpotVectorPtr> existingVectors,
+                            SeedGrowth *growth, int *failures = NULL,
+                            int added = 0);
 
   /* Shoebox must be n by n where n is an odd number */
   int shoebox[7][7];
@@ -90,9 +127,27 @@ class Image : protected LoggableObject,
   IndexingSolutionStatus testSeedSolution(
       IndexingSolutionPtr newSolution,
       std::vector<SpotVectorPtr> &prunedVectors, int *successes);
+  bool seedSolutionIsDuplicate(IndexingSolutionPtr newSolution);
+  IndexingSolutionStatus commitSeedGrowth(SeedGrowth *growth,
+                                          int *successes);
+  void keepBiggestFailedSolution(SeedGrowth *growth);
+  void exploreSeedPairs(int seedThreads, int maxSearch, int maxSuccesses,
+                        int maxLattices, int timeLimit, time_t startTime,
+                        int *successes, bool *continuing, bool *reachedTime);
+  void planSeedPairs(int first, int second, SpotVectorPtr firstVector,
+                     int batchSize, int maxSearch,
+                     std::vector<SeedPairTrial> *trials);
+  void growSeedPairs(SeedPairQueue *queue, int seedThreads,
+                     std::vector<SeedPairTrial> *trials,
+                     std::vector<SpotVectorPtr> *vectors);
+  static void seedPairThread(Image *me, SeedPairQueue *queue);
   IndexingSolutionPtr biggestFailedSolution;
   std::vector<SpotVectorPtr> biggestFailedSolutionVectors;
 
+  static void findClosePairs(std::vector<vec> &positions,
+                             std::vector<char> &usable, double maxDistance,
+                             std::vector<std::pair<int, int> > *pairs);
+
  protected:
   int xDim;
   int yDim;
@@ -311,6 +311,146 @@ double IndexManager::pseudoAngleScore(void *object) {
   return -totalScore;
 }
 
+typedef struct {
+  DetectorPtr master;
+  IndexManagerPtr manager;
+} IndexManagerSnapshot;
+
+typedef boost::shared_ptr<IndexManagerSnapshot> IndexManagerSnapshotPtr;
+typedef std::map<Spot *, SpotPtr> SpotCloneMap;
+typedef std::map<SpotVector *, SpotVectorPtr> SpotVectorCloneMap;
+
+static SpotPtr cloneSpot(SpotPtr spot, DetectorPtr master, CloneMap *cloneMap,
+                         SpotCloneMap *spotMap) {
+  if (spotMap->count(&*spot)) {
+    return (*spotMap)[&*spot];
+  }
+
+  DetectorPtr detector = spot->getDetector();
+  DetectorPtr cloneDetector;
+
+  if (detector && cloneMap->count(&*detector)) {
+    cloneDetector = (*cloneMap)[&*detector];
+  } else {
+    cloneDetector =
+        master->findDetectorPanelForSpotCoord(spot->getRawX(), spot->getRawY());
+  }
+
+  SpotPtr clone = spot->copyForDetector(cloneDetector);
+  (*spotMap)[&*spot] = clone;
+
+  return clone;
+}
+
+static SpotVectorPtr cloneSpotVector(SpotVectorPtr vector, DetectorPtr master,
+                                     CloneMap *cloneMap, SpotCloneMap *spotMap,
+                                     SpotVectorCloneMap *vectorMap) {
+  if (!vector) {
+    return SpotVectorPtr();
+  }
+
+  if (vectorMap->count(&*vector)) {
+    return (*vectorMap)[&*vector];
+  }
+
+  SpotPtr first = cloneSpot(vector->getFirstSpot(), master, cloneMap, spotMap);
+  SpotPtr second =
+      cloneSpot(vector->getSecondSpot(), master, cloneMap, spotMap);
+
+  if (!first || !second) {
+    return SpotVectorPtr();
+  }
+
+  SpotVectorPtr clone = vector->copyWithSpots(first, second);
+  (*vectorMap)[&*vector] = clone;
+
+  return clone;
+}
+
+bool IndexManager::makeEvaluationContext(void *evaluatedObject,
+                                         std::vector<void *> objects,
+                                         EvaluationContext *context) {
+  IndexManager *me = static_cast<IndexManager *>(evaluatedObject);
+
+  /* Vector pairs must already be chosen, or the copy would go back
+   * to the live images to choose them again */
+  if (me->goodVectorPairs.size() == 0) {
+    return false;
+  }
+
+  IndexManagerSnapshotPtr snapshot =
+      IndexManagerSnapshotPtr(new IndexManagerSnapshot());
+  CloneMap cloneMap;
+  SpotCloneMap spotMap;
+  SpotVectorCloneMap vectorMap;
+
+  DetectorPtr master = Detector::getMaster()->cloneTree(&cloneMap);
+  snapshot->master = master;
+
+  IndexManagerPtr clone = IndexManagerPtr(new IndexManager(me->images));
+  clone->lattice = me->lattice;
+  clone->scoreType = me->scoreType;
+  clone->_canLockVectors = me->_canLockVectors;
+  clone->_axisWeighting = me->_axisWeighting;
+  clone->_activeDetector = cloneMap[&*me->getActiveDetector()];
+  snapshot->manager = clone;
+
+  for (std::set<SpotPtr>::iterator it = me->goodSpots.begin();
+       it != me->goodSpots.end(); it++) {
+    SpotPtr spot = cloneSpot(*it, master, &cloneMap, &spotMap);
+
+    if (!spot) {
+      return false;
+    }
+
+    clone->goodSpots.insert(spot);
+  }
+
+  for (int i = 0; i < me->goodVectors.size(); i++) {
+    SpotVectorPtr vector = cloneSpotVector(me->goodVectors[i], master,
+                                           &cloneMap, &spotMap, &vectorMap);
+
+    if (!vector) {
+      return false;
+    }
+
+    clone->goodVectors.push_back(vector);
+  }
+
+  for (int i = 0; i < me->goodVectorPairs.size(); i++) {
+    SpotVectorPair pair;
+
+    for (int j = 0; j < 3; j++) {
+      SpotVectorPtr original = me->goodVectorPairs[i].vecs[j];
+      pair.vecs[j] = cloneSpotVector(original, master, &cloneMap, &spotMap,
+                                     &vectorMap);
+
+      if (original && !pair.vecs[j]) {
+        return false;
+      }
+    }
+
+    clone->goodVectorPairs.push_back(pair);
+  }
+
+  context->objects.clear();
+
+  for (int i = 0; i < objects.size(); i++) {
+    Detector *object = static_cast<Detector *>(objects[i]);
+
+    if (!cloneMap.count(object)) {
+      return false;
+    }
+
+    context->objects.push_back(&*cloneMap[object]);
+  }
+
+  context->evaluateObject = &*clone;
+  context->owner = snapshot;
+
+  return true;
+}
+
 // MARK: Actual indexing
 
 void IndexManager::indexThread(IndexManager *indexer,
@@ -122,6 +122,9 @@ class IndexManager : LoggableObject,
 
   void plotGoodVectors();
   static double pseudoScore(void *object);
+  static bool makeEvaluationContext(void *evaluatedObject,
+                                    std::vector<void *> objects,
+                                    EvaluationContext *context);
   IndexManager(std::vector<ImagePtr> images);
 };
 
@@ -35,6 +35,8 @@ bool IndexingSolution::notSetup = true;
 bool IndexingSolution::finishedSetup = false;
 bool IndexingSolution::checkingCommonSpots = true;
 std::mutex IndexingSolution::setupMutex;
+std::vector<double> IndexingSolution::symmetryRotations;
+double IndexingSolution::similarityThreshold = 0;
 
 void IndexingSolution::setupStandardVectors() {
   if (finishedSetup) return;
@@ -81,6 +83,8 @@ void IndexingSolution::setupStandardVectors() {
   newReflection->setUnitCell(unitCell);
   newReflection->setSpaceGroup(spaceGroupNum);
 
+  makeSymmetryRotations();
+
   finishedSetup = true;
 
   setupMutex.unlock();
@@ -89,44 +93,82 @@ void IndexingSolution::setupStandardVectors() {
 void IndexingSolution::calculateSimilarStandardVectorsForImageVectors(
     std::vector<SpotVectorPtr> vectors) {
   for (int i = 0; i < vectors.size(); i++) {
-    vectors[i]->addSimilarLengthStandardVectors(lattice->getStandardVectors(),
-                                                distanceTolerance);
+    vectors[i]->addSimilarLengthStandardVectors(lattice, distanceTolerance);
   }
 }
 
-bool IndexingSolution::matrixSimilarToMatrix(MatrixPtr mat1, MatrixPtr mat2,
-                                             bool force) {
-  double minTrace = FLT_MAX;
+/* Same product as Matrix::preMultiply, on the 3x3 part only: second is
+ * pre-multiplied by first. Both are stored as Matrix columns of three. */
+void IndexingSolution::multiplyRotations(const double *first,
+                                         const double *second,
+                                         double *result) {
+  for (int c = 0; c < 3; c++) {
+    for (int r = 0; r < 3; r++) {
+      result[c * 3 + r] = second[r] * first[c * 3] +
+                          second[3 + r] * first[c * 3 + 1] +
+                          second[6 + r] * first[c * 3 + 2];
+    }
+  }
+}
 
-  std::ostringstream logged;
+void IndexingSolution::makeSymmetryRotations() {
+  symmetryRotations.clear();
 
   for (int k = 0; k < symOperatorCount(); k++) {
     MatrixPtr symOp = symOperator(k);
 
     for (int l = 0; l < newReflection->ambiguityCount(); l++) {
-      MatrixPtr mat3 = mat2->copy();
       MatrixPtr ambiguity = newReflection->matrixForAmbiguity(l);
-      mat3->getRotation()->preMultiply(*symOp);
-      mat3->getRotation()->preMultiply(*ambiguity);
+      double sym[9], amb[9], combined[9];
 
-      MatrixPtr subtractedMat = mat1->getRotation()->copy();
-      subtractedMat->subtract(mat3->getRotation());
-      MatrixPtr transposedMat = subtractedMat->copy()->transpose();
-      transposedMat->multiply(*subtractedMat);
+      for (int c = 0; c < 3; c++) {
+        for (int r = 0; r < 3; r++) {
+          sym[c * 3 + r] = symOp->components[c * 4 + r];
+          amb[c * 3 + r] = ambiguity->components[c * 4 + r];
+        }
+      }
 
-      double trace = transposedMat->trace();
+      /* Pre-multiplying by the operator and then the ambiguity is the
+       * same as pre-multiplying once by their product */
+      multiplyRotations(amb, sym, combined);
+      symmetryRotations.insert(symmetryRotations.end(), combined,
+                               combined + 9);
+    }
+  }
 
-      if (trace < minTrace) {
-        minTrace = trace;
-        //   logged << "Trace with existing solution: " << trace << std::endl;
-        //   Logger::log(logged);
-      }
+  similarityThreshold = sqrt(4 * (1 - cos(solutionAngleSpread)));
+}
+
+bool IndexingSolution::matrixSimilarToMatrix(MatrixPtr mat1, MatrixPtr mat2,
+                                             bool force) {
+  double minTrace = FLT_MAX;
+  double first[9], second[9], rotated[9];
+
+  for (int c = 0; c < 3; c++) {
+    for (int r = 0; r < 3; r++) {
+      first[c * 3 + r] = mat1->getRotation()->components[c * 4 + r];
+      second[c * 3 + r] = mat2->getRotation()->components[c * 4 + r];
     }
   }
 
-  double badMinTrace = sqrt(4 * (1 - cos(solutionAngleSpread)));
+  /* Trace of the difference times its transpose is the sum of its squared
+   * elements, so no matrices need to be made */
+  for (int i = 0; i < symmetryRotations.size(); i += 9) {
+    multiplyRotations(&symmetryRotations[i], second, rotated);
+
+    double trace = 0;
 
-  return (minTrace < badMinTrace);
+    for (int j = 0; j < 9; j++) {
+      double difference = first[j] - rotated[j];
+      trace += difference * difference;
+    }
+
+    if (trace < minTrace) {
+      minTrace = trace;
+    }
+  }
+
+  return (minTrace < similarityThreshold);
 }
 
 bool IndexingSolution::vectorPairLooksLikePair(SpotVectorPtr firstObserved,
@@ -149,6 +191,11 @@ bool IndexingSolution::vectorMatchesVector(
     std::vector<SpotVectorPtr> *secondMatches) {
   MatchPair matchPairs;
   double realAngle = firstVector->angleWithVector(secondVector);
+  double secondTolerance = secondVector->getMinDistanceTolerance();
+
+  /* Standard vectors which can match the second vector on length */
+  std::vector<int> secondIndices;
+  secondVector->standardVectorCandidates(lattice, &secondIndices);
 
   for (int i = 0; i < uniqueSymVectorCount();
        i++)  // FIXME: standardVectorCount
@@ -158,10 +205,10 @@ bool IndexingSolution::vectorMatchesVector(
     double firstTolerance = firstVector->getMinDistanceTolerance();
 
     if (firstVectorTrust > firstTolerance) {
-      for (int j = 0; j < standardVectorCount(); j++) {
+      for (int k = 0; k < secondIndices.size(); k++) {
+        int j = secondIndices[k];
         double secondVectorTrust =
             secondVector->trustComparedToStandardVector(standardVector(j));
-        double secondTolerance = secondVector->getMinDistanceTolerance();
 
         if (secondVectorTrust > secondTolerance) {
           double expectedAngle =
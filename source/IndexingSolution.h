@@ -58,6 +58,13 @@ class IndexingSolution : LoggableObject {
   static double angleTolerance;
   static double solutionAngleSpread;
   static double approximateCosineDelta;
+
+  /* Symmetry operator times ambiguity, 3x3 each, for every pairing */
+  static std::vector<double> symmetryRotations;
+  static double similarityThreshold;
+  static void makeSymmetryRotations();
+  static void multiplyRotations(const double *first, const double *second,
+                                double *result);
   static bool checkingCommonSpots;
   static int spaceGroupNum;
   static CSym::CCP4SPG *spaceGroup;
@@ -170,6 +170,11 @@ void InputFileParser::parse(bool fromPython) {
         refiner->merge();
       }
 
+      if (line == "REDUCE_MERGE_SHARDS") {
+        understood = true;
+        refiner->merge(-2, true);
+      }
+
       if (line == "DISPLAY_INDEXING_HANDS") {
         understood = true;
         refiner->displayIndexingHands();
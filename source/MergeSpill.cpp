@@ -0,0 +1,187 @@
+//
+//  MergeSpill.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "MergeSpill.h"
+#include <unistd.h>
+#include <mutex>
+#include "misc.h"
+
+MergeSpill::MergeSpill(std::string directory, int reflections, int buckets) {
+  reflectionCount = reflections;
+  buckets = std::max(1, std::min(buckets, reflections));
+
+  if (directory.length() && directory[directory.length() - 1] != '/') {
+    directory += "/";
+  }
+
+  prefix = directory + "merge_spill_" + i_to_str(getpid()) + "_" +
+           i_to_str((int)((size_t)this % 100000)) + "_";
+
+  for (int i = 0; i < buckets; i++) {
+    FILE *file = fopen(bucketPath(i).c_str(), "w+b");
+
+    if (file == NULL) {
+      logged << "Could not open spill file " << bucketPath(i)
+             << ", merging in memory instead." << std::endl;
+      sendLog();
+
+      for (int j = 0; j < files.size(); j++) {
+        fclose(files[j]);
+        remove(bucketPath(j).c_str());
+      }
+
+      files.clear();
+      mutexes.clear();
+      recordCounts.clear();
+      return;
+    }
+
+    files.push_back(file);
+    mutexes.push_back(MutexPtr(new std::mutex()));
+    recordCounts.push_back(0);
+  }
+}
+
+MergeSpill::~MergeSpill() {
+  for (int i = 0; i < files.size(); i++) {
+    fclose(files[i]);
+    remove(bucketPath(i).c_str());
+  }
+}
+
+std::string MergeSpill::bucketPath(int bucket) {
+  return prefix + i_to_str(bucket) + ".bin";
+}
+
+int MergeSpill::bucketForReflection(int reflection) {
+  return (int)((long)reflection * bucketCount() / reflectionCount);
+}
+
+int MergeSpill::firstReflection(int bucket) {
+  if (bucket >= bucketCount()) {
+    return reflectionCount;
+  }
+
+  /* Smallest reflection index which maps onto this bucket */
+  long count = bucketCount();
+  return (int)(((long)bucket * reflectionCount + count - 1) / count);
+}
+
+void MergeSpill::write(int crystal,
+                       std::vector<LiteContribution> *contributions) {
+  std::vector<SpillRecord> records;
+  int start = 0;
+
+  /* Contributions arrive in reflection order, so each bucket receives a
+   * single run of records from this crystal */
+  while (start < contributions->size()) {
+    int bucket = bucketForReflection((*contributions)[start].first);
+    int end = start;
+    records.clear();
+
+    while (end < contributions->size() &&
+           bucketForReflection((*contributions)[end].first) == bucket) {
+      SpillRecord record;
+      record.crystal = crystal;
+      record.reflection = (*contributions)[end].first;
+      record.lite = (*contributions)[end].second;
+      records.push_back(record);
+      end++;
+    }
+
+    std::lock_guard<std::mutex> lg(*mutexes[bucket]);
+    fseek(files[bucket], 0, SEEK_END);
+    fwrite(&records[0], sizeof(SpillRecord), records.size(), files[bucket]);
+    recordCounts[bucket] += records.size();
+
+    start = end;
+  }
+}
+
+void MergeSpill::readBuckets(int first, int last,
+                             std::vector<SpillRecord> *records) {
+  size_t total = 0;
+
+  for (int i = first; i < last; i++) {
+    total += recordCounts[i];
+  }
+
+  records->resize(total);
+  size_t position = 0;
+
+  for (int i = first; i < last; i++) {
+    if (recordCounts[i] == 0) {
+      continue;
+    }
+
+    fflush(files[i]);
+    fseek(files[i], 0, SEEK_SET);
+    size_t read =
+        fread(&(*records)[position], sizeof(SpillRecord), recordCounts[i],
+              files[i]);
+
+    if (read != recordCounts[i]) {
+      logged << "Only read " << read << " of " << recordCounts[i]
+             << " observations back from " << bucketPath(i) << std::endl;
+      sendLog();
+    }
+
+    position += read;
+  }
+
+  records->resize(position);
+}
+
+/* Streams through one bucket, keeping only the records for reflections
+ * begin to end, so that a bucket too big for memory can be merged in
+ * parts */
+void MergeSpill::readBucketRange(int bucket, int begin, int end,
+                                 std::vector<SpillRecord> *records) {
+  records->clear();
+
+  if (recordCounts[bucket] == 0) {
+    return;
+  }
+
+  std::vector<SpillRecord> chunk(4096);
+  size_t remaining = recordCounts[bucket];
+
+  fflush(files[bucket]);
+  fseek(files[bucket], 0, SEEK_SET);
+
+  while (remaining > 0) {
+    size_t wanted = std::min(remaining, chunk.size());
+    size_t read = fread(&chunk[0], sizeof(SpillRecord), wanted, files[bucket]);
+
+    for (int i = 0; i < read; i++) {
+      if (chunk[i].reflection >= begin && chunk[i].reflection < end) {
+        records->push_back(chunk[i]);
+      }
+    }
+
+    if (read != wanted) {
+      logged << "Could not read all observations back from "
+             << bucketPath(bucket) << std::endl;
+      sendLog();
+      return;
+    }
+
+    remaining -= read;
+  }
+}
@@ -0,0 +1,72 @@
+//
+//  MergeSpill.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __cppxfel__MergeSpill__
+#define __cppxfel__MergeSpill__
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "LoggableObject.h"
+#include "Reflection.h"
+#include "parameters.h"
+
+/* Lite miller destined for the grouped reflection at a given index */
+typedef std::pair<int, LiteMiller> LiteContribution;
+
+typedef struct {
+  int crystal;
+  int reflection;
+  LiteMiller lite;
+} SpillRecord;
+
+/* Grouped observations for an out-of-core merge. Records are appended to
+ * one file per range of reflection indices ("bucket"), so that neighbouring
+ * buckets can be read back and merged a few at a time. Files are removed
+ * when the spill is destroyed. */
+
+class MergeSpill : public LoggableObject {
+ private:
+  std::string prefix;
+  int reflectionCount;
+  std::vector<FILE *> files;
+  std::vector<MutexPtr> mutexes;
+  std::vector<size_t> recordCounts;
+
+  std::string bucketPath(int bucket);
+
+ public:
+  MergeSpill(std::string directory, int reflections, int buckets);
+  ~MergeSpill();
+
+  bool isOpen() { return files.size() > 0; }
+
+  int bucketCount() { return (int)files.size(); }
+
+  int bucketForReflection(int reflection);
+  int firstReflection(int bucket);
+  size_t bucketRecords(int bucket) { return recordCounts[bucket]; }
+
+  void write(int crystal, std::vector<LiteContribution> *contributions);
+  void readBuckets(int first, int last, std::vector<SpillRecord> *records);
+  void readBucketRange(int bucket, int begin, int end,
+                       std::vector<SpillRecord> *records);
+};
+
+#endif /* defined(__cppxfel__MergeSpill__) */
@@ -0,0 +1,444 @@
+//
+//  MergeState.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "MergeState.h"
+#include <string.h>
+
+#define MERGE_STATE_MAGIC "cppxfel merge state"
+#define MERGE_STATE_VERSION 3
+
+#define OBSERVATION_BYTES (4 + 8 + 8 + 1 + 1)
+#define RESULT_BYTES (4 + 8 + 8 + 8 + 4 + 1)
+
+static void putUInt(unsigned char *bytes, unsigned long long value, int width) {
+  for (int i = 0; i < width; i++) {
+    bytes[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+static unsigned long long getUInt(const unsigned char *bytes, int width) {
+  unsigned long long value = 0;
+
+  for (int i = 0; i < width; i++) {
+    value |= (unsigned long long)bytes[i] << (8 * i);
+  }
+
+  return value;
+}
+
+static void putDouble(unsigned char *bytes, double value) {
+  unsigned long long bits = 0;
+  memcpy(&bits, &value, sizeof(double));
+  putUInt(bytes, bits, 8);
+}
+
+static double getDouble(const unsigned char *bytes) {
+  unsigned long long bits = getUInt(bytes, 8);
+  double value = 0;
+  memcpy(&value, &bits, sizeof(double));
+
+  return value;
+}
+
+static void encodeObservation(unsigned char *bytes,
+                              const StoredObservation &observation) {
+  putUInt(&bytes[0], observation.first, 4);
+  putDouble(&bytes[4], observation.second.intensity);
+  putDouble(&bytes[12], observation.second.weight);
+  bytes[20] = observation.second.friedel;
+  bytes[21] = observation.second.halfSet;
+}
+
+static void decodeObservation(const unsigned char *bytes,
+                              StoredObservation *observation) {
+  observation->first = (unsigned int)getUInt(&bytes[0], 4);
+  observation->second.intensity = getDouble(&bytes[4]);
+  observation->second.weight = getDouble(&bytes[12]);
+  observation->second.friedel = (bytes[20] != 0);
+  observation->second.halfSet = bytes[21];
+}
+
+static void encodeResult(unsigned char *bytes,
+                         const std::pair<unsigned int, MergeResult> &result) {
+  putUInt(&bytes[0], result.first, 4);
+  putDouble(&bytes[4], result.second.intensity);
+  putDouble(&bytes[12], result.second.countingSigma);
+  putDouble(&bytes[20], result.second.sigma);
+  putUInt(&bytes[28], (unsigned int)result.second.rejected, 4);
+  bytes[32] = result.second.valid;
+}
+
+static void decodeResult(const unsigned char *bytes,
+                         std::pair<unsigned int, MergeResult> *result) {
+  result->first = (unsigned int)getUInt(&bytes[0], 4);
+  result->second.intensity = getDouble(&bytes[4]);
+  result->second.countingSigma = getDouble(&bytes[12]);
+  result->second.sigma = getDouble(&bytes[20]);
+  result->second.rejected = (int)(unsigned int)getUInt(&bytes[28], 4);
+  result->second.valid = (bytes[32] != 0);
+}
+
+MergeState::MergeState(std::string aFilename) {
+  filename = aFilename;
+  input = NULL;
+  output = NULL;
+  readCrystals = false;
+}
+
+MergeState::~MergeState() {
+  if (input != NULL) {
+    fclose(input);
+  }
+
+  if (output != NULL) {
+    fclose(output);
+    remove(temporaryName().c_str());
+  }
+}
+
+bool MergeState::readInt(int *value) {
+  unsigned char bytes[4];
+
+  if (fread(bytes, 1, 4, input) != 4) {
+    return false;
+  }
+
+  *value = (int)(unsigned int)getUInt(bytes, 4);
+
+  return true;
+}
+
+void MergeState::writeInt(int value) {
+  unsigned char bytes[4];
+  putUInt(bytes, (unsigned int)value, 4);
+  fwrite(bytes, 1, 4, output);
+}
+
+bool MergeState::readDouble(double *value) {
+  unsigned char bytes[8];
+
+  if (fread(bytes, 1, 8, input) != 8) {
+    return false;
+  }
+
+  *value = getDouble(bytes);
+
+  return true;
+}
+
+void MergeState::writeDouble(double value) {
+  unsigned char bytes[8];
+  putDouble(bytes, value);
+  fwrite(bytes, 1, 8, output);
+}
+
+bool MergeState::readString(std::string *string) {
+  int length = 0;
+
+  if (!readInt(&length) || length < 0) {
+    return false;
+  }
+
+  std::vector<char> chars(length);
+
+  if (length > 0 && fread(&chars[0], 1, length, input) != length) {
+    return false;
+  }
+
+  *string = std::string(chars.begin(), chars.end());
+
+  return true;
+}
+
+void MergeState::writeString(std::string string) {
+  int length = (int)string.length();
+
+  writeInt(length);
+  fwrite(string.c_str(), 1, length, output);
+}
+
+bool MergeState::readInfo(ShardInfo *info) {
+  int count = 0;
+
+  if (!readInt(&count) || count < 0) {
+    return false;
+  }
+
+  info->crystals.resize(count);
+
+  for (int i = 0; i < count; i++) {
+    if (!readString(&info->crystals[i])) {
+      return false;
+    }
+  }
+
+  info->unitCell.resize(6);
+  info->matrix.resize(16);
+
+  if (!readDouble(&info->maxResolution) || !readInt(&info->symmetryFold) ||
+      !readInt(&info->spaceGroup)) {
+    return false;
+  }
+
+  for (int i = 0; i < 6; i++) {
+    if (!readDouble(&info->unitCell[i])) {
+      return false;
+    }
+  }
+
+  for (int i = 0; i < 16; i++) {
+    if (!readDouble(&info->matrix[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* States which are not shards carry an empty info */
+void MergeState::writeInfo(ShardInfo *info) {
+  int count = info ? (int)info->crystals.size() : 0;
+  writeInt(count);
+
+  for (int i = 0; i < count; i++) {
+    writeString(info->crystals[i]);
+  }
+
+  writeDouble(info ? info->maxResolution : 0);
+  writeInt(info ? info->symmetryFold : -1);
+  writeInt(info ? info->spaceGroup : 0);
+
+  for (int i = 0; i < 6; i++) {
+    bool given = (info && i < info->unitCell.size());
+    writeDouble(given ? info->unitCell[i] : 0);
+  }
+
+  for (int i = 0; i < 16; i++) {
+    bool given = (info && i < info->matrix.size());
+    writeDouble(given ? info->matrix[i] : 0);
+  }
+}
+
+bool MergeState::open(std::string groupingSignature,
+                      std::string rejectionSignature, bool *cacheValid,
+                      ShardInfo *info) {
+  *cacheValid = false;
+  input = fopen(filename.c_str(), "rb");
+
+  if (input == NULL) {
+    logged << "No merge state in " << filename << ", starting a new one."
+           << std::endl;
+    sendLog();
+    return false;
+  }
+
+  std::string magic, grouping, rejection;
+  int version = 0;
+  ShardInfo unusedInfo;
+
+  if (info == NULL) {
+    info = &unusedInfo;
+  }
+
+  if (!readString(&magic) || magic != MERGE_STATE_MAGIC ||
+      !readInt(&version) || !readString(&grouping) ||
+      !readString(&rejection) ||
+      (version == MERGE_STATE_VERSION && !readInfo(info))) {
+    logged << "Could not read merge state from " << filename
+           << ", starting a new one." << std::endl;
+    sendLog();
+    fclose(input);
+    input = NULL;
+    return false;
+  }
+
+  if (version != MERGE_STATE_VERSION) {
+    logged << "Merge state in " << filename << " has format version "
+           << version << " rather than " << MERGE_STATE_VERSION
+           << ", starting a new one." << std::endl;
+    sendLog();
+    fclose(input);
+    input = NULL;
+    return false;
+  }
+
+  storedGrouping = grouping;
+
+  if (groupingSignature.length() && grouping != groupingSignature) {
+    logged << "Merge state in " << filename << " was grouped with different "
+           << "settings (" << grouping << "), starting a new one." << std::endl;
+    sendLog();
+    fclose(input);
+    input = NULL;
+    return false;
+  }
+
+  *cacheValid = (rejection == rejectionSignature);
+
+  return true;
+}
+
+bool MergeState::readCrystal(StoredCrystal *crystal) {
+  if (input == NULL || readCrystals) {
+    return false;
+  }
+
+  int fold = -1;
+  int count = 0;
+
+  if (!readInt(&fold) || fold < 0) {
+    readCrystals = true;
+    return false;
+  }
+
+  crystal->fold = fold;
+  crystal->observations.clear();
+
+  if (!readString(&crystal->name) || !readInt(&crystal->rejection) ||
+      !readString(&crystal->parameters) || !readInt(&count) || count < 0) {
+    readCrystals = true;
+    return false;
+  }
+
+  std::vector<unsigned char> bytes((size_t)count * OBSERVATION_BYTES);
+
+  if (count > 0 && fread(&bytes[0], 1, bytes.size(), input) != bytes.size()) {
+    logged << "Merge state " << filename << " is truncated." << std::endl;
+    sendLog();
+    readCrystals = true;
+    return false;
+  }
+
+  crystal->observations.resize(count);
+
+  for (int i = 0; i < count; i++) {
+    decodeObservation(&bytes[(size_t)i * OBSERVATION_BYTES],
+                      &crystal->observations[i]);
+  }
+
+  return true;
+}
+
+void MergeState::readResults(
+    std::vector<std::pair<unsigned int, MergeResult> > *results) {
+  results->clear();
+
+  if (input == NULL || !readCrystals) {
+    return;
+  }
+
+  int count = 0;
+
+  if (readInt(&count) && count > 0) {
+    std::vector<unsigned char> bytes((size_t)count * RESULT_BYTES);
+    size_t read = fread(&bytes[0], RESULT_BYTES, count, input);
+    results->resize(read);
+
+    for (int i = 0; i < read; i++) {
+      decodeResult(&bytes[(size_t)i * RESULT_BYTES], &(*results)[i]);
+    }
+  }
+
+  fclose(input);
+  input = NULL;
+}
+
+bool MergeState::beginWrite(std::string groupingSignature,
+                            std::string rejectionSignature, ShardInfo *info) {
+  output = fopen(temporaryName().c_str(), "wb");
+
+  if (output == NULL) {
+    logged << "Could not write merge state to " << temporaryName()
+           << std::endl;
+    sendLog();
+    return false;
+  }
+
+  writeString(MERGE_STATE_MAGIC);
+  writeInt(MERGE_STATE_VERSION);
+  writeString(groupingSignature);
+  writeString(rejectionSignature);
+  writeInfo(info);
+
+  return true;
+}
+
+void MergeState::writeCrystal(StoredCrystal *crystal) {
+  if (output == NULL) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lg(writeMutex);
+
+  std::vector<StoredObservation> *observations = &crystal->observations;
+  int count = (int)observations->size();
+  writeInt(crystal->fold);
+  writeString(crystal->name);
+  writeInt(crystal->rejection);
+  writeString(crystal->parameters);
+  writeInt(count);
+
+  if (count > 0) {
+    std::vector<unsigned char> bytes((size_t)count * OBSERVATION_BYTES);
+
+    for (int i = 0; i < count; i++) {
+      encodeObservation(&bytes[(size_t)i * OBSERVATION_BYTES],
+                        (*observations)[i]);
+    }
+
+    fwrite(&bytes[0], 1, bytes.size(), output);
+  }
+}
+
+void MergeState::finishWrite(
+    std::vector<std::pair<unsigned int, MergeResult> > *results) {
+  if (output == NULL) {
+    return;
+  }
+
+  int endOfCrystals = -1;
+  int count = (int)results->size();
+
+  writeInt(endOfCrystals);
+  writeInt(count);
+
+  if (count > 0) {
+    std::vector<unsigned char> bytes((size_t)count * RESULT_BYTES);
+
+    for (int i = 0; i < count; i++) {
+      encodeResult(&bytes[(size_t)i * RESULT_BYTES], (*results)[i]);
+    }
+
+    fwrite(&bytes[0], 1, bytes.size(), output);
+  }
+
+  bool failed = ferror(output);
+  fclose(output);
+  output = NULL;
+
+  if (failed || rename(temporaryName().c_str(), filename.c_str()) != 0) {
+    logged << "Could not save merge state to " << filename << std::endl;
+    sendLog();
+    remove(temporaryName().c_str());
+    return;
+  }
+
+  logged << "Saved merge state to " << filename << std::endl;
+  sendLog(LogLevelDetailed);
+}
@@ -0,0 +1,119 @@
+//
+//  MergeState.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __cppxfel__MergeState__
+#define __cppxfel__MergeState__
+
+#include <stdio.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "LoggableObject.h"
+#include "MergeSpill.h"
+#include "parameters.h"
+
+/* Merged value of one reflection, kept so that reflections without new
+ * observations need not be merged (and outlier-rejected) again */
+typedef struct {
+  double intensity;
+  double countingSigma;
+  double sigma;
+  int rejected;
+  bool valid;
+} MergeResult;
+
+/* Reflection ID (Reflection::getReflId) and the scaled observation; not an
+ * index into the merged MTZ, which changes with the resolution cut-off */
+typedef std::pair<unsigned int, LiteMiller> StoredObservation;
+
+/* Rejection is the MtzRejectionReason of a crystal which was not grouped,
+ * stored without observations; parameters is its line of the parameter
+ * CSV from before scaling */
+typedef struct {
+  int fold;
+  std::string name;
+  int rejection;
+  std::string parameters;
+  std::vector<StoredObservation> observations;
+} StoredCrystal;
+
+/* What the reduce of a sharded merge needs besides the observations, so
+ * that it reads neither the crystal list nor any MTZ. Crystals holds the
+ * full crystal list in fold order, which every shard must agree on.
+ * Symmetry is taken from the shard's first crystal with reflections, whose
+ * fold is symmetryFold (-1 if it read none); maxResolution is the highest
+ * resolution (1/d) of any crystal it read. */
+typedef struct {
+  std::vector<std::string> crystals;
+  double maxResolution;
+  int symmetryFold;
+  int spaceGroup;
+  std::vector<double> unitCell;
+  std::vector<double> matrix;
+} ShardInfo;
+
+/* Persistent state for MERGE_INCREMENTAL. The file holds every crystal
+ * folded in so far with its scaled observations (by reflection ID), then
+ * the merged value of each reflection from the last merge. The grouping
+ * signature guards against folding crystals which were grouped with
+ * different settings; the rejection signature only guards the cached
+ * merged values. Shard files of a sharded merge have the same layout, with
+ * their ShardInfo filled in and no merged values. A new state is written
+ * next to the old one and moved over it once complete. Every field is
+ * written little-endian at a fixed width, so the file does not depend on
+ * how the compiler lays out MergeResult or LiteMiller. */
+
+class MergeState : public LoggableObject {
+ private:
+  std::string filename;
+  std::string storedGrouping;
+  FILE *input;
+  FILE *output;
+  std::mutex writeMutex;
+  bool readCrystals;
+
+  bool readInt(int *value);
+  void writeInt(int value);
+  bool readDouble(double *value);
+  void writeDouble(double value);
+  bool readString(std::string *string);
+  void writeString(std::string string);
+  bool readInfo(ShardInfo *info);
+  void writeInfo(ShardInfo *info);
+  std::string temporaryName() { return filename + ".tmp"; }
+
+ public:
+  MergeState(std::string aFilename);
+  ~MergeState();
+
+  /* An empty grouping signature accepts whatever the file was grouped
+   * with, for the caller to check against groupingSignature() */
+  bool open(std::string groupingSignature, std::string rejectionSignature,
+            bool *cacheValid, ShardInfo *info = NULL);
+  std::string groupingSignature() { return storedGrouping; }
+  bool readCrystal(StoredCrystal *crystal);
+  void readResults(std::vector<std::pair<unsigned int, MergeResult> > *results);
+
+  bool beginWrite(std::string groupingSignature,
+                  std::string rejectionSignature, ShardInfo *info = NULL);
+  void writeCrystal(StoredCrystal *crystal);
+  void finishWrite(std::vector<std::pair<unsigned int, MergeResult> > *results);
+};
+
+#endif /* defined(__cppxfel__MergeState__) */
@@ -17,6 +17,7 @@
 #include "Reflection.h"
 #include "Shoebox.h"
 #include "Spot.h"
+#include "SpotHash.h"
 #include "Vector.h"
 #include "definitions.h"
 #include "parameters.h"
@@ -58,27 +59,6 @@ void Miller::setupStaticVariables() {
   millerMutex.unlock();
 }
 
-double Miller::superGaussian(double bandwidth, double mean, double sigma,
-                             double exponent) {
-  if (mtzParent == NULL || !mtzParent->setupGaussianTable()) {
-    return super_gaussian(bandwidth, mean, sigma, exponent);
-  } else {
-    if (bandwidth != bandwidth || mean != mean) return 0;
-
-    double standardisedX = fabs((bandwidth - mean) / sigma);
-
-    if (standardisedX > MAX_SUPER_GAUSSIAN) return 0;
-
-    if (!std::isfinite(standardisedX) || standardisedX != standardisedX)
-      return 0;
-
-    const double step = SUPER_GAUSSIAN_STEP;
-
-    int lookupInt = standardisedX / step;
-    return mtzParent->superGaussianTable[lookupInt];
-  }
-}
-
 void Miller::recalculatePredictedWavelength() {
   double rlpSize = FileParser::getKey("INITIAL_RLP_SIZE", 0.0001);
   double bandwidth = FileParser::getKey("INITIAL_BANDWIDTH", 0.0013);
@@ -385,17 +365,95 @@ void Miller::limitingEwaldWavelengths(vec hkl, double mosaicity,
   *limitLow = outwards_bandwidth;
 }
 
-double Miller::calculatePartiality(double pB, double qB, double beamMean,
-                                   double beamSigma, double beamExp,
-                                   double binary) {
-  beamSigma *= beamMean;
-  beamSigma /= 2;
+/* Beam profile from the shared lookup table, or calculated if the table
+ * has not been set up */
+template <bool lookupTable>
+static inline double beamProfile(double x, double mean, double sigma,
+                                 double exponent) {
+  if (!lookupTable) {
+    return super_gaussian(x, mean, sigma, exponent);
+  }
+
+  if (x != x || mean != mean) return 0;
+
+  double standardisedX = fabs((x - mean) / sigma);
+
+  if (standardisedX > MAX_SUPER_GAUSSIAN) return 0;
+
+  if (!std::isfinite(standardisedX) || standardisedX != standardisedX)
+    return 0;
 
-  predictedWavelength = getImage()->getWavelength();
+  const double step = SUPER_GAUSSIAN_STEP;
 
-  double correction_sigma = pow(M_PI, (2 / beamExp - 1));
+  int lookupInt = standardisedX / step;
+  return MtzManager::superGaussianTable[lookupInt];
+}
+
+template <bool lookupTable>
+static double beamIntegral(double limitP, double beamSigma, double beamExp) {
+  int sampling = 10;
+  double bValue = -limitP;
+  double integralBeam = 0;
+  double bIncrement = limitP * 2 / (double)sampling;
+
+  for (int i = 0; i < sampling; i++) {
+    double evalE = beamProfile<lookupTable>(bValue, 0, beamSigma, beamExp);
+    integralBeam += evalE * bIncrement;
+
+    bValue += bIncrement;
+  }
+
+  return integralBeam;
+}
+
+PartialityKernel Miller::partialityKernel(double wavelength, double bandwidth,
+                                          double exponent, bool binary,
+                                          bool lookupTable) {
+  PartialityKernel kernel;
+  kernel.binary = binary;
+  kernel.wavelength = wavelength;
+  kernel.bandwidth = bandwidth;
+  kernel.exponent = exponent;
+
+  double correction_sigma = pow(M_PI, (2 / exponent - 1));
   const double lnNum = 3.0;
-  double limit = correction_sigma * pow(lnNum, 1 / beamExp);
+  kernel.limit = correction_sigma * pow(lnNum, 1 / exponent);
+
+  /* The beam integral only depends on the beam, not the reflection */
+  double beamSigma = bandwidth;
+  beamSigma *= wavelength;
+  beamSigma /= 2;
+  double limitP = kernel.limit * beamSigma;
+
+  if (lookupTable) {
+    kernel.integralBeam = beamIntegral<true>(limitP, beamSigma, exponent);
+  } else {
+    kernel.integralBeam = beamIntegral<false>(limitP, beamSigma, exponent);
+  }
+
+  if (individualWavelength) {
+    kernel.norm = (lookupTable ? &Miller::partialityIntegral<false, true, true>
+                               : &Miller::partialityIntegral<false, true, false>);
+  } else {
+    kernel.norm = (lookupTable ? &Miller::partialityIntegral<false, false, true>
+                               : &Miller::partialityIntegral<false, false, false>);
+  }
+
+  kernel.partiality = kernel.norm;
+
+  if (binary) {
+    kernel.partiality = &Miller::partialityIntegral<true, false, false>;
+  }
+
+  return kernel;
+}
+
+template <bool binary, bool trackWavelength, bool lookupTable>
+double Miller::partialityIntegral(double pB, double qB, double beamMean,
+                                  double beamSigma, double beamExp,
+                                  double limit, double integralBeam) {
+  beamSigma *= beamMean;
+  beamSigma /= 2;
 
   double limitP = limit * beamSigma;
 
@@ -406,25 +464,17 @@ double Miller::calculatePartiality(double pB, double qB, double beamMean,
   if ((pqMin > 0 && pqMax > pqMin && diffLimit < pqMin) ||
       (pqMax < 0 && pqMin < pqMax && -diffLimit > pqMax)) {
     // way too far from the diffraction condition
+    predictedWavelength = getImage()->getWavelength();
     return 0;
   } else if (binary) {
+    predictedWavelength = getImage()->getWavelength();
     return 1;
   }
 
   int sampling = 10;
-  double bValue = -limitP;
-  double integralBeam = 0;
   double bIncrement = limitP * 2 / (double)sampling;
-
-  for (int i = 0; i < sampling; i++) {
-    double evalE = superGaussian(bValue, 0, beamSigma, beamExp);
-    integralBeam += evalE * bIncrement;
-
-    bValue += bIncrement;
-  }
-
   double pDiff = fabs(qB - pB);
-  bValue = -limitP + beamMean;
+  double bValue = -limitP + beamMean;
   double squash = 1 / pDiff;
   double offset = (qB + pB) / 2;
 
@@ -434,32 +484,41 @@ double Miller::calculatePartiality(double pB, double qB, double beamMean,
   }
 
   double integralAll = 0;
-  predictedWavelength = 0;
+  double wavelengthSum = 0;
 
   for (int i = 0; i < sampling; i++) {
     double pValue = (bValue - offset) * squash;
     double evalP = std::max(0., 1 - 4 * pValue * pValue);
-    double evalE = superGaussian(bValue, beamMean, beamSigma, beamExp);
+    double evalE = beamProfile<lookupTable>(bValue, beamMean, beamSigma,
+                                            beamExp);
     double slice = (evalE * evalP) * bIncrement;
     integralAll += slice;
 
-    if (individualWavelength) {
-      predictedWavelength += bValue * slice;
+    if (trackWavelength) {
+      wavelengthSum += bValue * slice;
     }
 
     bValue += bIncrement;
   }
 
-  predictedWavelength /= integralAll;
+  predictedWavelength = wavelengthSum / integralAll;
 
   integralAll /= integralBeam;
 
-  //   logged <<  integralAll << std::endl;
-  //   sendLog();
-
   return integralAll;
 }
 
+double Miller::calculatePartiality(double pB, double qB, double beamMean,
+                                   double beamSigma, double beamExp,
+                                   double binary) {
+  bool lookupTable = (mtzParent != NULL && MtzManager::setupGaussianTable());
+  PartialityKernel kernel =
+      partialityKernel(beamMean, beamSigma, beamExp, binary, lookupTable);
+
+  return (this->*kernel.partiality)(pB, qB, beamMean, beamSigma, beamExp,
+                                    kernel.limit, kernel.integralBeam);
+}
+
 double Miller::sinTwoTheta(MatrixPtr rotatedMatrix) {
   vec hkl = new_vector(h, k, l);
   rotatedMatrix->multiplyVector(&hkl);
@@ -502,10 +561,23 @@ void Miller::recalculatePartiality(MatrixPtr rotatedMatrix, double mosaicity,
     return;
   }
 
+  bool lookupTable = (mtzParent != NULL && MtzManager::setupGaussianTable());
+  PartialityKernel kernel =
+      partialityKernel(wavelength, bandwidth, exponent, binary, lookupTable);
+
+  recalculatePartiality(rotatedMatrix, mosaicity, spotSize, &kernel);
+}
+
+void Miller::recalculatePartiality(MatrixPtr rotatedMatrix, double mosaicity,
+                                   double spotSize, PartialityKernel *kernel) {
   if (model == PartialityModelFixed) {
     return;
   }
 
+  double wavelength = kernel->wavelength;
+  double bandwidth = kernel->bandwidth;
+  double exponent = kernel->exponent;
+
   vec hkl = new_vector(h, k, l);
   rotatedMatrix->multiplyVector(&hkl);
   double dStar = length_of_vector(hkl);
@@ -513,17 +585,17 @@ void Miller::recalculatePartiality(MatrixPtr rotatedMatrix, double mosaicity,
   double rlpWavelength = getEwaldSphereNoMatrix(hkl);
   this->wavelength = rlpWavelength;
 
-  MatrixPtr mat = MatrixPtr(new Matrix());
   double pB = 0;
   double qB = 0;
 
   limitingEwaldWavelengths(hkl, mosaicity, spotSize, wavelength, &pB, &qB);
 
   double integral =
-      calculatePartiality(pB, qB, wavelength, bandwidth, exponent, binary);
+      (this->*kernel->partiality)(pB, qB, wavelength, bandwidth, exponent,
+                                  kernel->limit, kernel->integralBeam);
   partiality = integral;
 
-  if (integral > 0 && !binary) {
+  if (integral > 0 && !kernel->binary) {
     double newH = 0;
     double newK =
         sqrt((4 * pow(dStar, 2) - pow(dStar, 4) * pow(wavelength, 2)) / 4);
@@ -536,7 +608,9 @@ void Miller::recalculatePartiality(MatrixPtr rotatedMatrix, double mosaicity,
 
     limitingEwaldWavelengths(newHKL, mosaicity, spotSize, wavelength, &pB, &qB);
 
-    double norm = calculatePartiality(pB, qB, wavelength, bandwidth, exponent);
+    double norm =
+        (this->*kernel->norm)(pB, qB, wavelength, bandwidth, exponent,
+                              kernel->limit, kernel->integralBeam);
 
     partiality /= norm;
   }
@@ -645,6 +719,26 @@ MillerPtr Miller::copy(void) {
   return newMiller;
 }
 
+/* Snapshot for positioning on a cloned detector: carries over what is
+ * needed to recalculate shifts without searching the image again. */
+MillerPtr Miller::copyForDetector(DetectorPtr detector) {
+  MillerPtr newMiller = copy();
+
+  newMiller->scale = scale;
+  newMiller->image = image;
+  newMiller->beam = beam;
+  newMiller->shoebox = shoebox;
+  newMiller->flipMatrix = flipMatrix;
+  newMiller->correctedX = correctedX;
+  newMiller->correctedY = correctedY;
+  newMiller->predictedWavelength = predictedWavelength;
+  newMiller->recipShiftX = recipShiftX;
+  newMiller->recipShiftY = recipShiftY;
+  newMiller->lastDetector = detector;
+
+  return newMiller;
+}
+
 void Miller::applyScaleFactor(double scaleFactor) {
   setScale(scale * scaleFactor);
 }
@@ -847,24 +941,25 @@ void Miller::incrementOverlapMask(double hRot, double kRot) {
   getImage()->incrementOverlapMask(x, y, shoebox);
 }
 
-bool Miller::isOverlappedWithSpots(std::vector<SpotPtr> *spots,
-                                   bool actuallyDelete) {
+bool Miller::isOverlappedWithSpots(SpotHash *spots, bool actuallyDelete) {
   double x = correctedX;
   double y = correctedY;
   int count = 0;
-  double tolerance = 2.5;
+  double tolerance = SPOT_OVERLAP_TOLERANCE;
+
+  std::vector<int> near;
+  spots->findNear(new_vector(x, y, 0), tolerance, &near);
 
-  for (int i = 0; i < spots->size(); i++) {
-    double x2 = (*spots)[i]->getRawXY().first;
-    double y2 = (*spots)[i]->getRawXY().second;
+  for (int i = 0; i < near.size(); i++) {
+    double x2 = spots->position(near[i]).h;
+    double y2 = spots->position(near[i]).k;
 
     double xDiff = fabs(x2 - x);
     double yDiff = fabs(y2 - y);
 
     if (xDiff < tolerance && yDiff < tolerance) {
       if (actuallyDelete) {
-        spots->erase(spots->begin() + i);
-        i--;
+        spots->remove(near[i]);
       }
       count++;
     }
@@ -18,6 +18,7 @@
 class MtzManager;
 class Reflection;
 class Image;
+class Miller;
 
 typedef enum {
   CalculationTypeOriginal,
@@ -29,6 +30,24 @@ typedef enum {
   RlpModelGaussian,
 } RlpModel;
 
+typedef double (Miller::*PartialityFunction)(double pB, double qB,
+                                             double beamMean, double beamSigma,
+                                             double beamExp, double limit,
+                                             double integralBeam);
+
+/* Partiality calculation chosen once for a crystal's beam parameters, so
+ * that nothing needs checking for every reflection. */
+typedef struct {
+  PartialityFunction partiality;
+  PartialityFunction norm;
+  bool binary;
+  double wavelength;
+  double bandwidth;
+  double exponent;
+  double limit;
+  double integralBeam;
+} PartialityKernel;
+
 class Miller : public LoggableObject,
                public boost::enable_shared_from_this<Miller> {
  private:
@@ -71,8 +90,10 @@ class Miller : public LoggableObject,
   // in pixels
   std::pair<float, float> shift;
 
-  double superGaussian(double bandwidth, double mean, double sigma,
-                       double exponent);
+  template <bool binary, bool trackWavelength, bool lookupTable>
+  double partialityIntegral(double pB, double qB, double beamMean,
+                            double beamSigma, double beamExp, double limit,
+                            double integralBeam);
 
   void recalculatePredictedWavelength();
 
@@ -113,6 +134,7 @@ class Miller : public LoggableObject,
   Miller(MtzManager *parent, int _h = 0, int _k = 0, int _l = 0,
          bool calcFree = true);
   MillerPtr copy(void);
+  MillerPtr copyForDetector(DetectorPtr detector);
 
   static double scaleForScaleAndBFactor(double scaleFactor, double bFactor,
                                         double resol,
@@ -122,8 +144,7 @@ class Miller : public LoggableObject,
                                 double *limitHigh, vec *inwards = NULL,
                                 vec *outwards = NULL);
 
-  bool isOverlappedWithSpots(std::vector<SpotPtr> *spots,
-                             bool actuallyDelete = true);
+  bool isOverlappedWithSpots(SpotHash *spots, bool actuallyDelete = true);
   void setPartialityModel(PartialityModel model);
   void setData(double _intensity, double _sigma, double _partiality,
                double _wavelength);
@@ -163,6 +184,11 @@ class Miller : public LoggableObject,
                              double spotSize, double wavelength,
                              double bandwidth, double exponent,
                              bool binary = false, bool no_norm = false);
+  void recalculatePartiality(MatrixPtr rotatedMatrix, double mosaicity,
+                             double spotSize, PartialityKernel *kernel);
+  static PartialityKernel partialityKernel(double wavelength, double bandwidth,
+                                           double exponent, bool binary,
+                                           bool lookupTable);
   double calculatePartiality(double pB, double qB, double beamMean,
                              double beamSigma, double beamExp,
                              double binary = false);
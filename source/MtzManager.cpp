@@ -14,6 +14,7 @@
 #include "Miller.h"
 #include "RefinementStepSearch.h"
 #include "Reflection.h"
+#include "SpotHash.h"
 #include "StatisticsManager.h"
 #include "Vector.h"
 #include "ccp4_general.h"
@@ -40,6 +41,7 @@ double MtzManager::superGaussianScale = 0;
 
 MtzManager *MtzManager::referenceManager = NULL;
 MtzPtr MtzManager::differenceManager = MtzPtr();
+MtzWriterPtr MtzManager::refinedWriter = MtzWriterPtr();
 
 std::string MtzManager::describeScoreType() {
   switch (scoreType) {
@@ -202,6 +204,12 @@ MtzManager::MtzManager() {
   dropped = false;
   lastRSplit = 0;
   timeDelay = 0;
+  cycleShift = 0;
+  cycleScoreChange = 0;
+  cycleAmbiguityChanged = false;
+  convergedAmbiguity = -1;
+  convergedCycles = 0;
+  refinementSeconds = 0;
   _xPos = 0;
   _yPos = 0;
 
@@ -684,6 +692,22 @@ int MtzManager::findReflectionWithId(long unsigned int refl_id,
   return -1;
 }
 
+static bool reflectionIdBelow(ReflectionPtr refl, long unsigned int reflId) {
+  return refl->getReflId() < reflId;
+}
+
+/* Position of the reflection with this ID, or -1 if there is none */
+int MtzManager::reflectionIndexWithId(long unsigned int reflId) {
+  std::vector<ReflectionPtr>::iterator low = std::lower_bound(
+      reflections.begin(), reflections.end(), reflId, reflectionIdBelow);
+
+  if (low == reflections.end() || (*low)->getReflId() != reflId) {
+    return -1;
+  }
+
+  return (int)(low - reflections.begin());
+}
+
 void MtzManager::findCommonReflections(MtzManager *other,
                                        vector<ReflectionPtr> &reflectionVector1,
                                        vector<ReflectionPtr> &reflectionVector2,
@@ -948,112 +972,55 @@ void MtzManager::applyPolarisation(void) {
   }
 }
 
-void MtzManager::writeToFile(std::string newFilename, bool announce,
-                             bool plusAmbiguity, bool withScale) {
-  int columns = 11;
-
-  float cell[6], wavelength;
-  float *fdata = new float[columns];
+MtzSnapshotPtr MtzManager::snapshot(std::string newFilename,
+                                    bool plusAmbiguity, bool withScale) {
+  MtzSnapshotPtr snapshot = MtzSnapshotPtr(new MtzSnapshot());
   std::vector<double> unitCell = getUnitCell();
 
-  /* variables for symmetry */
-  CCP4SPG *mtzspg = getSpaceGroup();
-  float rsm[192][4][4];
-  char ltypex[2];
-
-  /* variables for MTZ data structure */
-  MTZ *mtzout;
-  MTZXTAL *xtal;
-  MTZSET *set;
-  MTZCOL *colout[11];
-
-  /*  Removed: General CCP4 initializations e.g. HKLOUT on command line */
+  for (int i = 0; i < 6; i++) {
+    snapshot->cell[i] = unitCell[i];
+  }
 
-  cell[0] = unitCell[0];
-  cell[1] = unitCell[1];
-  cell[2] = unitCell[2];
-  cell[3] = unitCell[3];
-  cell[4] = unitCell[4];
-  cell[5] = unitCell[5];
-  wavelength = this->getWavelength();
+  snapshot->wavelength = this->getWavelength();
+  snapshot->spaceGroup = getSpaceGroup();
 
   if (newFilename == "") {
     newFilename = getFilename();
   }
 
-  std::string outputFile = FileReader::addOutputDirectory(newFilename);
-
-  mtzout = MtzMalloc(0, 0);
-  ccp4_lwtitl(mtzout, "Written from Helen's XFEL tasks ", 0);
-  mtzout->refs_in_memory = 0;
-  mtzout->fileout = MtzOpenForWrite(outputFile.c_str());
-
-  // then add symm headers...
-  for (int i = 0; i < mtzspg->nsymop; ++i)
-    CCP4::rotandtrn_to_mat4(rsm[i], mtzspg->symop[i]);
-  strncpy(ltypex, mtzspg->symbol_old, 1);
-  ccp4_lwsymm(mtzout, mtzspg->nsymop, mtzspg->nsymop_prim, rsm, ltypex,
-              mtzspg->spg_ccp4_num, mtzspg->symbol_old, mtzspg->point_group);
-
-  // then add xtals, datasets, cols
-  xtal = MtzAddXtal(mtzout, "XFEL crystal", "XFEL project", cell);
-  set = MtzAddDataset(mtzout, xtal, "Dataset", wavelength);
-  colout[0] = MtzAddColumn(mtzout, set, "H", "H");
-  colout[1] = MtzAddColumn(mtzout, set, "K", "H");
-  colout[2] = MtzAddColumn(mtzout, set, "L", "H");
-  colout[3] = MtzAddColumn(mtzout, set, "I", "J");
-  colout[4] = MtzAddColumn(mtzout, set, "SIGI", "Q");
-  colout[5] = MtzAddColumn(mtzout, set, "PART", "R");
-  colout[6] = MtzAddColumn(mtzout, set, "WAVE", "R");
-  colout[7] = MtzAddColumn(mtzout, set, "SHIFTX", "R");
-  colout[8] = MtzAddColumn(mtzout, set, "SHIFTY", "R");
-  colout[9] = MtzAddColumn(mtzout, set, "CSIGI", "R");
-  colout[10] = MtzAddColumn(mtzout, set, "REJECT", "R");
-
-  int num = 0;
+  snapshot->filename = newFilename;
 
   if (plusAmbiguity) {
     flipToActiveAmbiguity();
   }
 
+  std::vector<float> &rows = snapshot->rows;
+
   for (int i = 0; i < reflectionCount(); i++) {
     for (int j = 0; j < reflection(i)->millerCount(); j++) {
       MillerPtr miller = reflection(i)->miller(j);
 
-      double intensity = reflections[i]->miller(j)->getRawestIntensity();
+      double intensity = miller->getRawestIntensity();
 
       if (withScale) {
-        intensity = reflections[i]->miller(j)->intensity();
+        intensity = miller->intensity();
       }
-      double sigma = reflections[i]->miller(j)->getRawSigma();
-      double partiality = reflections[i]->miller(j)->getPartiality();
-      double bFactor = reflections[i]->miller(j)->getBFactorScale();
-      double countingSigma = reflections[i]->miller(j)->getRawCountingSigma();
-      double rejectFlags = reflections[i]->miller(j)->getRejectionFlags();
 
       if (intensity != intensity) {
         continue;
       }
 
-      num++;
-
-      int h = reflections[i]->miller(j)->getH();
-      int k = reflections[i]->miller(j)->getK();
-      int l = reflections[i]->miller(j)->getL();
-
-      fdata[0] = h;
-      fdata[1] = k;
-      fdata[2] = l;
-      fdata[3] = intensity / bFactor;
-      fdata[4] = sigma;
-      fdata[5] = partiality;
-      fdata[6] = reflections[i]->miller(j)->getWavelength();
-      fdata[7] = reflections[i]->miller(j)->getCorrectedX();
-      fdata[8] = reflections[i]->miller(j)->getCorrectedY();
-      fdata[9] = countingSigma;
-      fdata[10] = rejectFlags;
-
-      ccp4_lwrefl(mtzout, fdata, colout, columns, num);
+      rows.push_back(miller->getH());
+      rows.push_back(miller->getK());
+      rows.push_back(miller->getL());
+      rows.push_back(intensity / miller->getBFactorScale());
+      rows.push_back(miller->getRawSigma());
+      rows.push_back(miller->getPartiality());
+      rows.push_back(miller->getWavelength());
+      rows.push_back(miller->getCorrectedX());
+      rows.push_back(miller->getCorrectedY());
+      rows.push_back(miller->getRawCountingSigma());
+      rows.push_back(miller->getRejectionFlags());
     }
   }
 
@@ -1061,16 +1028,20 @@ void MtzManager::writeToFile(std::string newFilename, bool announce,
     resetFlip();
   }
 
-  MtzPut(mtzout, " ");
-  MtzFree(mtzout);
+  return snapshot;
+}
+
+void MtzManager::writeToFile(std::string newFilename, bool announce,
+                             bool plusAmbiguity, bool withScale) {
+  MtzSnapshotPtr toWrite = snapshot(newFilename, plusAmbiguity, withScale);
+  int num = MtzWriter::writeMtz(toWrite);
 
   LogLevel shouldAnnounce = announce ? LogLevelNormal : LogLevelDebug;
 
   std::ostringstream logged;
-  logged << "Written " << num << " refls to file " << newFilename << std::endl;
+  logged << "Written " << num << " refls to file " << toWrite->filename
+         << std::endl;
   Logger::mainLogger->addStream(&logged, shouldAnnounce);
-
-  delete[] fdata;
 }
 
 MtzManager::~MtzManager(void) {
@@ -1123,10 +1094,18 @@ int MtzManager::removeStrongSpots(std::vector<SpotPtr> *spots,
                                   bool actuallyDelete) {
   int count = 0;
 
+  /* One index of the spots serves every prediction; spots which overlap
+   * are struck off and removed from the list in one pass at the end */
+  SpotHash hash(*spots, SPOT_OVERLAP_TOLERANCE);
+
   for (int i = 0; i < reflectionCount(); i++) {
     ReflectionPtr ref = reflection(i);
 
-    count += ref->checkSpotOverlaps(spots, actuallyDelete);
+    count += ref->checkSpotOverlaps(&hash, actuallyDelete);
+  }
+
+  if (actuallyDelete) {
+    hash.compact(spots);
   }
 
   return count;
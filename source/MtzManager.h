@@ -10,6 +10,7 @@
 #include <tuple>
 #include "Logger.h"
 #include "Matrix.h"
+#include "MtzWriter.h"
 #include "definitions.h"
 #include "hasFilename.h"
 #include "hasSymmetry.h"
@@ -98,6 +99,14 @@ class MtzManager : public LoggableObject,
 
   double timeDelay;
 
+  /* Convergence of this crystal across refinement cycles */
+  double cycleShift;
+  double cycleScoreChange;
+  bool cycleAmbiguityChanged;
+  int convergedAmbiguity;
+  int convergedCycles;
+  double refinementSeconds;
+
   uint32 activeAmbiguity;
 
   bool optimisingWavelength;
@@ -140,6 +149,7 @@ class MtzManager : public LoggableObject,
   MatrixPtr rotatedMatrix;
   static MtzManager *referenceManager;
   static MtzPtr differenceManager;
+  static MtzWriterPtr refinedWriter;
   MtzManager *lastReference;
 
   int _xPos;
@@ -195,10 +205,12 @@ class MtzManager : public LoggableObject,
   virtual void loadReflections();
   void dropReflections();
   static void setReference(MtzManager *reference);
+  static void setRefinedWriter(MtzWriterPtr writer) { refinedWriter = writer; }
   ReflectionPtr findReflectionWithId(ReflectionPtr exampleRefl,
                                      size_t *lowestId = NULL);
   int findReflectionWithId(long unsigned int refl_id, ReflectionPtr *reflection,
                            bool insertionPoint = false);
+  int reflectionIndexWithId(long unsigned int reflId);
   void findCommonReflections(MtzManager *other,
                              vector<ReflectionPtr> &reflectionVector1,
                              vector<ReflectionPtr> &reflectionVector2,
@@ -223,6 +235,8 @@ class MtzManager : public LoggableObject,
 
   virtual void writeToFile(std::string newFilename, bool announce = false,
                            bool plusAmbiguity = false, bool withScale = false);
+  MtzSnapshotPtr snapshot(std::string newFilename, bool plusAmbiguity = false,
+                          bool withScale = false);
   void writeToHdf5();
 
   double correlationWithManager(
@@ -272,9 +286,23 @@ class MtzManager : public LoggableObject,
   double rSplit(double low, double high);
   double rewardAgreement(double low, double high);
   std::string describeScoreType();
-  double refinePartialitiesOrientation(int ambiguity, bool reset = true);
+  double refinePartialitiesOrientation(int ambiguity, bool reset = true,
+                                       int cycles = 0);
+
+  void refinePartialities(bool verification = false);
+
+  void beginConvergenceCycle();
+  bool updateConvergence();
+
+  bool hasConverged() { return convergedCycles > 0; }
+
+  int getConvergedCycles() { return convergedCycles; }
+
+  void setConvergedCycles(int cycles) { convergedCycles = cycles; }
+
+  double getRefinementSeconds() { return refinementSeconds; }
 
-  void refinePartialities();
+  void setRefinementSeconds(double seconds) { refinementSeconds = seconds; }
 
   void refreshCurrentPartialities();
   // delete
@@ -103,7 +103,8 @@ void MtzManager::addParameters(RefinementStrategyPtr refiner) {
   }
 }
 
-double MtzManager::refinePartialitiesOrientation(int ambiguity, bool reset) {
+double MtzManager::refinePartialitiesOrientation(int ambiguity, bool reset,
+                                                 int cycles) {
   this->setActiveAmbiguity(ambiguity);
   scoreType = defaultScoreType;
 
@@ -139,6 +140,10 @@ beam->addParameters(refinementMap);
 
   addParameters(refinementMap);
 
+  if (cycles > 0) {
+    refinementMap->setCycles(cycles);
+  }
+
   refinementMap->setJobName("Refining " + getFilename());
   refinementMap->setEvaluationFunction(refineParameterScore, this);
 
@@ -148,28 +153,72 @@ beam->addParameters(refinementMap);
 
   if (reset) {
     refinementMap->resetToInitialParameters();
+  } else {
+    double shift = refinementMap->largestShift();
+    double change = refinementMap->scoreChange();
+
+    if (shift > cycleShift || shift != shift) cycleShift = shift;
+    if (change > cycleScoreChange || change != change)
+      cycleScoreChange = change;
   }
 
   return correl;
 }
 
-void MtzManager::refinePartialities() {
+void MtzManager::beginConvergenceCycle() {
+  cycleShift = 0;
+  cycleScoreChange = 0;
+  cycleAmbiguityChanged = false;
+}
+
+bool MtzManager::updateConvergence() {
+  double scoreTolerance =
+      FileParser::getKey("CONVERGENCE_SCORE_TOLERANCE", 0.01);
+
+  /* Every parameter moved by less than its own convergence step */
+  bool stable = (cycleShift <= 1 && cycleScoreChange <= scoreTolerance &&
+                 !cycleAmbiguityChanged);
+
+  if (stable) {
+    convergedCycles++;
+  } else {
+    convergedCycles = 0;
+  }
+
+  return stable;
+}
+
+void MtzManager::refinePartialities(bool verification) {
   std::vector<double> correlations;
   double maxCorrel = -1;
   int bestAmbiguity = 0;
+  int cycles = 0;
 
-  for (int i = 0; i < ambiguityCount(); i++) {
-    correlations.push_back(refinePartialitiesOrientation(i));
-  }
+  /* A converged crystal keeps its ambiguity and gets a short check */
+  if (verification && convergedAmbiguity >= 0) {
+    bestAmbiguity = convergedAmbiguity;
+    int fullCycles = FileParser::getKey("NELDER_MEAD_CYCLES", 30);
+    cycles = std::max(fullCycles / 4, 2);
+  } else {
+    for (int i = 0; i < ambiguityCount(); i++) {
+      correlations.push_back(refinePartialitiesOrientation(i));
+    }
 
-  for (int i = 0; i < ambiguityCount(); i++) {
-    if (correlations[i] > maxCorrel) {
-      bestAmbiguity = i;
-      maxCorrel = correlations[i];
+    for (int i = 0; i < ambiguityCount(); i++) {
+      if (correlations[i] > maxCorrel) {
+        bestAmbiguity = i;
+        maxCorrel = correlations[i];
+      }
     }
   }
 
-  refinePartialitiesOrientation(bestAmbiguity, false);
+  if (convergedAmbiguity >= 0 && bestAmbiguity != convergedAmbiguity) {
+    cycleAmbiguityChanged = true;
+  }
+
+  convergedAmbiguity = bestAmbiguity;
+
+  refinePartialitiesOrientation(bestAmbiguity, false, cycles);
   double partCorrel = leastSquaresPartiality();
   setRefPartCorrel(partCorrel);
 
@@ -182,7 +231,13 @@ void MtzManager::refinePartialities() {
          << "\t" << accepted() << std::endl;
   sendLog();
 
-  writeToFile(std::string("ref-") + getFilename());
+  if (refinedWriter) {
+    if (refinedWriter->isEnabled()) {
+      refinedWriter->queue(snapshot(std::string("ref-") + getFilename()));
+    }
+  } else {
+    writeToFile(std::string("ref-") + getFilename());
+  }
 }
 
 void MtzManager::refreshCurrentPartialities() {
@@ -224,11 +279,26 @@ void MtzManager::refreshPartialities(double hRot, double kRot, double mosaicity,
   MatrixPtr newMatrix = MatrixPtr();
   Miller::rotateMatrixHKL(hRot, kRot, 0, matrix, &newMatrix);
 
+  /* Without a crystal wavelength, each Miller falls back to its image's */
+  if (wavelength == 0) {
+    for (int i = 0; i < reflections.size(); i++) {
+      for (int j = 0; j < reflections[i]->millerCount(); j++) {
+        MillerPtr miller = reflections[i]->miller(j);
+        miller->recalculatePartiality(newMatrix, mosaicity, spotSize,
+                                      wavelength, bandwidth, exponent);
+      }
+    }
+
+    return;
+  }
+
+  PartialityKernel kernel = Miller::partialityKernel(
+      wavelength, bandwidth, exponent, false, setupGaussianTable());
+
   for (int i = 0; i < reflections.size(); i++) {
     for (int j = 0; j < reflections[i]->millerCount(); j++) {
       MillerPtr miller = reflections[i]->miller(j);
-      miller->recalculatePartiality(newMatrix, mosaicity, spotSize, wavelength,
-                                    bandwidth, exponent);
+      miller->recalculatePartiality(newMatrix, mosaicity, spotSize, &kernel);
     }
   }
 
@@ -8,7 +8,9 @@
 //
 
 #include "MtzMerger.h"
+#include <algorithm>
 #include <fstream>
+#include "BatchScaler.h"
 #include "FileParser.h"
 #include "FileReader.h"
 #include "Miller.h"
@@ -22,20 +24,6 @@
 
 // MARK: Miscellaneous
 
-void MtzMerger::splitAllMtzs(std::vector<MtzPtr> &firstHalfMtzs,
-                             std::vector<MtzPtr> &secondHalfMtzs) {
-  int all = (int)allMtzs.size();
-  int half = (int)allMtzs.size() / 2;
-
-  firstHalfMtzs.reserve(half);
-  secondHalfMtzs.reserve(all - half);
-
-  firstHalfMtzs.insert(firstHalfMtzs.begin(), allMtzs.begin(),
-                       allMtzs.begin() + half);
-  secondHalfMtzs.insert(secondHalfMtzs.begin(), allMtzs.begin() + half,
-                        allMtzs.end());
-}
-
 std::string MtzMerger::makeFilename(std::string prefix) {
   std::string aFilename = prefix + i_to_str(cycle) + ".mtz";
 
@@ -62,6 +50,11 @@ double MtzMerger::maxResolution() {
         maxRes = thisRes;
       }
     }
+
+    /* The reduce has no crystals of its own */
+    if (reduceShards && shardInfo.maxResolution > maxRes) {
+      maxRes = shardInfo.maxResolution;
+    }
   } else if (lowMemoryMode) {
     /* Return a default, any default! */
     maxRes = 1.4;
@@ -72,9 +65,8 @@ double MtzMerger::maxResolution() {
 
 // MARK: write type of MTZ
 
-void MtzMerger::createUnmergedMtz() {
-  float cell[6], wavelength, fdata[9];
-  int num = 0;
+void MtzMerger::queueUnmergedMtz(std::string name, signed char halfSet) {
+  float cell[6], wavelength;
 
   /* variables for symmetry */
   CCP4SPG *mtzspg = mergedMtz->getSpaceGroup();
@@ -82,10 +74,10 @@ void MtzMerger::createUnmergedMtz() {
   char ltypex[2];
 
   /* variables for MTZ data structure */
+  UnmergedOutput output;
   MTZ *mtzout;
   MTZXTAL *xtal;
   MTZSET *set;
-  MTZCOL *colout[5];
 
   /*  Removed: General CCP4 initializations e.g. HKLOUT on command line */
 
@@ -97,7 +89,7 @@ void MtzMerger::createUnmergedMtz() {
 
   wavelength = 0;
 
-  std::string fullPath = FileReader::addOutputDirectory("u_" + filename);
+  std::string fullPath = FileReader::addOutputDirectory(name);
 
   mtzout = MtzMalloc(0, 0);
   ccp4_lwtitl(mtzout, "Unmerged dataset ", 0);
@@ -114,13 +106,24 @@ void MtzMerger::createUnmergedMtz() {
   // then add xtals, datasets, cols
   xtal = MtzAddXtal(mtzout, "XFEL crystal", "XFEL project", cell);
   set = MtzAddDataset(mtzout, xtal, "Dataset", wavelength);
-  colout[0] = MtzAddColumn(mtzout, set, "H", "H");
-  colout[1] = MtzAddColumn(mtzout, set, "K", "H");
-  colout[2] = MtzAddColumn(mtzout, set, "L", "H");
-  colout[3] = MtzAddColumn(mtzout, set, "I", "J");
-  colout[4] = MtzAddColumn(mtzout, set, "SIGI", "Q");
+  output.columns[0] = MtzAddColumn(mtzout, set, "H", "H");
+  output.columns[1] = MtzAddColumn(mtzout, set, "K", "H");
+  output.columns[2] = MtzAddColumn(mtzout, set, "L", "H");
+  output.columns[3] = MtzAddColumn(mtzout, set, "I", "J");
+  output.columns[4] = MtzAddColumn(mtzout, set, "SIGI", "Q");
 
-  for (int i = 0; i < mergedMtz->reflectionCount(); i++) {
+  output.mtz = mtzout;
+  output.rows = 0;
+  output.halfSet = halfSet;
+
+  queuedUnmerged.push_back(output);
+}
+
+void MtzMerger::writeUnmergedRows(UnmergedOutput *output, int begin,
+                                  int end) {
+  float fdata[5];
+
+  for (int i = begin; i < end; i++) {
     ReflectionPtr refl = mergedMtz->reflection(i);
     MillerPtr miller = refl->miller(0);
     int h = miller->getH();
@@ -129,6 +132,11 @@ void MtzMerger::createUnmergedMtz() {
 
     for (int j = 0; j < refl->liteMillerCount(); j++) {
       LiteMiller lite = refl->liteMiller(j);
+
+      if (output->halfSet != -1 && lite.halfSet != output->halfSet) {
+        continue;
+      }
+
       double meanIntensity = lite.intensity;
       double meanSigma = lite.weight;
 
@@ -136,26 +144,29 @@ void MtzMerger::createUnmergedMtz() {
         continue;
       }
 
-      num++;
+      output->rows++;
 
       fdata[0] = h;
       fdata[1] = k;
       fdata[2] = l;
       fdata[3] = meanIntensity;
       fdata[4] = meanSigma;
-      ccp4_lwrefl(mtzout, fdata, colout, 5, num);
+      ccp4_lwrefl(output->mtz, fdata, output->columns, 5, output->rows);
     }
   }
+}
 
+void MtzMerger::closeUnmergedMtz(UnmergedOutput *output) {
   // print header information, just for info
   //  ccp4_lhprt(mtzout, 1);
-  MtzPut(mtzout, " ");
-  MtzFree(mtzout);
+  MtzPut(output->mtz, " ");
+  MtzFree(output->mtz);
 }
 
-void MtzMerger::createAnomalousDiffMtz(MtzPtr negative, MtzPtr positive) {
-  for (int i = 0; i < mergedMtz->reflectionCount(); i++) {
-    ReflectionPtr refl = mergedMtz->reflection(i);
+void MtzMerger::createAnomalousDiffMtz(MtzPtr target, MtzPtr negative,
+                                       MtzPtr positive) {
+  for (int i = 0; i < target->reflectionCount(); i++) {
+    ReflectionPtr refl = target->reflection(i);
     MillerPtr meanMiller = refl->miller(0);
     int reflId = (int)refl->getReflId();
 
@@ -166,7 +177,7 @@ void MtzMerger::createAnomalousDiffMtz(MtzPtr negative, MtzPtr positive) {
     positive->findReflectionWithId(reflId, &posRefl);
 
     if (!posRefl || !negRefl) {
-      mergedMtz->removeReflection(i);
+      target->removeReflection(i);
       i--;
       continue;
     }
@@ -338,9 +349,13 @@ MtzRejectionReason MtzMerger::isMtzAccepted(MtzPtr mtz) {
   return MtzRejectionNotRejected;
 }
 
-bool MtzMerger::mtzIsPruned(MtzPtr mtz) {
+bool MtzMerger::mtzIsPruned(MtzPtr mtz, MtzRejectionReason *reason) {
   MtzRejectionReason rejectReason = isMtzAccepted(mtz);
 
+  if (reason) {
+    *reason = rejectReason;
+  }
+
   std::lock_guard<std::mutex> lg(*rejectMutex);
 
   logged << "Rejecting " << mtz->getFilename() << " " << rejectReason
@@ -382,37 +397,28 @@ void MtzMerger::summary() {
 
 // MARK: scaling
 
-void MtzMerger::scaleIndividual(MtzPtr mtz) {
-  double scale = 1;
-
-  if (scalingType == ScalingTypeAverage) {
-    scale = 1000 / mtz->averageIntensity();
-  } else if (scalingType == ScalingTypeReference) {
-    MtzManager *reference = MtzManager::getReferenceManager();
-
-    mtz->scaleToMtz(reference, true);
-  } else if (scalingType == ScalingTypeBFactor) {
-    double bFactor, scale;
-    mtz->bFactorAndScale(&scale, &bFactor);
-  }
-
-  mtz->applyScaleFactor(scale);
+void MtzMerger::makeScaler() {
+  /* Reference intensities are looked up once for every crystal */
+  scaler = BatchScalerPtr(
+      new BatchScaler(MtzManager::getReferenceManager(), scalingType));
 }
 
+void MtzMerger::scaleIndividual(MtzPtr mtz) { scaler->scale(mtz); }
+
 void MtzMerger::scale() {
   if (!needToScale) {
     return;
   }
 
-  for (int i = 0; i < someMtzs.size(); i++) {
-    scaleIndividual(someMtzs[i]);
-  }
+  makeScaler();
+  scaler->scaleAll(someMtzs);
 }
 
 // MARK: params_cycle_X.csv.
 
 void MtzMerger::writeParameterCSV() {
-  if (silent) return;
+  /* Left to the reduce step when sharded */
+  if (silent || shardIndex >= 0) return;
 
   std::ofstream paramLog;
   std::string paramLogName = "params_cycle_" + i_to_str(cycle) + ".csv";
@@ -428,6 +434,11 @@ void MtzMerger::writeParameterCSV() {
     params << allMtzs[i]->writeParameterSummary() << std::endl;
   }
 
+  /* The reduce writes the lines stored by its shards, in crystal order */
+  for (int i = 0; i < storedParameters.size(); i++) {
+    params << storedParameters[i] << std::endl;
+  }
+
   params.close();
   logged << "N: --------------------------" << std::endl;
   logged << "N: Written parameter values to " << fullPath << std::endl;
@@ -450,9 +461,9 @@ void MtzMerger::makeEmptyReflectionShells(MtzPtr whichMtz) {
   double maxRes = maxResolution();
   int maxMillers[3];
 
-  CCP4SPG *spg = allMtzs[0]->getSpaceGroup();
-  MatrixPtr anyMat = allMtzs[0]->getMatrix();
-  std::vector<double> unitCell = allMtzs[0]->getUnitCell();
+  CCP4SPG *spg = symmetryMtz->getSpaceGroup();
+  MatrixPtr anyMat = symmetryMtz->getMatrix();
+  std::vector<double> unitCell = symmetryMtz->getUnitCell();
   anyMat->maxMillers(maxMillers, maxRes);
 
   for (int h = -maxMillers[0]; h <= maxMillers[0]; h++) {
@@ -485,15 +496,13 @@ void MtzMerger::makeEmptyReflectionShells(MtzPtr whichMtz) {
   }
 }
 
-void MtzMerger::addMtzMillers(MtzPtr mtz) {
+void MtzMerger::addMtzMillers(MtzPtr mtz, unsigned char halfSet,
+                              std::vector<LiteContribution> *buffer) {
   for (int j = 0; j < mtz->reflectionCount(); j++) {
     ReflectionPtr refl = mtz->reflection(j);
-    ReflectionPtr partnerRefl;
-    int reflId = (int)refl->getReflId();
+    int index = mergedMtz->reflectionIndexWithId(refl->getReflId());
 
-    mergedMtz->findReflectionWithId(reflId, &partnerRefl);
-
-    if (partnerRefl) {
+    if (index >= 0) {
       for (int k = 0; k < refl->millerCount(); k++) {
         bool accept = true;
 
@@ -526,7 +535,8 @@ void MtzMerger::addMtzMillers(MtzPtr mtz) {
 
             sendLog();
           }
-          partnerRefl->addLiteMiller(miller);
+          LiteMiller lite = Reflection::makeLiteMiller(miller, halfSet);
+          buffer->push_back(std::make_pair(index, lite));
         }
       }
     }
@@ -535,15 +545,40 @@ void MtzMerger::addMtzMillers(MtzPtr mtz) {
 
 void MtzMerger::groupMillerThread(int offset) {
   int maxThreads = FileParser::getMaxThreads();
+  int half = crystalCount / 2;
 
   for (int i = offset; i < allMtzs.size(); i += maxThreads) {
     MtzPtr mtz = allMtzs[i];
+    int fold = mtzFolds[i];
+    unsigned char halfSet = (i < half) ? 0 : 1;
+    MtzRejectionReason reason = MtzRejectionNotRejected;
+    std::string parameters;
+
+    if (fold < 0) {
+      continue;
+    }
+
+    /* Half sets must not change as crystals are added */
+    if (incremental) {
+      halfSet = fold % 2;
+    }
 
     if (lowMemoryMode) {
       mtz->loadReflections();
     }
 
-    if (mtzIsPruned(mtz)) {
+    /* Taken before scaling, as writeParameterCSV would */
+    if (shardIndex >= 0) {
+      parameters = mtz->writeParameterSummary();
+    }
+
+    if (mtzIsPruned(mtz, &reason)) {
+      /* The reduce counts every crystal of a shard, rejected or not */
+      if (shardIndex >= 0) {
+        std::vector<LiteContribution> none;
+        storeCrystal(fold, mtz, &none, reason, parameters);
+      }
+
       continue;
     }
 
@@ -553,7 +588,25 @@ void MtzMerger::groupMillerThread(int offset) {
       scaleIndividual(mtz);
     }
 
-    addMtzMillers(mtz);
+    addMtzMillers(mtz, halfSet, &contributions[fold]);
+
+    if (state) {
+      storeCrystal(fold, mtz, &contributions[fold], reason, parameters);
+    }
+
+    if (shardIndex >= 0) {
+      std::vector<LiteContribution>().swap(contributions[fold]);
+    }
+
+    if (spill && shardIndex < 0) {
+      spill->write(fold, &contributions[fold]);
+
+      reflCountMutex->lock();
+      spilledObservations += contributions[fold].size();
+      reflCountMutex->unlock();
+
+      std::vector<LiteContribution>().swap(contributions[fold]);
+    }
 
     if (lowMemoryMode) {
       mtz->dropReflections();
@@ -567,13 +620,488 @@ void MtzMerger::groupMillerThreadWrapper(MtzMerger *object, int offset) {
   object->groupMillerThread(offset);
 }
 
-void MtzMerger::groupMillers() {
-  mergedMtz = MtzPtr(new MtzManager());
-  mergedMtz->copySymmetryInformationFromManager(allMtzs[0]);
-  mergedMtz->setDefaultMatrix();
+MtzPtr MtzMerger::makeOutputMtz() {
+  MtzPtr output = MtzPtr(new MtzManager());
+
+  /* The reduce has made its own from the shard headers */
+  if (!reduceShards) {
+    symmetryMtz = allMtzs[0];
+
+    /* A shard has read only its own crystals */
+    for (int i = 0; i < allMtzs.size() && !symmetryMtz->reflectionCount();
+         i++) {
+      if (allMtzs[i]->reflectionCount()) {
+        symmetryMtz = allMtzs[i];
+      }
+    }
+  }
+
+  output->copySymmetryInformationFromManager(symmetryMtz);
+  output->setDefaultMatrix();
+
+  makeEmptyReflectionShells(output);
+
+  return output;
+}
+
+void MtzMerger::reduceContributions() {
+  /* Added in crystal order, so each reflection sees its observations in
+   * the same order whatever the number of threads. Nothing is reserved up
+   * front: each crystal's buffer is freed as it is moved, so the lite
+   * millers only grow as the buffers shrink. */
+  for (int i = 0; i < contributions.size(); i++) {
+    for (int j = 0; j < contributions[i].size(); j++) {
+      LiteContribution &contribution = contributions[i][j];
+      mergedMtz->reflection(contribution.first)
+          ->addLiteMiller(contribution.second);
+    }
+
+    std::vector<LiteContribution>().swap(contributions[i]);
+  }
+
+  contributions.clear();
+}
+
+// MARK: Incremental merging.
+
+std::string MtzMerger::groupingSignature() {
+  std::ostringstream signature;
+  CCP4SPG *spg = symmetryMtz->getSpaceGroup();
+  signature << "spg " << (spg ? spg->spg_num : 0) << " scaling "
+            << (needToScale ? (int)scalingType : -1) << " free " << freeOnly;
+
+  return signature.str();
+}
+
+std::string MtzMerger::rejectionSignature() {
+  std::ostringstream signature;
+  signature << "friedel " << friedel << " prevent " << preventRejections
+            << " median " << FileParser::getKey("MERGE_MEDIAN", false)
+            << " reject " << FileParser::getKey("OUTLIER_REJECTION", true)
+            << " sigma "
+            << FileParser::getKey("OUTLIER_REJECTION_SIGMA",
+                                  OUTLIER_REJECTION_SIGMA);
+
+  return signature.str();
+}
+
+void MtzMerger::readStoredCrystals(MergeStatePtr source, bool carryOver,
+                                   std::map<std::string, bool> *folded,
+                                   int *nextFold, int *observationCount,
+                                   int shard) {
+  StoredCrystal crystal;
+
+  while (source->readCrystal(&crystal)) {
+    std::vector<LiteContribution> buffer;
+
+    if (shard >= 0) {
+      checkShardCrystal(shard, &crystal);
+    }
+
+    for (int i = 0; i < crystal.observations.size(); i++) {
+      int index =
+          mergedMtz->reflectionIndexWithId(crystal.observations[i].first);
+
+      /* Reflections beyond the current merge resolution drop out */
+      if (index >= 0) {
+        buffer.push_back(std::make_pair(index, crystal.observations[i].second));
+      }
+    }
+
+    if (carryOver) {
+      state->writeCrystal(&crystal);
+    }
+
+    (*folded)[crystal.name] = true;
+    *nextFold = std::max(*nextFold, crystal.fold + 1);
+    *observationCount += buffer.size();
+
+    if (contributions.size() < *nextFold) {
+      contributions.resize(*nextFold);
+    }
+
+    if (spill) {
+      spill->write(crystal.fold, &buffer);
+      spilledObservations += buffer.size();
+    } else {
+      contributions[crystal.fold].swap(buffer);
+    }
+  }
+}
+
+void MtzMerger::loadMergeState() {
+  std::string filename = FileReader::addOutputDirectory(
+      FileParser::getKey("MERGE_STATE_FILE", std::string("merge_state.dat")));
+
+  state = MergeStatePtr(new MergeState(filename));
+  bool cacheValid = false;
+  bool loaded = state->open(groupingSignature(), rejectionSignature(),
+                            &cacheValid);
+
+  /* If the new state cannot be written, the old one is still merged */
+  state->beginWrite(groupingSignature(), rejectionSignature());
+
+  std::map<std::string, bool> folded;
+  int nextFold = 0;
+  int observationCount = 0;
+
+  if (loaded) {
+    readStoredCrystals(state, true, &folded, &nextFold, &observationCount);
+  }
+
+  int reflections = mergedMtz->reflectionCount();
+  currentResults = std::vector<MergeResult>(reflections);
+  cachedResults = std::vector<MergeResult>(reflections);
+  useCachedResults = (loaded && cacheValid);
+
+  for (int i = 0; i < reflections; i++) {
+    cachedResults[i].valid = false;
+    currentResults[i].valid = false;
+  }
+
+  if (useCachedResults) {
+    std::vector<std::pair<unsigned int, MergeResult> > results;
+    state->readResults(&results);
+
+    for (int i = 0; i < results.size(); i++) {
+      int index = mergedMtz->reflectionIndexWithId(results[i].first);
+
+      if (index >= 0) {
+        cachedResults[index] = results[i].second;
+      }
+    }
+  }
+
+  int newCrystals = 0;
+
+  for (int i = 0; i < allMtzs.size(); i++) {
+    if (folded.count(allMtzs[i]->getFilename())) {
+      mtzFolds[i] = -1;
+      continue;
+    }
+
+    mtzFolds[i] = nextFold;
+    nextFold++;
+    newCrystals++;
+  }
+
+  contributions.resize(nextFold);
+
+  logged << "N: Incremental merge: " << folded.size()
+         << " crystals already merged (" << observationCount
+         << " observations), folding in " << newCrystals << " new crystals."
+         << std::endl;
+  sendLog();
+}
+
+void MtzMerger::storeCrystal(int fold, MtzPtr mtz,
+                             std::vector<LiteContribution> *buffer,
+                             MtzRejectionReason reason,
+                             std::string parameters) {
+  StoredCrystal crystal;
+  crystal.fold = fold;
+  crystal.name = mtz->getFilename();
+  crystal.rejection = reason;
+  crystal.parameters = parameters;
+  crystal.observations.reserve(buffer->size());
+
+  for (int i = 0; i < buffer->size(); i++) {
+    int index = (*buffer)[i].first;
+    unsigned int reflId = mergedMtz->reflection(index)->getReflId();
+    crystal.observations.push_back(std::make_pair(reflId, (*buffer)[i].second));
+  }
+
+  state->writeCrystal(&crystal);
+
+  std::lock_guard<std::mutex> lg(*reflCountMutex);
+
+  for (int i = 0; i < buffer->size(); i++) {
+    changedReflections[(*buffer)[i].first] = 1;
+  }
+}
+
+void MtzMerger::saveMergeState() {
+  std::vector<std::pair<unsigned int, MergeResult> > results;
+  int reused = 0;
+
+  for (int i = 0; i < currentResults.size(); i++) {
+    if (!currentResults[i].valid) {
+      continue;
+    }
+
+    if (!changedReflections[i] && cachedResults[i].valid) {
+      reused++;
+    }
+
+    unsigned int reflId = mergedMtz->reflection(i)->getReflId();
+    results.push_back(std::make_pair(reflId, currentResults[i]));
+  }
+
+  logged << "N: Reused merged values for " << reused << " of "
+         << results.size() << " reflections." << std::endl;
+  sendLog();
+
+  state->finishWrite(&results);
+  state = MergeStatePtr();
+}
+
+// MARK: Sharded merging.
+
+std::string MtzMerger::shardFilename(int index) {
+  std::string name = "merge_shard_" + i_to_str(index) + "_of_" +
+                     i_to_str(shardCount) + ".dat";
+
+  return FileReader::addOutputDirectory(name);
+}
+
+/* Header of this shard's file, from the full crystal list and the
+ * crystals it has read */
+void MtzMerger::makeShardInfo() {
+  shardInfo = ShardInfo();
+  shardInfo.symmetryFold = -1;
+
+  for (int i = 0; i < allMtzs.size(); i++) {
+    shardInfo.crystals.push_back(allMtzs[i]->getFilename());
+
+    if (!allMtzs[i]->reflectionCount()) {
+      continue;
+    }
+
+    double thisRes = allMtzs[i]->maxResolution();
+    shardInfo.maxResolution = std::max(shardInfo.maxResolution, thisRes);
+
+    if (allMtzs[i] == symmetryMtz) {
+      shardInfo.symmetryFold = i;
+    }
+  }
+
+  if (shardInfo.symmetryFold < 0) {
+    return;
+  }
+
+  shardInfo.spaceGroup = symmetryMtz->getSpaceGroupNum();
+  shardInfo.unitCell = symmetryMtz->getUnitCell();
+
+  if (symmetryMtz->getMatrix()) {
+    double *components = symmetryMtz->getMatrix()->components;
+    shardInfo.matrix = std::vector<double>(components, components + 16);
+  }
+}
+
+/* Opens every shard and checks that they agree on the crystal list before
+ * anything is merged. The output takes the symmetry of the first crystal
+ * with reflections, as a single-process merge would. */
+void MtzMerger::loadShardInfo() {
+  shards.clear();
+  shardInfo = ShardInfo();
+  shardInfo.symmetryFold = -1;
+  std::string grouping;
+
+  if (shardCount <= 0) {
+    logged << "Set MERGE_SHARD_COUNT to the number of shards to reduce."
+           << std::endl;
+    sendLogAndExit();
+  }
+
+  for (int i = 0; i < shardCount; i++) {
+    MergeStatePtr shard = MergeStatePtr(new MergeState(shardFilename(i)));
+    ShardInfo info;
+    bool unused = false;
+
+    if (!shard->open("", "", &unused, &info)) {
+      logged << "Cannot merge without shard " << shardFilename(i) << std::endl;
+      sendLogAndExit();
+    }
+
+    if (i > 0 && info.crystals != shardInfo.crystals) {
+      logged << "Shard " << shardFilename(i) << " lists "
+             << info.crystals.size() << " crystals which do not match the "
+             << shardInfo.crystals.size() << " of " << shardFilename(0)
+             << "; all shards must be made from the same crystal list."
+             << std::endl;
+      sendLogAndExit();
+    }
+
+    shardInfo.crystals.swap(info.crystals);
+    shardInfo.maxResolution =
+        std::max(shardInfo.maxResolution, info.maxResolution);
+    shards.push_back(shard);
+
+    /* Shards which read no crystals could not know their symmetry */
+    if (info.symmetryFold < 0) {
+      continue;
+    }
+
+    if (grouping.length() && shard->groupingSignature() != grouping) {
+      logged << "Shard " << shardFilename(i) << " was grouped with different "
+             << "settings (" << shard->groupingSignature() << ") from the "
+             << "others (" << grouping << ")." << std::endl;
+      sendLogAndExit();
+    }
+
+    grouping = shard->groupingSignature();
+
+    if (shardInfo.symmetryFold < 0 ||
+        info.symmetryFold < shardInfo.symmetryFold) {
+      shardInfo.symmetryFold = info.symmetryFold;
+      shardInfo.spaceGroup = info.spaceGroup;
+      shardInfo.unitCell = info.unitCell;
+      shardInfo.matrix = info.matrix;
+    }
+  }
+
+  if (shardInfo.symmetryFold < 0) {
+    logged << "None of the " << shardCount << " shards read any crystals."
+           << std::endl;
+    sendLogAndExit();
+  }
+
+  symmetryMtz = MtzPtr(new MtzManager());
+  symmetryMtz->setSpaceGroupNum(shardInfo.spaceGroup);
+  symmetryMtz->setUnitCell(shardInfo.unitCell);
+  symmetryMtz->setMatrix(MatrixPtr(new Matrix(&shardInfo.matrix[0])));
+
+  if (grouping != groupingSignature()) {
+    logged << "Shards were grouped with different settings (" << grouping
+           << ") from this reduce (" << groupingSignature() << ")."
+           << std::endl;
+    sendLogAndExit();
+  }
+}
+
+/* Each crystal must come once, from the shard which owns its fold */
+void MtzMerger::checkShardCrystal(int shard, StoredCrystal *crystal) {
+  int fold = crystal->fold;
 
-  makeEmptyReflectionShells(mergedMtz);
+  if (fold >= shardInfo.crystals.size() || fold % shardCount != shard ||
+      shardInfo.crystals[fold] != crystal->name) {
+    logged << "Shard " << shardFilename(shard) << " holds crystal "
+           << crystal->name << " as number " << fold
+           << ", which does not belong to it." << std::endl;
+    sendLogAndExit();
+  }
+
+  if (shardFolds[fold]) {
+    logged << "Crystal " << crystal->name << " (number " << fold
+           << ") appears more than once in " << shardFilename(shard)
+           << std::endl;
+    sendLogAndExit();
+  }
+
+  shardFolds[fold] = 1;
+  storedParameters[fold] = crystal->parameters;
+  rejectNums[(MtzRejectionReason)crystal->rejection]++;
+}
+
+void MtzMerger::loadShards() {
+  std::map<std::string, bool> folded;
+  int nextFold = 0;
+  int observationCount = 0;
+  int count = (int)shardInfo.crystals.size();
+
+  shardFolds = std::vector<char>(count, 0);
+  storedParameters = std::vector<std::string>(count);
+
+  /* Folds are indices into the full crystal list, so the observations
+   * are reduced in the same order as a single-process merge */
+  for (int i = 0; i < shards.size(); i++) {
+    readStoredCrystals(shards[i], false, &folded, &nextFold, &observationCount,
+                       i);
+  }
+
+  shards.clear();
+  int missing = 0;
+
+  for (int i = 0; i < count; i++) {
+    if (shardFolds[i]) {
+      continue;
+    }
+
+    if (missing < 10) {
+      logged << "Crystal " << shardInfo.crystals[i] << " (number " << i
+             << ") is missing from " << shardFilename(i % shardCount)
+             << std::endl;
+    }
+
+    missing++;
+  }
+
+  if (missing > 0) {
+    logged << missing << " of " << count << " crystals are missing from the "
+           << "shards; was every shard written to completion?" << std::endl;
+    sendLogAndExit();
+  }
+
+  logged << "N: Reduced " << shardCount << " shards: " << count
+         << " crystals, " << observationCount << " observations." << std::endl;
+  sendLog();
+}
+
+void MtzMerger::writeShard(int index, int count) {
+  shardIndex = index;
+  shardCount = count;
+
+  if (groupAll()) {
+    std::vector<std::pair<unsigned int, MergeResult> > noResults;
+    state->finishWrite(&noResults);
+
+    logged << "N: Written merge shard " << index + 1 << " of " << count
+           << " to " << shardFilename(index) << std::endl;
+    sendLog();
+  }
+
+  state = MergeStatePtr();
+  shardIndex = -1;
+}
+
+bool MtzMerger::groupMillers() {
+  mergedMtz = makeOutputMtz();
   rejectNums = std::map<MtzRejectionReason, int>();
+  contributions.clear();
+  contributions.resize(crystalCount);
+  spilledObservations = 0;
+  spill = MergeSpillPtr();
+  state = MergeStatePtr();
+  mtzFolds.resize(allMtzs.size());
+
+  for (int i = 0; i < allMtzs.size(); i++) {
+    mtzFolds[i] = i;
+  }
+
+  changedReflections = std::vector<char>(mergedMtz->reflectionCount(), 0);
+
+  if (memoryLimit > 0 && shardIndex < 0) {
+    /* Enough buckets that a handful fit in memory at once for most limits,
+     * and few enough to keep one file open for each */
+    int buckets = 256;
+    std::string directory =
+        FileParser::getKey("MERGE_SPILL_DIRECTORY", std::string(""));
+    spill = MergeSpillPtr(
+        new MergeSpill(directory, mergedMtz->reflectionCount(), buckets));
+
+    if (!spill->isOpen()) {
+      spill = MergeSpillPtr();
+    }
+  }
+
+  if (shardIndex >= 0) {
+    /* Each shard groups every shardCount-th crystal */
+    for (int i = 0; i < allMtzs.size(); i++) {
+      mtzFolds[i] = (i % shardCount == shardIndex) ? i : -1;
+    }
+
+    state = MergeStatePtr(new MergeState(shardFilename(shardIndex)));
+    makeShardInfo();
+
+    if (!state->beginWrite(groupingSignature(), "", &shardInfo)) {
+      return false;
+    }
+  } else if (reduceShards) {
+    loadShards();
+  } else if (incremental) {
+    contributions.clear();
+    loadMergeState();
+  }
 
   boost::thread_group threads;
   int maxThreads = FileParser::getMaxThreads();
@@ -584,6 +1112,16 @@ void MtzMerger::groupMillers() {
   }
 
   threads.join_all();
+
+  if (shardIndex >= 0) {
+    return true;
+  }
+
+  if (!spill) {
+    reduceContributions();
+  }
+
+  return true;
 }
 
 // MARK: Merging millers.
@@ -593,7 +1131,7 @@ void MtzMerger::mergeMillersThread(int offset) {
 
   bool mergeMedian = FileParser::getKey("MERGE_MEDIAN", false);
 
-  for (int i = offset; i < mergedMtz->reflectionCount(); i += maxThreads) {
+  for (int i = mergeBegin + offset; i < mergeEnd; i += maxThreads) {
     double intensity = 0;
     double sigma = 0;
     double countingSigma = 0;
@@ -606,11 +1144,30 @@ void MtzMerger::mergeMillersThread(int offset) {
     }
 
     int *rejPtr = preventRejections ? NULL : &rejected;
-
-    if (!mergeMedian) {
-      refl->liteMerge(&intensity, &countingSigma, &sigma, rejPtr, friedel);
+    bool trackResult = (state && mergeTarget == mergedMtz);
+
+    if (trackResult && useCachedResults && !changedReflections[i] &&
+        cachedResults[i].valid) {
+      MergeResult &cached = cachedResults[i];
+      intensity = cached.intensity;
+      countingSigma = cached.countingSigma;
+      sigma = cached.sigma;
+      rejected = cached.rejected;
+    } else if (!mergeMedian) {
+      refl->liteMerge(&intensity, &countingSigma, &sigma, rejPtr,
+                      mergeFriedel, mergeHalfSet);
     } else {
-      refl->medianMerge(&intensity, &countingSigma, rejPtr, friedel);
+      refl->medianMerge(&intensity, &countingSigma, rejPtr, mergeFriedel,
+                        mergeHalfSet);
+    }
+
+    if (trackResult) {
+      MergeResult &result = currentResults[i];
+      result.intensity = intensity;
+      result.countingSigma = countingSigma;
+      result.sigma = sigma;
+      result.rejected = rejected;
+      result.valid = true;
     }
 
     float intFloat = (float)intensity;
@@ -620,19 +1177,18 @@ void MtzMerger::mergeMillersThread(int offset) {
     }
 
     // this could be better coded
-    for (int r = 0; r < rejected; r++) {
+    // (only the full merge is counted, not each half / Friedel output)
+    for (int r = 0; r < rejected && mergeTarget == mergedMtz; r++) {
       incrementRejectedReflections();
     }
 
     // this should exist. we made it earlier.
-    MillerPtr miller = refl->miller(0);
+    MillerPtr miller = mergeTarget->reflection(i)->miller(0);
 
     miller->setRawIntensity(intensity);
     miller->setCountingSigma(countingSigma);
     miller->setSigma(sigma);
     miller->setPartiality(1);
-
-    refl->clearLiteMillers();
   }
 }
 
@@ -640,7 +1196,13 @@ void MtzMerger::mergeMillersThreadWrapper(MtzMerger *object, int offset) {
   object->mergeMillersThread(offset);
 }
 
-void MtzMerger::mergeMillers() {
+void MtzMerger::mergeMillers(MergeOutput *output, int begin, int end) {
+  mergeTarget = output->target;
+  mergeHalfSet = output->halfSet;
+  mergeFriedel = output->friedel;
+  mergeBegin = begin;
+  mergeEnd = end;
+
   boost::thread_group threads;
   int maxThreads = FileParser::getMaxThreads();
 
@@ -650,22 +1212,168 @@ void MtzMerger::mergeMillers() {
   }
 
   threads.join_all();
+
+  mergeTarget = MtzPtr();
+}
+
+MtzPtr MtzMerger::queueOutput(signed char halfSet, signed char friedelSign,
+                              MtzPtr target) {
+  if (!target) {
+    target = makeOutputMtz();
+  }
+
+  /* Shells are made the same way for every output, so reflections of the
+   * target line up with the grouped reflections */
+  if (target->reflectionCount() != mergedMtz->reflectionCount()) {
+    logged << "Merge output does not match grouped reflections." << std::endl;
+    sendLog();
+    return target;
+  }
+
+  MergeOutput output;
+  output.target = target;
+  output.halfSet = halfSet;
+  output.friedel = friedelSign;
+
+  queuedOutputs.push_back(output);
+
+  return target;
+}
+
+void MtzMerger::mergeRange(int begin, int end) {
+  for (int i = 0; i < queuedOutputs.size(); i++) {
+    mergeMillers(&queuedOutputs[i], begin, end);
+  }
+
+  for (int i = 0; i < queuedUnmerged.size(); i++) {
+    writeUnmergedRows(&queuedUnmerged[i], begin, end);
+  }
+}
+
+static bool spillRecordBefore(const SpillRecord &one, const SpillRecord &two) {
+  return one.crystal < two.crystal;
+}
+
+void MtzMerger::mergeSpilledRecords(std::vector<SpillRecord> *spilled,
+                                    int begin, int end) {
+  /* Threads spilled whole crystals in any order; putting them back in
+   * crystal order gives each reflection the same observations, in the
+   * same order, as an in-memory merge */
+  std::stable_sort(spilled->begin(), spilled->end(), spillRecordBefore);
+
+  for (int i = 0; i < spilled->size(); i++) {
+    mergedMtz->reflection((*spilled)[i].reflection)
+        ->addLiteMiller((*spilled)[i].lite);
+  }
+
+  std::vector<SpillRecord>().swap(*spilled);
+
+  mergeRange(begin, end);
+  clearLiteMillers(begin, end);
+}
+
+void MtzMerger::mergeSpilled() {
+  size_t perObservation = sizeof(SpillRecord) + sizeof(LiteMiller);
+  size_t limit = (size_t)(memoryLimit * 1024 * 1024);
+  int loads = 0;
+  int first = 0;
+
+  while (first < spill->bucketCount()) {
+    size_t records = spill->bucketRecords(first);
+    int last = first + 1;
+    int begin = spill->firstReflection(first);
+
+    /* A bucket over the limit on its own is read in several passes, each
+     * keeping an even share of its reflections */
+    if (records * perObservation > limit) {
+      int end = spill->firstReflection(last);
+      int parts = (int)((records * perObservation + limit - 1) / limit);
+      parts = std::min(parts, end - begin);
+
+      for (int i = 0; i < parts; i++) {
+        int partBegin = begin + (int)((long)(end - begin) * i / parts);
+        int partEnd = begin + (int)((long)(end - begin) * (i + 1) / parts);
+
+        std::vector<SpillRecord> spilled;
+        spill->readBucketRange(first, partBegin, partEnd, &spilled);
+
+        if (spilled.size() * perObservation > limit) {
+          logged << "Reflections " << partBegin << " to " << partEnd
+                 << " hold " << spilled.size() << " observations ("
+                 << spilled.size() * perObservation / (1024 * 1024)
+                 << " MB), over MERGE_MEMORY_LIMIT." << std::endl;
+          sendLog();
+        }
+
+        mergeSpilledRecords(&spilled, partBegin, partEnd);
+        loads++;
+      }
+
+      first = last;
+      continue;
+    }
+
+    while (last < spill->bucketCount() &&
+           (records + spill->bucketRecords(last)) * perObservation <= limit) {
+      records += spill->bucketRecords(last);
+      last++;
+    }
+
+    std::vector<SpillRecord> spilled;
+    spill->readBuckets(first, last, &spilled);
+    mergeSpilledRecords(&spilled, begin, spill->firstReflection(last));
+
+    loads++;
+    first = last;
+  }
+
+  logged << "Merged " << spilledObservations << " spilled observations in "
+         << loads << " parts." << std::endl;
+  sendLog(LogLevelDetailed);
+
+  spill = MergeSpillPtr();
+}
+
+void MtzMerger::mergeQueued() {
+  if (spill) {
+    mergeSpilled();
+  } else {
+    mergeRange(0, mergedMtz->reflectionCount());
+    clearLiteMillers(0, mergedMtz->reflectionCount());
+  }
+
+  for (int i = 0; i < queuedUnmerged.size(); i++) {
+    closeUnmergedMtz(&queuedUnmerged[i]);
+  }
+
+  queuedOutputs.clear();
+  queuedUnmerged.clear();
+
+  if (state) {
+    saveMergeState();
+  }
+}
+
+void MtzMerger::clearLiteMillers(int begin, int end) {
+  for (int i = begin; i < end; i++) {
+    mergedMtz->reflection(i)->clearLiteMillers();
+  }
 }
 
 // MARK: remove reflections.
 
-void MtzMerger::removeReflections() {
-  for (int i = mergedMtz->reflectionCount() - 1; i >= 0; i--) {
-    ReflectionPtr refl = mergedMtz->reflection(i);
+void MtzMerger::removeReflections(MtzPtr target) {
+  for (int i = target->reflectionCount() - 1; i >= 0; i--) {
+    ReflectionPtr refl = target->reflection(i);
     if (!refl->anyAccepted()) {
-      mergedMtz->removeReflection(i);
+      target->removeReflection(i);
     }
   }
 }
 
 // MARK: fixSigmas
 
-void MtzMerger::fixSigmas() {
+void MtzMerger::fixSigmas(MtzPtr target) {
   double minRes = 0;
   double maxRes = maxResolution();
 
@@ -678,13 +1386,13 @@ void MtzMerger::fixSigmas() {
     int reflNum = 0;
     std::vector<MillerPtr> millersToCorrect;
 
-    for (int i = 0; i < mergedMtz->reflectionCount(); i++) {
-      if (!mergedMtz->reflection(i)->betweenResolutions(bins[bin],
-                                                        bins[bin + 1])) {
+    for (int i = 0; i < target->reflectionCount(); i++) {
+      if (!target->reflection(i)->betweenResolutions(bins[bin],
+                                                     bins[bin + 1])) {
         continue;
       }
 
-      MillerPtr miller = mergedMtz->reflection(i)->miller(0);
+      MillerPtr miller = target->reflection(i)->miller(0);
 
       if (miller->getCountingSigma() > 0) {
         iSum += miller->intensity();
@@ -717,6 +1425,10 @@ void MtzMerger::fixSigmas() {
 }
 
 int MtzMerger::totalObservations() {
+  if (spill) {
+    return spilledObservations;
+  }
+
   int total = 0;
 
   for (int i = 0; i < mergedMtz->reflectionCount(); i++) {
@@ -761,42 +1473,72 @@ MtzMerger::MtzMerger() {
   freeOnly = false;
   needToScale = true;
   preventRejections = false;
+  observations = 0;
+  rejectsPerImage = 0;
+  mergeHalfSet = -1;
+  mergeFriedel = -1;
+  mergeBegin = 0;
+  mergeEnd = 0;
+  spilledObservations = 0;
+  memoryLimit = FileParser::getKey("MERGE_MEMORY_LIMIT", 0.0);
+  incremental = false;
+  useCachedResults = false;
+  shardIndex = -1;
+  shardCount = 0;
+  reduceShards = false;
+  crystalCount = 0;
 }
 
 // MARK: Things to call from other classes.
 
-void MtzMerger::merge() {
+bool MtzMerger::groupAll() {
   if (MtzManager::getReferenceManager()) {
     double refScale =
         1000 / MtzManager::getReferenceManager()->averageIntensity();
     MtzManager::getReferenceManager()->applyScaleFactor(refScale);
   }
 
-  writeParameterCSV();
+  crystalCount = (int)allMtzs.size();
 
-  if (allMtzs.size() <= 1) {
-    logged << "N: Not enough MTZs, cannot merge." << std::endl;
-    return;
+  /* The reduce writes parameters once it has read them from the shards */
+  if (reduceShards) {
+    loadShardInfo();
+    crystalCount = (int)shardInfo.crystals.size();
+  } else {
+    writeParameterCSV();
   }
 
-  mergedMtz = MtzPtr(new MtzManager());
-  groupMillers();
-  summary();
-  size_t imageNum = allMtzs.size();
+  if (crystalCount <= 1) {
+    logged << "N: Not enough MTZs, cannot merge." << std::endl;
+    sendLog();
+    return false;
+  }
 
-  double rejectsPerImage = (double)rejectedReflections / (double)imageNum;
+  if (needToScale && !reduceShards) {
+    makeScaler();
+  }
 
-  int observations = totalObservations();
+  if (!groupMillers()) {
+    return false;
+  }
 
-  if (needToScale) {
-    createUnmergedMtz();
+  if (reduceShards) {
+    writeParameterCSV();
   }
 
-  mergeMillers();
+  summary();
+  size_t imageNum = crystalCount;
 
-  int totalRefls = mergedMtz->reflectionCount();
+  rejectsPerImage = (double)rejectedReflections / (double)imageNum;
+  observations = totalObservations();
 
-  if (!silent) {
+  return true;
+}
+
+void MtzMerger::finishMerge(MtzPtr target, std::string name, bool verbose) {
+  int totalRefls = target->reflectionCount();
+
+  if (verbose) {
     logged << "N: Total observations: " << observations << std::endl;
     logged << "N: Total unique reflections: " << totalRefls << std::endl;
     logged << "N: Multiplicity: " << (double)observations / (double)totalRefls
@@ -804,11 +1546,11 @@ void MtzMerger::merge() {
     logged << "N: Rejects per image: " << rejectsPerImage << std::endl;
   }
 
-  removeReflections();
+  removeReflections(target);
 
-  int someRefls = mergedMtz->reflectionCount();
+  int someRefls = target->reflectionCount();
 
-  if (!silent) {
+  if (verbose) {
     logged << "N: Reflections present: " << someRefls << std::endl;
     logged << "N: Completeness: "
            << 100 * (double)someRefls / (double)totalRefls << "%." << std::endl;
@@ -816,88 +1558,138 @@ void MtzMerger::merge() {
 
   sendLog();
 
-  fixSigmas();
+  fixSigmas(target);
+
+  target->setFilename(name);
 
-  mergedMtz->setFilename(filename);
-  mergedMtz->writeToFile(filename, !silent);
+  if (name.length()) {
+    target->writeToFile(name, verbose);
+  }
 }
 
-void MtzMerger::copyDetails(MtzMerger &second) {
-  setCycle(second.cycle);
-  setFreeOnly(second.freeOnly);
-  setNeedToScale(second.needToScale);
-  setSilent(true);
-  setExcludeWorst(second.excludeWorst);
-  setScalingType(second.scalingType);
-  setPreventRejections(second.preventRejections);
+void MtzMerger::merge() {
+  if (!groupAll()) {
+    return;
+  }
+
+  if (needToScale) {
+    queueUnmergedMtz("u_" + filename);
+  }
+
+  queueOutput(-1, friedel, mergedMtz);
+  mergeQueued();
+
+  finishMerge(mergedMtz, filename, !silent);
+}
+
+void MtzMerger::reportHalfStatistics(MtzPtr first, MtzPtr second,
+                                     std::string set) {
+  double maxRes = 1 / maxResolution();
+
+  logged << "N: === R split" << (freeOnly ? " (free)" : "")
+         << " ===" << std::endl;
+  sendLog();
+  double rSplit = first->rSplitWithManager(&*second, false, false, 0, maxRes,
+                                           20, NULL, true);
+  logged << "N: === CC half" << (freeOnly ? " (free)" : "")
+         << " ===" << std::endl;
+  sendLog();
+  double correlation = first->correlationWithManager(
+      &*second, false, false, 0, maxRes, 20, NULL, true);
+
+  logged << "N: Final stats (" << set << "): " << rSplit << ", "
+         << correlation << std::endl;
+  sendLog();
 }
 
 void MtzMerger::mergeFull(bool anomalous) {
   time_t startcputime;
   time(&startcputime);
 
-  std::vector<MtzPtr> firstHalfMtzs, secondHalfMtzs;
-  splitAllMtzs(firstHalfMtzs, secondHalfMtzs);
-
-  MtzMerger firstMerge = MtzMerger();
-  firstMerge.setAllMtzs(firstHalfMtzs);
-  firstMerge.setFilename(makeFilename("half1Merge"));
-  firstMerge.copyDetails(*this);
-  anomalous ? firstMerge.mergeAnomalous() : firstMerge.merge();
-  MtzPtr idxMerge = firstMerge.getMergedMtz();
+  if (!filename.length()) {
+    filename = makeFilename("allMerge");
+  }
 
-  bool doRsplit = true;
+  /* Every crystal is flipped, scaled and grouped once. Observations are
+   * tagged with their half of the data set, so the half-set and Friedel
+   * outputs below are all merged from the same grouping. */
+  if (!groupAll()) {
+    return;
+  }
 
-  MtzMerger secondMerge = MtzMerger();
-  secondMerge.setAllMtzs(secondHalfMtzs);
-  secondMerge.setFilename(makeFilename("half2Merge"));
-  secondMerge.copyDetails(*this);
-  anomalous ? secondMerge.mergeAnomalous() : secondMerge.merge();
-  MtzPtr invMerge = secondMerge.getMergedMtz();
+  int half = crystalCount / 2;
+  bool doRsplit = (half > 1 && crystalCount - half > 1);
 
-  if (!idxMerge || !invMerge) {
+  if (!doRsplit) {
     logged << "No images in half-data set or both, not doing R split / CC half "
               "calculations."
            << std::endl;
     sendLog();
-    doRsplit = false;
   }
 
-  if (!filename.length()) {
-    filename = makeFilename("allMerge");
+  MtzPtr halfMerges[2];
+  MtzPtr halfNegatives[2];
+  MtzPtr halfPositives[2];
+  std::string halfNames[2];
+
+  for (int h = 0; h < 2 && doRsplit; h++) {
+    halfNames[h] = makeFilename(h == 0 ? "half1Merge" : "half2Merge");
+
+    if (needToScale) {
+      queueUnmergedMtz("u_" + halfNames[h], h);
+    }
+
+    halfMerges[h] = queueOutput(h, -1);
+
+    if (anomalous) {
+      halfNegatives[h] = queueOutput(h, 0);
+      halfPositives[h] = queueOutput(h, 1);
+    }
   }
 
-  setNeedToScale(false);
+  MtzPtr negative, positive;
 
-  anomalous ? mergeAnomalous() : merge();
+  if (anomalous) {
+    negative = queueOutput(-1, 0);
+    positive = queueOutput(-1, 1);
+  }
 
-  if (!mergedMtz) {
-    return;
+  queueOutput(-1, friedel, mergedMtz);
+  mergeQueued();
+
+  for (int h = 0; h < 2 && doRsplit; h++) {
+    finishMerge(halfMerges[h], halfNames[h], false);
+
+    if (anomalous) {
+      finishMerge(halfNegatives[h], "", false);
+      finishMerge(halfPositives[h], "", false);
+    }
+  }
+
+  if (anomalous) {
+    finishMerge(negative, makeFilename("tmp1Merge"), false);
+    finishMerge(positive, makeFilename("tmp2Merge"), false);
   }
 
-  std::string set = "all";
+  finishMerge(mergedMtz, filename, !silent);
+
+  setNeedToScale(false);
 
   if (anomalous) {
-    set = "anom";
+    writeAnomalousMtz(negative, positive, mergedMtz, makeFilename("anomMerge"));
   }
 
   if (doRsplit) {
-    double maxRes = 1 / maxResolution();
+    reportHalfStatistics(halfMerges[0], halfMerges[1], "all");
 
-    logged << "N: === R split" << (freeOnly ? " (free)" : "")
-           << " ===" << std::endl;
-    sendLog();
-    double rSplit = idxMerge->rSplitWithManager(&*invMerge, false, false, 0,
-                                                maxRes, 20, NULL, true);
-    logged << "N: === CC half" << (freeOnly ? " (free)" : "")
-           << " ===" << std::endl;
-    sendLog();
-    double correlation = idxMerge->correlationWithManager(
-        &*invMerge, false, false, 0, maxRes, 20, NULL, true);
+    if (anomalous) {
+      for (int h = 0; h < 2; h++) {
+        createAnomalousDiffMtz(halfMerges[h], halfNegatives[h],
+                               halfPositives[h]);
+      }
 
-    logged << "N: Final stats (" << set << "): " << rSplit << ", "
-           << correlation << std::endl;
-    sendLog();
+      reportHalfStatistics(halfMerges[0], halfMerges[1], "anom");
+    }
   }
 
   time_t endcputime;
@@ -910,29 +1702,30 @@ void MtzMerger::mergeFull(bool anomalous) {
   int minutes = seconds / 60;
 
   logged << "N: Clock time " << minutes << " minutes, " << finalSeconds
-         << " seconds to merge (" << set << ")" << std::endl;
+         << " seconds to merge (" << (anomalous ? "all, anom" : "all") << ")"
+         << std::endl;
   sendLog();
 }
 
 void MtzMerger::mergeAnomalous() {
-  MtzMerger firstMerge = MtzMerger();
-  firstMerge.setAllMtzs(allMtzs);
-  firstMerge.setFriedel(0);
-  firstMerge.setFilename(makeFilename("tmp1Merge"));
-  firstMerge.copyDetails(*this);
-  firstMerge.merge();
-  MtzPtr negativeMerge = firstMerge.getMergedMtz();
-
-  MtzMerger secondMerge = MtzMerger();
-  secondMerge.setAllMtzs(allMtzs);
-  secondMerge.setFriedel(1);
-  secondMerge.setFilename(makeFilename("tmp2Merge"));
-  secondMerge.copyDetails(*this);
-  secondMerge.merge();
-  MtzPtr positiveMerge = secondMerge.getMergedMtz();
-
-  merge();
-  writeAnomalousMtz(negativeMerge, positiveMerge, mergedMtz,
-                    makeFilename("anomMerge"));
-  createAnomalousDiffMtz(negativeMerge, positiveMerge);
+  if (!groupAll()) {
+    return;
+  }
+
+  if (needToScale) {
+    queueUnmergedMtz("u_" + filename);
+  }
+
+  MtzPtr negative = queueOutput(-1, 0);
+  MtzPtr positive = queueOutput(-1, 1);
+
+  queueOutput(-1, friedel, mergedMtz);
+  mergeQueued();
+
+  finishMerge(negative, makeFilename("tmp1Merge"), false);
+  finishMerge(positive, makeFilename("tmp2Merge"), false);
+  finishMerge(mergedMtz, filename, !silent);
+
+  writeAnomalousMtz(negative, positive, mergedMtz, makeFilename("anomMerge"));
+  createAnomalousDiffMtz(mergedMtz, negative, positive);
 }
@@ -13,6 +13,10 @@
 #include <stdio.h>
 #include <mutex>
 #include "LoggableObject.h"
+#include "MergeSpill.h"
+#include "MergeState.h"
+#include "Reflection.h"
+#include "cmtzlib.h"
 #include "parameters.h"
 
 typedef enum {
@@ -24,6 +28,20 @@ typedef enum {
   MtzRejectionOther,
 } MtzRejectionReason;
 
+/* Output filled in from the grouped observations by mergeQueued */
+typedef struct {
+  MtzPtr target;
+  signed char halfSet;
+  signed char friedel;
+} MergeOutput;
+
+typedef struct {
+  CMtz::MTZ *mtz;
+  CMtz::MTZCOL *columns[5];
+  int rows;
+  signed char halfSet;
+} UnmergedOutput;
+
 class MtzMerger : public LoggableObject {
  private:
   std::mutex *reflCountMutex;
@@ -38,6 +56,7 @@ class MtzMerger : public LoggableObject {
   double rFactorThreshold;
   int minReflectionCounts;
   ScalingType scalingType;
+  BatchScalerPtr scaler;
   bool excludeWorst;
   double rejectSigma;
   std::string filename;
@@ -46,35 +65,114 @@ class MtzMerger : public LoggableObject {
   bool freeOnly;
   bool needToScale;
   bool preventRejections;
+  int observations;
+  double rejectsPerImage;
+
+  /* One buffer per crystal, filled by groupMillerThread */
+  std::vector<std::vector<LiteContribution> > contributions;
+
+  /* Out-of-core merging: observations spilled to disk during grouping */
+  double memoryLimit;
+  MergeSpillPtr spill;
+  int spilledObservations;
+  std::vector<MergeOutput> queuedOutputs;
+  std::vector<UnmergedOutput> queuedUnmerged;
+
+  /* Incremental merging: crystals already folded into the merge state are
+   * not grouped again, and reflections without new observations reuse
+   * their merged value from the state. mtzFolds holds the position of
+   * each crystal in the fold order, or -1 if it was folded before. */
+  bool incremental;
+  MergeStatePtr state;
+  std::vector<int> mtzFolds;
+  std::vector<char> changedReflections;
+  std::vector<MergeResult> cachedResults;
+  std::vector<MergeResult> currentResults;
+  bool useCachedResults;
+
+  /* Sharded merging: a shard groups every shardCount-th crystal into a
+   * shard file; the reduce reads all shard files instead of grouping, and
+   * takes the crystal list, symmetry and resolution from their headers.
+   * shardFolds marks the folds read so far by the reduce. */
+  int shardIndex;
+  int shardCount;
+  bool reduceShards;
+  ShardInfo shardInfo;
+  std::vector<MergeStatePtr> shards;
+  std::vector<char> shardFolds;
+  std::vector<std::string> storedParameters;
+
+  /* Crystals being merged, which for the reduce are not in allMtzs, and
+   * the crystal whose symmetry the merged output takes */
+  int crystalCount;
+  MtzPtr symmetryMtz;
+
+  /* Output being merged by mergeMillersThread */
+  MtzPtr mergeTarget;
+  signed char mergeHalfSet;
+  signed char mergeFriedel;
+  int mergeBegin;
+  int mergeEnd;
 
-  void splitAllMtzs(std::vector<MtzPtr> &firstHalfMtzs,
-                    std::vector<MtzPtr> &secondHalfMtzs);
   MtzRejectionReason isMtzAccepted(MtzPtr mtz);
   std::map<MtzRejectionReason, int> rejectNums;
   std::mutex *rejectMutex;
-  bool mtzIsPruned(MtzPtr mtz);
+  bool mtzIsPruned(MtzPtr mtz, MtzRejectionReason *reason = NULL);
   void summary();
   void writeParameterCSV();
   void groupMillerThread(int offset);
-  void groupMillers();
-  void addMtzMillers(MtzPtr mtz);
+  bool groupMillers();
+  bool groupAll();
+  void addMtzMillers(MtzPtr mtz, unsigned char halfSet,
+                     std::vector<LiteContribution> *buffer);
+  void reduceContributions();
+  std::string groupingSignature();
+  std::string rejectionSignature();
+  void loadMergeState();
+  void readStoredCrystals(MergeStatePtr source, bool carryOver,
+                          std::map<std::string, bool> *folded, int *nextFold,
+                          int *observationCount, int shard = -1);
+  std::string shardFilename(int index);
+  void makeShardInfo();
+  void loadShardInfo();
+  void checkShardCrystal(int shard, StoredCrystal *crystal);
+  void loadShards();
+  void storeCrystal(int fold, MtzPtr mtz,
+                    std::vector<LiteContribution> *buffer,
+                    MtzRejectionReason reason = MtzRejectionNotRejected,
+                    std::string parameters = "");
+  void saveMergeState();
   void makeEmptyReflectionShells(MtzPtr whichMtz);
+  MtzPtr makeOutputMtz();
   double maxResolution();
   static void groupMillerThreadWrapper(MtzMerger *object, int offset);
   std::string makeFilename(std::string prefix);
 
+  void makeScaler();
   void scaleIndividual(MtzPtr mtz);
-  void fixSigmas();
-  void removeReflections();
+  void fixSigmas(MtzPtr target);
+  void removeReflections(MtzPtr target);
   void mergeMillersThread(int offset);
-  void mergeMillers();
+  void mergeMillers(MergeOutput *output, int begin, int end);
+  MtzPtr queueOutput(signed char halfSet, signed char friedelSign,
+                     MtzPtr target = MtzPtr());
+  void queueUnmergedMtz(std::string name, signed char halfSet = -1);
+  void mergeRange(int begin, int end);
+  void mergeQueued();
+  void mergeSpilled();
+  void mergeSpilledRecords(std::vector<SpillRecord> *spilled, int begin,
+                           int end);
+  void finishMerge(MtzPtr target, std::string name, bool verbose);
+  void clearLiteMillers(int begin, int end);
   int totalObservations();
   static void mergeMillersThreadWrapper(MtzMerger *object, int offset);
   static void writeAnomalousMtz(MtzPtr negative, MtzPtr positive, MtzPtr mean,
                                 std::string filename);
-  void createAnomalousDiffMtz(MtzPtr negative, MtzPtr positive);
-  void createUnmergedMtz();
-  void copyDetails(MtzMerger &second);
+  void createAnomalousDiffMtz(MtzPtr target, MtzPtr negative,
+                              MtzPtr positive);
+  void writeUnmergedRows(UnmergedOutput *output, int begin, int end);
+  void closeUnmergedMtz(UnmergedOutput *output);
+  void reportHalfStatistics(MtzPtr first, MtzPtr second, std::string set);
 
   void incrementRejectedReflections();
 
@@ -111,6 +209,15 @@ class MtzMerger : public LoggableObject {
   void setFreeOnly(bool free) { freeOnly = free; }
 
   void setNeedToScale(bool need) { needToScale = need; }
+
+  void setIncremental(bool incr) { incremental = incr; }
+
+  void writeShard(int index, int count);
+
+  void setReduceShards(int count) {
+    reduceShards = true;
+    shardCount = count;
+  }
 };
 
 #endif /* defined(__cppxfel__MtzMerger__) */
@@ -6,7 +6,9 @@
  */
 
 #include "MtzRefiner.h"
+#include <algorithm>
 #include <boost/thread/thread.hpp>
+#include <chrono>
 #include <fstream>
 #include <vector>
 #include "AmbiguityBreaker.h"
@@ -16,6 +18,7 @@
 #include "Image.h"
 #include "IndexManager.h"
 #include "Miller.h"
+#include "ScratchArena.h"
 #include "UnitCellLattice.h"
 #include "Vector.h"
 #include "misc.h"
@@ -44,6 +47,7 @@ MtzRefiner::MtzRefiner() {
   hasRefined = false;
   isPython = false;
   readRefinedMtzs = FileParser::getKey("READ_REFINED_MTZS", false);
+  deferMtzLoading = false;
 
   indexManager = NULL;
 }
@@ -62,6 +66,9 @@ void MtzRefiner::cycleThread(int offset) {
 
   int maxThreads = FileParser::getMaxThreads();
 
+  bool skipConverged = FileParser::getKey("SKIP_CONVERGED_CRYSTALS", false);
+  int verifyInterval = FileParser::getKey("CONVERGED_VERIFY_INTERVAL", 2);
+
   for (int i = offset; i < img_num; i += maxThreads) {
     std::ostringstream logged;
 
@@ -72,8 +79,26 @@ void MtzRefiner::cycleThread(int offset) {
 
       if (!mtz->isRejected()) {
         bool silent = (targets.size() > 0);
+        bool verification = false;
+
+        if (skipConverged && mtz->hasConverged()) {
+          int since = mtz->getConvergedCycles();
+
+          if (verifyInterval <= 0 || since % verifyInterval != 0) {
+            mtz->setConvergedCycles(since + 1);
+            skippedCrystals[offset]++;
+            savedSeconds[offset] += mtz->getRefinementSeconds();
+            continue;
+          }
 
-        mtz->refinePartialities();
+          verification = true;
+        }
+
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+
+        mtz->beginConvergenceCycle();
+        mtz->refinePartialities(verification);
 
         if (targets.size() > 0) {
           ScoreType firstScore = mtz->getScoreType();
@@ -81,12 +106,28 @@ void MtzRefiner::cycleThread(int offset) {
             silent = (i < targets.size() - 1);
             mtz->setDefaultScoreType((ScoreType)targets[i]);
 
-            mtz->refinePartialities();
+            mtz->refinePartialities(verification);
           }
 
           mtz->setDefaultScoreType(firstScore);
         }
 
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        bool stable = mtz->updateConvergence();
+
+        if (verification) {
+          verifiedCrystals[offset]++;
+          double saved = mtz->getRefinementSeconds() - elapsed.count();
+          savedSeconds[offset] += std::max(saved, 0.);
+
+          if (!stable) {
+            revertedCrystals[offset]++;
+          }
+        } else {
+          mtz->setRefinementSeconds(elapsed.count());
+        }
+
         mtz->setRefineOrientations(false);
       }
     }
@@ -108,6 +149,11 @@ void MtzRefiner::cycle() {
          << std::endl;
   Logger::mainLogger->addStream(&logged);
 
+  skippedCrystals = std::vector<int>(maxThreads, 0);
+  verifiedCrystals = std::vector<int>(maxThreads, 0);
+  revertedCrystals = std::vector<int>(maxThreads, 0);
+  savedSeconds = std::vector<double>(maxThreads, 0);
+
   for (int i = 0; i < maxThreads; i++) {
     boost::thread *thr = new boost::thread(cycleThreadWrapper, this, i);
     threads.add_thread(thr);
@@ -115,6 +161,26 @@ void MtzRefiner::cycle() {
 
   threads.join_all();
 
+  if (FileParser::getKey("SKIP_CONVERGED_CRYSTALS", false)) {
+    int skipped = 0;
+    int verified = 0;
+    int reverted = 0;
+    double saved = 0;
+
+    for (int i = 0; i < maxThreads; i++) {
+      skipped += skippedCrystals[i];
+      verified += verifiedCrystals[i];
+      reverted += revertedCrystals[i];
+      saved += savedSeconds[i];
+    }
+
+    /* Summed over threads, so this is CPU time rather than wall time */
+    std::cout << "N: Converged crystals: " << skipped << " skipped, "
+              << verified << " verified (" << reverted
+              << " returned to full refinement), saving approx. "
+              << f_to_str(saved, 1) << " thread-seconds." << std::endl;
+  }
+
   time_t endcputime;
   time(&endcputime);
 
@@ -203,6 +269,12 @@ void MtzRefiner::refineCycle(bool once) {
   bool stop = FileParser::getKey("STOP_REFINEMENT", true);
   bool outputIndividualCycles =
       FileParser::getKey("OUTPUT_INDIVIDUAL_CYCLES", false);
+  bool finalCycleOnly = FileParser::getKey("REFINED_MTZ_FINAL_CYCLE", false);
+
+  /* Refined crystals are written out in the background */
+  MtzWriterPtr writer = MtzWriterPtr(new MtzWriter());
+  writer->setEnabled(!finalCycleOnly);
+  MtzManager::setRefinedWriter(writer);
 
   while (!finished) {
     if (outputIndividualCycles) {
@@ -220,6 +292,21 @@ void MtzRefiner::refineCycle(bool once) {
 
     i++;
   }
+
+  if (finalCycleOnly) {
+    writer->setEnabled(true);
+
+    for (int j = 0; j < mtzManagers.size(); j++) {
+      MtzPtr mtz = mtzManagers[j];
+
+      if (!mtz->isRejected()) {
+        writer->queue(mtz->snapshot("ref-" + mtz->getFilename()));
+      }
+    }
+  }
+
+  writer->flush();
+  MtzManager::setRefinedWriter(MtzWriterPtr());
 }
 
 // MARK: Loading data
@@ -522,10 +609,18 @@ void MtzRefiner::readSingleImageV2(std::string *filename,
             newManager->setImage(newImage);
             newManager->calcXYOffset();
 
-            newManager->loadReflections();
-            newManager->setWavelength(newImage->getWavelength());
+            bool listed = false;
+
+            if (me->deferMtzLoading && !v3) {
+              /* Listed without reading, for whoever needs only some */
+              listed = FileReader::exists(newManager->getFilename());
+            } else {
+              newManager->loadReflections();
+              newManager->setWavelength(newImage->getWavelength());
+              listed = (newManager->reflectionCount() > 0);
+            }
 
-            if (newManager->reflectionCount() > 0 && !v3) {
+            if (listed && !v3) {
               newImage->addMtz(newManager);
 
               if (newMtzs) {
@@ -836,12 +931,15 @@ void MtzRefiner::readMatrix(double (&matrix)[9], std::string line) {
 // MARK: Merging
 
 void MtzRefiner::correlationAndInverse(bool shouldFlip) {
+  correlationAndInverse(getAllMtzs(), shouldFlip);
+}
+
+void MtzRefiner::correlationAndInverse(std::vector<MtzPtr> mtzManagers,
+                                       bool shouldFlip) {
   if (MtzManager::getReferenceManager() == NULL) {
     MtzManager::setReference(&*reference);
   }
 
-  std::vector<MtzPtr> mtzManagers = getAllMtzs();
-
   for (int i = 0; i < mtzManagers.size(); i++) {
     double correl = mtzManagers[i]->correlation(true);
     double invCorrel = correl;
@@ -874,14 +972,54 @@ void MtzRefiner::linearScaling() {
   referencePtr = merger.getMergedMtz();
 }
 
-void MtzRefiner::merge(int cycle) {
-  loadImageFiles();
+static bool filenameBefore(MtzPtr a, MtzPtr b) {
+  return (a->getFilename() < b->getFilename());
+}
+
+void MtzRefiner::merge(int cycle, bool reduceShards) {
+  int shard = FileParser::getKey("MERGE_SHARD", -1);
+  int shardCount = FileParser::getKey("MERGE_SHARD_COUNT", 0);
+  bool writeShard =
+      (cycle < -1 && !reduceShards && shard >= 0 && shard < shardCount);
+
+  std::vector<MtzPtr> mtzManagers;
+
+  /* The reduce takes everything it needs from the shard files. Otherwise
+   * the MERGE command lists every crystal whose MTZ exists before reading
+   * any, in filename order, so that a shard numbers crystals exactly as the
+   * other shards and a single process do, whatever the number of threads.
+   * A shard then reads only its own. */
+  if (!reduceShards) {
+    deferMtzLoading = (cycle < -1);
+    loadImageFiles();
+    deferMtzLoading = false;
+    mtzManagers = getAllMtzs();
+  }
+
   loadInitialMtz();
 
-  std::vector<MtzPtr> mtzManagers = getAllMtzs();
+  if (cycle < -1 && !reduceShards) {
+    std::sort(mtzManagers.begin(), mtzManagers.end(), filenameBefore);
+
+    std::vector<MtzPtr> readMtzs;
+    int first = writeShard ? shard : 0;
+    int step = writeShard ? shardCount : 1;
+
+    for (int i = first; i < mtzManagers.size(); i += step) {
+      readMtzs.push_back(mtzManagers[i]);
+    }
+
+    boost::thread_group threads;
+    int maxThreads = FileParser::getMaxThreads();
+
+    for (int i = 0; i < maxThreads; i++) {
+      boost::thread *thr = new boost::thread(loadMtzsThread, &readMtzs, i);
+      threads.add_thread(thr);
+    }
+
+    threads.join_all();
 
-  if (cycle < -1) {
-    correlationAndInverse();
+    correlationAndInverse(readMtzs);
   }
 
   bool anomalousMerge = FileParser::getKey("MERGE_ANOMALOUS", false);
@@ -899,15 +1037,23 @@ void MtzRefiner::merge(int cycle) {
   merger.setAllMtzs(mtzManagers);
   merger.setCycle(cycleNum);
   merger.setScalingType(scaling);
-  merger.mergeFull();
+
+  if (reduceShards) {
+    merger.setReduceShards(shardCount);
+  } else if (writeShard) {
+    merger.writeShard(shard, shardCount);
+    return;
+  } else if (cycle < -1) {
+    /* Only for the MERGE command, as refinement cycles change every
+     * crystal */
+    merger.setIncremental(FileParser::getKey("MERGE_INCREMENTAL", false));
+  }
+
+  merger.mergeFull(anomalousMerge);
   mergedMtz = merger.getMergedMtz();
 
   referencePtr = mergedMtz;
 
-  if (anomalousMerge) {
-    merger.mergeFull(true);
-  }
-
   // *************************
   // ***** BINNED MERGE ******
   // *************************
@@ -1289,6 +1435,7 @@ void MtzRefiner::index() {
   if (!indexManager) indexManager = new IndexManager(images);
 
   indexManager->index();
+  ScratchArena::emptyPool();
 
   takeTwoPNG();
 
@@ -1310,6 +1457,7 @@ void MtzRefiner::powderPattern() {
   }
 
   threads.join_all();
+  ScratchArena::emptyPool();
 
   indexManager->powderPattern();
 }
@@ -1483,6 +1631,22 @@ void MtzRefiner::fakeSpotsThread(std::vector<ImagePtr> *images, int offset) {
   }
 }
 
+void MtzRefiner::loadMtzsThread(std::vector<MtzPtr> *mtzs, int offset) {
+  int maxThreads = FileParser::getMaxThreads();
+
+  for (int i = offset; i < mtzs->size(); i += maxThreads) {
+    MtzPtr mtz = mtzs->at(i);
+
+    /* Crystals read by an earlier command keep their refined wavelength */
+    if (mtz->reflectionCount()) {
+      continue;
+    }
+
+    mtz->loadReflections();
+    mtz->setWavelength(mtz->getImagePtr()->getWavelength());
+  }
+}
+
 void MtzRefiner::fakeSpots() {
   loadImageFiles();
 
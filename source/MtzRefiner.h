@@ -31,6 +31,7 @@ class MtzRefiner : public LoggableObject {
   static void findSpotsThread(MtzRefiner *me, int offset);
   void readFromHdf5(std::vector<ImagePtr> *newImages);
   bool readRefinedMtzs;
+  bool deferMtzLoading;
   std::vector<MtzPtr> getAllMtzs();
   IndexManager *indexManager;
   static int cycleNum;
@@ -47,6 +48,12 @@ class MtzRefiner : public LoggableObject {
 
   BinList binList;
 
+  /* Per-thread tallies for crystals which had converged */
+  std::vector<int> skippedCrystals;
+  std::vector<int> verifiedCrystals;
+  std::vector<int> revertedCrystals;
+  std::vector<double> savedSeconds;
+
  public:
   MtzRefiner();
   virtual ~MtzRefiner();
@@ -77,6 +84,7 @@ class MtzRefiner : public LoggableObject {
   void loadPanels(bool mustFail = true);
   void integrate();
   static void fakeSpotsThread(std::vector<ImagePtr> *images, int offset);
+  static void loadMtzsThread(std::vector<MtzPtr> *mtzs, int offset);
   void fakeSpots();
   void integrationSummary();
   static void integrateImagesWrapper(MtzRefiner *object,
@@ -88,8 +96,10 @@ class MtzRefiner : public LoggableObject {
   void refineUnitCell();
 
   static void readMatrix(double (&matrix)[9], std::string line);
-  void merge(int cycle = -2);
+  void merge(int cycle = -2, bool reduceShards = false);
   void correlationAndInverse(bool shouldFlip = false);
+  void correlationAndInverse(std::vector<MtzPtr> mtzManagers,
+                             bool shouldFlip = false);
   void refreshCurrentPartialities();
   void maximumImage();
   static void maximumImageThread(MtzRefiner *me, ImagePtr maxImage, int offset);
@@ -0,0 +1,157 @@
+//
+//  MtzWriter.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "MtzWriter.h"
+#include <string.h>
+#include "FileReader.h"
+#include "ccp4_general.h"
+#include "ccp4_spg.h"
+#include "cmtzlib.h"
+
+using namespace CMtz;
+using namespace CSym;
+
+MtzWriter::MtzWriter(int newMaxQueued) {
+  maxQueued = std::max(newMaxQueued, 1);
+  finishing = false;
+  writing = false;
+  enabled = true;
+  written = 0;
+  thread = new boost::thread(writeLoopWrapper, this);
+}
+
+MtzWriter::~MtzWriter() {
+  {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    finishing = true;
+  }
+
+  queueChanged.notify_all();
+  thread->join();
+  delete thread;
+}
+
+int MtzWriter::writeMtz(MtzSnapshotPtr snapshot) {
+  int columns = MTZ_WRITER_COLUMNS;
+  CCP4SPG *mtzspg = snapshot->spaceGroup;
+  float rsm[192][4][4];
+  char ltypex[2];
+
+  MTZ *mtzout;
+  MTZXTAL *xtal;
+  MTZSET *set;
+  MTZCOL *colout[MTZ_WRITER_COLUMNS];
+
+  std::string outputFile = FileReader::addOutputDirectory(snapshot->filename);
+
+  mtzout = MtzMalloc(0, 0);
+  ccp4_lwtitl(mtzout, "Written from Helen's XFEL tasks ", 0);
+  mtzout->refs_in_memory = 0;
+  mtzout->fileout = MtzOpenForWrite(outputFile.c_str());
+
+  // then add symm headers...
+  for (int i = 0; i < mtzspg->nsymop; ++i)
+    CCP4::rotandtrn_to_mat4(rsm[i], mtzspg->symop[i]);
+  strncpy(ltypex, mtzspg->symbol_old, 1);
+  ccp4_lwsymm(mtzout, mtzspg->nsymop, mtzspg->nsymop_prim, rsm, ltypex,
+              mtzspg->spg_ccp4_num, mtzspg->symbol_old, mtzspg->point_group);
+
+  // then add xtals, datasets, cols
+  xtal = MtzAddXtal(mtzout, "XFEL crystal", "XFEL project", snapshot->cell);
+  set = MtzAddDataset(mtzout, xtal, "Dataset", snapshot->wavelength);
+  colout[0] = MtzAddColumn(mtzout, set, "H", "H");
+  colout[1] = MtzAddColumn(mtzout, set, "K", "H");
+  colout[2] = MtzAddColumn(mtzout, set, "L", "H");
+  colout[3] = MtzAddColumn(mtzout, set, "I", "J");
+  colout[4] = MtzAddColumn(mtzout, set, "SIGI", "Q");
+  colout[5] = MtzAddColumn(mtzout, set, "PART", "R");
+  colout[6] = MtzAddColumn(mtzout, set, "WAVE", "R");
+  colout[7] = MtzAddColumn(mtzout, set, "SHIFTX", "R");
+  colout[8] = MtzAddColumn(mtzout, set, "SHIFTY", "R");
+  colout[9] = MtzAddColumn(mtzout, set, "CSIGI", "R");
+  colout[10] = MtzAddColumn(mtzout, set, "REJECT", "R");
+
+  int num = (int)(snapshot->rows.size() / columns);
+
+  for (int i = 0; i < num; i++) {
+    ccp4_lwrefl(mtzout, &snapshot->rows[i * columns], colout, columns, i + 1);
+  }
+
+  MtzPut(mtzout, " ");
+  MtzFree(mtzout);
+
+  return num;
+}
+
+void MtzWriter::queue(MtzSnapshotPtr snapshot) {
+  std::unique_lock<std::mutex> lock(queueMutex);
+
+  /* Refinement waits rather than piling up snapshots in memory */
+  while (queued.size() >= maxQueued) {
+    queueChanged.wait(lock);
+  }
+
+  queued.push_back(snapshot);
+  queueChanged.notify_all();
+}
+
+void MtzWriter::flush() {
+  std::unique_lock<std::mutex> lock(queueMutex);
+
+  while (queued.size() || writing) {
+    queueChanged.wait(lock);
+  }
+}
+
+void MtzWriter::writeLoop() {
+  std::deque<MtzSnapshotPtr> batch;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      writing = false;
+      queueChanged.notify_all();
+
+      while (queued.empty() && !finishing) {
+        queueChanged.wait(lock);
+      }
+
+      if (queued.empty() && finishing) {
+        break;
+      }
+
+      /* Take everything waiting so far as one batch */
+      batch.swap(queued);
+      writing = true;
+      queueChanged.notify_all();
+    }
+
+    for (int i = 0; i < batch.size(); i++) {
+      writeMtz(batch[i]);
+    }
+
+    written += batch.size();
+    batch.clear();
+  }
+
+  logged << "Background writer wrote " << written << " crystals." << std::endl;
+  sendLog(LogLevelDetailed);
+}
+
+void MtzWriter::writeLoopWrapper(MtzWriter *me) { me->writeLoop(); }
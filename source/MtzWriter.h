@@ -0,0 +1,78 @@
+//
+//  MtzWriter.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __cppxfel__MtzWriter__
+#define __cppxfel__MtzWriter__
+
+#include <boost/thread/thread.hpp>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "LoggableObject.h"
+#include "csymlib.h"
+#include "parameters.h"
+
+#define MTZ_WRITER_COLUMNS 11
+
+/* Everything needed to write one crystal out, copied so that the crystal
+ * may carry on refining while it is written. Rows hold H, K, L, I, SIGI,
+ * PART, WAVE, SHIFTX, SHIFTY, CSIGI and REJECT for each observation. */
+typedef struct {
+  std::string filename;
+  float cell[6];
+  float wavelength;
+  CSym::CCP4SPG *spaceGroup;
+  std::vector<float> rows;
+} MtzSnapshot;
+
+typedef boost::shared_ptr<MtzSnapshot> MtzSnapshotPtr;
+
+/* Writes crystal snapshots on a background thread, a batch at a time.
+ * Each snapshot becomes one MTZ file. */
+
+class MtzWriter : public LoggableObject {
+ private:
+  std::deque<MtzSnapshotPtr> queued;
+  std::mutex queueMutex;
+  std::condition_variable queueChanged;
+  boost::thread *thread;
+  bool finishing;
+  bool writing;
+  bool enabled;
+  int maxQueued;
+  int written;
+
+  void writeLoop();
+  static void writeLoopWrapper(MtzWriter *me);
+
+ public:
+  MtzWriter(int maxQueued = 256);
+  ~MtzWriter();
+
+  static int writeMtz(MtzSnapshotPtr snapshot);
+
+  void setEnabled(bool enable) { enabled = enable; }
+  bool isEnabled() { return enabled; }
+  void queue(MtzSnapshotPtr snapshot);
+  void flush();
+};
+
+#endif /* defined(__cppxfel__MtzWriter__) */
@@ -132,7 +132,7 @@ void NelderMead::evaluateTestPoint(int num) {
 
 void NelderMead::evaluateTestPoint(TestPoint *testPoint) {
   setTestPointParameters(testPoint);
-  double eval = evaluationFunction(evaluateObject);
+  double eval = evaluate();
   testPoint->second = eval;
 }
 
@@ -20,6 +20,7 @@
 #include "RefinementGridSearch.h"
 #include <float.h>
 #include <iomanip>
+#include <boost/thread/thread.hpp>
 #include "CSV.h"
 #include "polyfit.hpp"
 
@@ -52,7 +53,7 @@ void RefinementGridSearch::recursiveEvaluation(ParamList referenceList,
     (*setter)(objects[i], workingList[i]);
   }
 
-  double result = (*evaluationFunction)(evaluateObject);
+  double result = evaluate();
   (*results)[workingList] = result;
 
   orderedParams.push_back(workingList);
@@ -61,6 +62,101 @@ void RefinementGridSearch::recursiveEvaluation(ParamList referenceList,
   reportProgress(result);
 }
 
+void RefinementGridSearch::gridPoints(ParamList referenceList,
+                                      ParamList workingList,
+                                      std::vector<ParamList> *points) {
+  size_t workingCount = workingList.size();
+
+  if (workingCount == objects.size()) {
+    points->push_back(workingList);
+    return;
+  }
+
+  /* Same order of traversal as recursiveEvaluation */
+  for (int i = -gridLength / 2; i <= (int)(gridLength / 2 + 0.5); i++) {
+    double mean = referenceList[workingCount];
+    double step = stepSizes[workingCount];
+    double value = mean + i * step;
+
+    ParamList extended = workingList;
+    extended.push_back(value);
+    gridPoints(referenceList, extended, points);
+  }
+}
+
+void RefinementGridSearch::batchEvaluationWrapper(
+    RefinementGridSearch *me, EvaluationContext *context,
+    std::vector<ParamList> *points, std::vector<double> *scores, int offset,
+    int threads) {
+  for (int j = offset; j < points->size(); j += threads) {
+    ParamList &params = (*points)[j];
+
+    for (int i = 0; i < params.size(); i++) {
+      Setter setter = me->setters[i];
+      (*setter)(context->objects[i], params[i]);
+    }
+
+    (*scores)[j] = (*me->evaluationFunction)(context->evaluateObject);
+  }
+}
+
+bool RefinementGridSearch::batchEvaluation(ParamList referenceList,
+                                           ResultMap *results) {
+  std::vector<ParamList> points;
+  gridPoints(referenceList, ParamList(), &points);
+
+  int threads = std::min(batchThreads, (int)points.size());
+
+  if (threads <= 1 || contextMaker == NULL) {
+    return false;
+  }
+
+  /* Contexts are made up front, from the calling thread, so that every
+   * copy starts from the same state of the live objects */
+  std::vector<EvaluationContext> contexts;
+  contexts.resize(threads);
+
+  for (int i = 0; i < threads; i++) {
+    if (!makeContext(&contexts[i])) {
+      logged << "Could not make evaluation context for " << jobName
+             << ", evaluating grid points serially." << std::endl;
+      sendLog(LogLevelDebug);
+      return false;
+    }
+  }
+
+  std::vector<double> scores;
+  scores.resize(points.size());
+
+  boost::thread_group workers;
+
+  for (int i = 0; i < threads; i++) {
+    boost::thread *thr =
+        new boost::thread(batchEvaluationWrapper, this, &contexts[i], &points,
+                          &scores, i, threads);
+    workers.add_thread(thr);
+  }
+
+  workers.join_all();
+
+  /* Reduce in grid order so that results do not depend on thread count */
+  for (int j = 0; j < points.size(); j++) {
+    (*results)[points[j]] = scores[j];
+    cacheEvaluation(&points[j], scores[j]);
+
+    orderedParams.push_back(points[j]);
+    orderedResults.push_back(scores[j]);
+
+    reportProgress(scores[j], &points[j]);
+  }
+
+  logged << "Evaluated " << points.size() << " grid points for " << jobName
+         << " on " << threads << " threads." << std::endl;
+  sendLog(LogLevelDebug);
+
+  return true;
+}
+
 void RefinementGridSearch::refine() {
   RefinementStrategy::refine();
 
@@ -75,7 +171,9 @@ void RefinementGridSearch::refine() {
 
   csv->addHeader("result");
 
-  recursiveEvaluation(currentValues, ParamList(), &results);
+  if (!batchEvaluation(currentValues, &results)) {
+    recursiveEvaluation(currentValues, ParamList(), &results);
+  }
 
   double minResult = FLT_MAX;
   ParamList minParams;
@@ -101,7 +199,7 @@ void RefinementGridSearch::refine() {
     logged << tags[i] << " = " << minParams[i] << ", ";
   }
 
-  double val = (*evaluationFunction)(evaluateObject);
+  double val = evaluate();
   logged << "score = " << val << std::endl;
   sendLog(LogLevelNormal);
 
@@ -187,7 +285,7 @@ void RefinementGridSearch::assignInterpanelMinimum() {
     logged << tags[i] << "=" << minParams[i] << ", ";
   }
 
-  double val = (*evaluationFunction)(evaluateObject);
+  double val = evaluateUncached();
 
   logged << "score = " << val << std::endl;
   sendLog();
@@ -33,6 +33,15 @@ class RefinementGridSearch : public RefinementStrategy {
   std::vector<double> orderedResults;
   std::vector<ParamList> orderedParams;
 
+  void gridPoints(ParamList referenceList, ParamList workingList,
+                  std::vector<ParamList> *points);
+  bool batchEvaluation(ParamList referenceList, ResultMap *results);
+  static void batchEvaluationWrapper(RefinementGridSearch *me,
+                                     EvaluationContext *context,
+                                     std::vector<ParamList> *points,
+                                     std::vector<double> *scores, int offset,
+                                     int threads);
+
  public:
   RefinementGridSearch() : RefinementStrategy() {
     gridJumps = 8;
@@ -58,7 +58,7 @@ double RefinementStepSearch::minimizeTwoParameters(int whichParam1,
       (*setter1)(object1, i);
       (*setter2)(object2, k);
 
-      double aScore = (*evaluationFunction)(evaluateObject);
+      double aScore = evaluate();
 
       if (aScore != aScore) {
         aScore = FLT_MAX;
@@ -114,7 +114,7 @@ double RefinementStepSearch::minimizeParameter(int whichParam,
   if (*bestScore != FLT_MAX) {
     param_scores[1] = *bestScore;
   } else {
-    double aScore = (*evaluationFunction)(evaluateObject);
+    double aScore = evaluate();
     if (aScore != aScore) {
       aScore = FLT_MAX;
     }
@@ -127,7 +127,7 @@ double RefinementStepSearch::minimizeParameter(int whichParam,
   for (double i = bestParam - step; j < 3; i += step * 2) {
     (*setter)(object, i);
 
-    double aScore = (*evaluationFunction)(evaluateObject);
+    double aScore = evaluate();
 
     if (aScore != aScore) {
       aScore = FLT_MAX;
@@ -180,6 +180,8 @@ void RefinementStepSearch::refine() {
 
     if (afterCycleObject && afterCycleFunction) {
       (*afterCycleFunction)(afterCycleObject);
+      /* scores from before this function may no longer hold */
+      clearEvaluationCache();
     }
 
     reportProgress(bestScore);
@@ -18,7 +18,10 @@
 //    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "RefinementStrategy.h"
+#include <float.h>
+#include <math.h>
 #include <iomanip>
+#include "DifferentialEvolution.h"
 #include "FileParser.h"
 #include "NelderMead.h"
 #include "RefinementGridSearch.h"
@@ -43,6 +46,10 @@ RefinementStrategyPtr RefinementStrategy::userChosenStrategy() {
       strategy = boost::static_pointer_cast<RefinementStrategy>(
           RefinementGridSearchPtr(new RefinementGridSearch()));
       break;
+    case MinimizationMethodDifferentialEvolution:
+      strategy = boost::static_pointer_cast<RefinementStrategy>(
+          DifferentialEvolutionPtr(new DifferentialEvolution()));
+      break;
     default:
       break;
   }
@@ -62,6 +69,21 @@ void RefinementStrategy::addParameter(void *object, Getter getter,
   stepSizes.push_back(stepSize);
   stepConvergences.push_back(stepConvergence);
 
+  /* Parameter values closer than this are the same point for the
+   * evaluation cache. Without a convergence criterion, steps may keep
+   * halving, so the quantum must be much finer. */
+  double quantum = stepConvergence * 1e-3;
+
+  if (stepConvergence <= 0) {
+    quantum = fabs(stepSize) * 1e-12;
+  }
+
+  if (quantum <= 0) {
+    quantum = DBL_EPSILON;
+  }
+
+  cacheQuanta.push_back(quantum);
+
   if (!tag.length()) {
     tag = "object" + i_to_str((int)objects.size());
   }
@@ -101,7 +123,13 @@ void RefinementStrategy::refine() {
 
   logged << tags[tags.size() - 1] << " --- " << std::endl;
 
-  startingScore = (*evaluationFunction)(evaluateObject);
+  cacheLookups = 0;
+  cacheHits = 0;
+  clearEvaluationCache();
+
+  startingScore = evaluate();
+  endScore = startingScore;
+  startingValues.clear();
 
   for (int i = 0; i < objects.size(); i++) {
     double objectValue = (*getters[i])(objects[i]);
@@ -111,33 +139,108 @@ void RefinementStrategy::refine() {
   reportProgress(startingScore);
 }
 
-void RefinementStrategy::reportProgress(double score) {
+void RefinementStrategy::reportProgress(double score,
+                                        std::vector<double> *values) {
   if (!(priority <= LogLevelNormal)) return;
 
   logged << "Cycle " << cycleNum << "\t";
 
   for (int i = 0; i < objects.size(); i++) {
-    double objectValue = (*getters[i])(objects[i]);
+    double objectValue = values ? (*values)[i] : (*getters[i])(objects[i]);
     logged << std::setprecision(5) << objectValue << "\t";
   }
 
   logged << " - score: ";
-  logged << score << std::endl;
+  logged << score;
+
+  if (cacheEvaluations) {
+    logged << " - cache hits: " << cacheHits << "/" << cacheLookups;
+  }
+
+  logged << std::endl;
 
   cycleNum++;
 }
 
+EvaluationKey RefinementStrategy::evaluationKey(std::vector<double> *values) {
+  EvaluationKey key;
+  key.first = evaluateObject;
+  key.second.reserve(objects.size());
+
+  for (int i = 0; i < objects.size(); i++) {
+    double value = values ? (*values)[i] : (*getters[i])(objects[i]);
+
+    /* NaN would break the ordering of the cache map */
+    if (value != value) {
+      key.second.push_back(-HUGE_VAL);
+      continue;
+    }
+
+    key.second.push_back(floor(value / cacheQuanta[i] + 0.5));
+  }
+
+  return key;
+}
+
+double RefinementStrategy::evaluate() {
+  if (!cacheEvaluations) {
+    return (*evaluationFunction)(evaluateObject);
+  }
+
+  EvaluationKey key = evaluationKey();
+  cacheLookups++;
+
+  EvaluationCache::iterator it = evaluationCache.find(key);
+
+  if (it != evaluationCache.end()) {
+    cacheHits++;
+    return it->second;
+  }
+
+  double score = (*evaluationFunction)(evaluateObject);
+  evaluationCache[key] = score;
+
+  return score;
+}
+
+/* Always calls the score function, for points at which the evaluated object
+ * must be left consistent (score functions may refresh state as they go) */
+double RefinementStrategy::evaluateUncached() {
+  double score = (*evaluationFunction)(evaluateObject);
+  cacheEvaluation(NULL, score);
+
+  return score;
+}
+
+void RefinementStrategy::cacheEvaluation(std::vector<double> *values,
+                                         double score) {
+  if (!cacheEvaluations) {
+    return;
+  }
+
+  evaluationCache[evaluationKey(values)] = score;
+}
+
 void RefinementStrategy::finish() {
-  double endScore = (*evaluationFunction)(evaluateObject);
+  endScore = evaluateUncached();
 
   sendLog(priority);
 
+  if (cacheEvaluations && cacheLookups > 0) {
+    double hitRate = (double)cacheHits / (double)cacheLookups;
+    logged << "Evaluation cache for " << jobName << ": " << cacheHits << "/"
+           << cacheLookups << " hits (" << f_to_str(hitRate * 100, 1) << "%)"
+           << std::endl;
+    sendLog(LogLevelDebug);
+  }
+
   if (endScore >= startingScore || endScore != endScore) {
     logged << "No change for " << jobName << " (" << startingScore << ")"
            << std::endl;
     sendLog(LogLevelDetailed);
 
     resetToInitialParameters();
+    endScore = startingScore;
     _changed = 0;
   } else {
     double reduction = (startingScore - endScore) / startingScore;
@@ -163,12 +266,58 @@ void RefinementStrategy::finish() {
   }
 
   cycleNum = 0;
+  clearEvaluationCache();
 
   if (finishFunction != NULL) {
     (*finishFunction)(evaluateObject);
   }
 }
 
+bool RefinementStrategy::makeContext(EvaluationContext *context) {
+  if (contextMaker == NULL) {
+    return false;
+  }
+
+  bool success = (*contextMaker)(evaluateObject, objects, context);
+
+  return (success && context->objects.size() == objects.size());
+}
+
+double RefinementStrategy::largestShift() {
+  double largest = 0;
+
+  for (int i = 0; i < objects.size() && i < startingValues.size(); i++) {
+    double unit = stepConvergences[i];
+
+    if (unit <= 0) {
+      unit = fabs(stepSizes[i]);
+    }
+
+    if (unit <= 0) {
+      continue;
+    }
+
+    double objectValue = (*getters[i])(objects[i]);
+    double shift = fabs(objectValue - startingValues[i]) / unit;
+
+    if (shift > largest || shift != shift) {
+      largest = shift;
+    }
+  }
+
+  return largest;
+}
+
+double RefinementStrategy::scoreChange() {
+  double change = endScore - startingScore;
+
+  if (startingScore != 0) {
+    change /= fabs(startingScore);
+  }
+
+  return fabs(change);
+}
+
 void RefinementStrategy::resetToInitialParameters() {
   for (int i = 0; i < objects.size(); i++) {
     double objectValue = startingValues[i];
@@ -21,13 +21,21 @@
 #define __cppxfel__RefinementStrategy__
 
 #include <stdio.h>
+#include "FileParser.h"
 #include "LoggableObject.h"
 #include "parameters.h"
 
+/* Parameter values in units of their cache quanta, rounded but left as
+ * doubles so that large ratios cannot overflow an integer type */
+typedef std::pair<void *, std::vector<double> > EvaluationKey;
+typedef std::map<EvaluationKey, double> EvaluationCache;
+
 class RefinementStrategy : public LoggableObject {
  protected:
   Getter evaluationFunction;
   Getter finishFunction;
+  ContextMaker contextMaker;
+  int batchThreads;
   int maxCycles;
   void *evaluateObject;
   LogLevel priority;
@@ -44,9 +52,24 @@ class RefinementStrategy : public LoggableObject {
   std::vector<std::string> tags;
   std::vector<double> startingValues;
   double startingScore;
-
-  void reportProgress(double score);
+  double endScore;
+
+  /* Optional memo of scores for parameter vectors already visited */
+  bool cacheEvaluations;
+  EvaluationCache evaluationCache;
+  std::vector<double> cacheQuanta;
+  int cacheLookups;
+  int cacheHits;
+
+  EvaluationKey evaluationKey(std::vector<double> *values = NULL);
+  double evaluate();
+  double evaluateUncached();
+  void cacheEvaluation(std::vector<double> *values, double score);
+  void clearEvaluationCache() { evaluationCache.clear(); }
+
+  void reportProgress(double score, std::vector<double> *values = NULL);
   void finish();
+  bool makeContext(EvaluationContext *context);
 
  public:
   RefinementStrategy() {
@@ -55,8 +78,14 @@ class RefinementStrategy : public LoggableObject {
     priority = LogLevelDebug;
     cycleNum = 0;
     startingScore = 0;
+    endScore = 0;
     _changed = -1;
     finishFunction = NULL;
+    contextMaker = NULL;
+    batchThreads = 1;
+    cacheEvaluations = FileParser::getKey("CACHE_EVALUATIONS", false);
+    cacheLookups = 0;
+    cacheHits = 0;
   };
 
   static RefinementStrategyPtr userChosenStrategy();
@@ -77,6 +106,15 @@ class RefinementStrategy : public LoggableObject {
 
   void setFinishFunction(Getter finishFunc) { finishFunction = finishFunc; }
 
+  /* Optional: allows strategies to score trial parameters in parallel on
+   * independent copies of the evaluated object */
+  void setContextMaker(ContextMaker maker) { contextMaker = maker; }
+
+  /* Number of threads for strategies which score several trial points at
+   * once. Only used if a context maker has been set, otherwise points are
+   * evaluated one at a time on the live objects. */
+  void setBatchThreads(int threads) { batchThreads = threads; }
+
   void setVerbose(bool verbose) {
     if (verbose) {
       priority = LogLevelNormal;
@@ -87,8 +125,17 @@ class RefinementStrategy : public LoggableObject {
 
   bool didChange() { return (_changed == 1); }
 
+  /* Largest parameter change over the last refinement, in units of each
+   * parameter's convergence step (or step size, if it has none) */
+  double largestShift();
+
+  /* Fractional change in score over the last refinement */
+  double scoreChange();
+
   void setCycles(int num) { maxCycles = num; }
 
+  void setCacheEvaluations(bool cache) { cacheEvaluations = cache; }
+
   void setJobName(std::string job) { jobName = job; }
 
   void *getEvaluationObject() { return evaluateObject; }
@@ -100,6 +147,8 @@ class RefinementStrategy : public LoggableObject {
     stepSizes.clear();
     stepConvergences.clear();
     tags.clear();
+    cacheQuanta.clear();
+    clearEvaluationCache();
   }
 };
 
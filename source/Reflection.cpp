@@ -7,6 +7,8 @@
 
 #include "Reflection.h"
 
+#include <float.h>
+#include <algorithm>
 #include <cmath>
 #include <vector>
 #include "Miller.h"
@@ -264,7 +266,6 @@ Reflection::Reflection() {
   resolution = 0;
   activeAmbiguity = 0;
 
-  millerMutex = MutexPtr(new std::mutex());
   rejectSigma =
       FileParser::getKey("OUTLIER_REJECTION_SIGMA", OUTLIER_REJECTION_SIGMA);
   shouldReject = FileParser::getKey("OUTLIER_REJECTION", true);
@@ -293,14 +294,6 @@ void Reflection::addMiller(MillerPtr miller) {
   }
 }
 
-void Reflection::addMillerCarefully(MillerPtr miller) {
-  millerMutex->lock();
-
-  addMiller(miller);
-
-  millerMutex->unlock();
-}
-
 bool Reflection::betweenResolutions(double lowAngstroms, double highAngstroms) {
   double minD, maxD = 0;
   StatisticsManager::convertResolutions(lowAngstroms, highAngstroms, &minD,
@@ -666,83 +659,147 @@ double Reflection::rMergeContribution(double *numerator, double *denominator) {
   return littleNum / littleDenom;
 }
 
+/* Running sums for liteMerge and medianMerge. The weighted mean is kept
+ * as plain sums, as before; the spread about it comes from an unweighted
+ * Welford accumulator, corrected from its own mean to the weighted one.
+ * NaN and FLT_MAX values are left out of the spread (count) but, as in
+ * the vector-based code, not out of the number of observations. */
+struct MergeStatistics {
+  int observations;
+  int count;
+  double weightedSum;
+  double totalWeight;
+  double mean;
+  double squaredDeviations;
+
+  MergeStatistics() {
+    observations = 0;
+    count = 0;
+    weightedSum = 0;
+    totalWeight = 0;
+    mean = 0;
+    squaredDeviations = 0;
+  }
+
+  void add(double value, double weight) {
+    observations++;
+    weightedSum += value * weight;
+    totalWeight += weight;
+
+    if (value != value || value == FLT_MAX) {
+      return;
+    }
+
+    count++;
+    double delta = value - mean;
+    mean += delta / count;
+    squaredDeviations += delta * (value - mean);
+  }
+
+  double weightedMean() { return weightedSum / totalWeight; }
+
+  /* Standard deviation about a chosen centre, divided by the number of
+   * values, as standard_deviation() in Vector.cpp */
+  double deviationAbout(double centre) {
+    double shift = mean - centre;
+    double squares = squaredDeviations + count * shift * shift;
+
+    return sqrt(squares / count);
+  }
+};
+
+static inline bool liteMillerIncluded(LiteMiller &lite, signed char friedel,
+                                      signed char halfSet) {
+  if (halfSet != -1 && lite.halfSet != halfSet) {
+    return false;
+  }
+
+  if (friedel != -1 && lite.friedel != friedel) {
+    return false;
+  }
+
+  return true;
+}
+
 void Reflection::medianMerge(double *intensity, double *sigma, int *rejected,
-                             signed char friedel) {
-  std::vector<double> intensities, weights;
+                             signed char friedel, signed char halfSet) {
+  /* Reused between reflections, so merging does not allocate */
+  static thread_local std::vector<double> scratch;
+  scratch.clear();
+
+  MergeStatistics running;
 
   for (int i = 0; i < liteMillers.size(); i++) {
-    if (friedel != -1) {
-      if (liteMillers[i].friedel != friedel) {
-        continue;
-      }
+    if (!liteMillerIncluded(liteMillers[i], friedel, halfSet)) {
+      continue;
     }
 
-    intensities.push_back(liteMillers[i].intensity);
+    scratch.push_back(liteMillers[i].intensity);
+    running.add(liteMillers[i].intensity, 1);
   }
 
-  *intensity = median(&intensities);
-  *sigma = standard_deviation(&intensities);
-
   if (rejected != NULL) {
     *rejected = 0;
   }
 
-  /*
-  std::ostringstream logged;
-  logged << "Int " << *intensity << " from " << intensities.size() << "
-  reflections for (" << miller(0)->getH() << ", " << miller(0)->getK() << ", "
-  << miller(0)->getL() << ")" << std::endl; Logger::log(logged);*/
+  if (scratch.size() == 0) {
+    *intensity = std::nan(" ");
+    *sigma = std::nan(" ");
+    return;
+  }
+
+  size_t mid = scratch.size() / 2;
+  std::nth_element(scratch.begin(), scratch.begin() + mid, scratch.end());
+  double midPoint = scratch[mid];
+
+  if (scratch.size() % 2 == 0) {
+    double lower = *std::max_element(scratch.begin(), scratch.begin() + mid);
+    midPoint = (midPoint + lower) / 2;
+  }
+
+  *intensity = midPoint;
+  *sigma = running.deviationAbout(running.weightedMean());
 }
 
 void Reflection::liteMerge(double *intensity, double *countingSigma,
-                           double *sigma, int *rejected, signed char friedel) {
-  std::vector<double> intensities, weights;
-  double totalWeight = 0;
+                           double *sigma, int *rejected, signed char friedel,
+                           signed char halfSet) {
+  MergeStatistics running;
+  int available = 0;
 
   if (rejected != NULL) {
     *rejected = 0;
   }
 
   for (int i = 0; i < liteMillers.size(); i++) {
-    if (friedel != -1) {
-      if (liteMillers[i].friedel != friedel) {
-        continue;
-      }
+    if (halfSet != -1 && liteMillers[i].halfSet != halfSet) {
+      continue;
     }
 
-    intensities.push_back(liteMillers[i].intensity);
-    weights.push_back(liteMillers[i].weight);
-    totalWeight += liteMillers[i].weight;
+    available++;
 
-    int isSpecial = miller(0)->is(2, 3, 5);
-    isSpecial = 0;
-
-    if (isSpecial) {
-      std::ostringstream logged;
-      logged << " MILLER " << liteMillers[i].intensity << " "
-             << liteMillers[i].weight << std::endl;
-      Logger::log(logged);
+    if (!liteMillerIncluded(liteMillers[i], friedel, halfSet)) {
+      continue;
     }
+
+    running.add(liteMillers[i].intensity, liteMillers[i].weight);
   }
 
-  double mean = weighted_mean(&intensities, &weights);
-  double stdev = standard_deviation(&intensities, NULL, mean);
+  double mean = running.weightedMean();
+  double stdev = running.deviationAbout(mean);
 
   bool shouldRejectLocal = (rejected != NULL) * shouldReject;
 
-  if (shouldRejectLocal && liteMillers.size() >= MIN_MILLER_COUNT) {
-    intensities.clear();
-    weights.clear();
-    totalWeight = 0;
-
+  if (shouldRejectLocal && available >= MIN_MILLER_COUNT) {
     int minIntensity = mean - stdev * rejectSigma;
     int maxIntensity = mean + stdev * rejectSigma;
 
+    /* Second pass over the same observations, without the outliers */
+    running = MergeStatistics();
+
     for (int i = 0; i < liteMillers.size(); i++) {
-      if (friedel != -1) {
-        if (liteMillers[i].friedel != friedel) {
-          continue;
-        }
+      if (!liteMillerIncluded(liteMillers[i], friedel, halfSet)) {
+        continue;
       }
 
       double testIntensity = liteMillers[i].intensity;
@@ -752,24 +809,22 @@ void Reflection::liteMerge(double *intensity, double *countingSigma,
         continue;
       }
 
-      intensities.push_back(testIntensity);
-      weights.push_back(liteMillers[i].weight);
-      totalWeight += liteMillers[i].weight;
+      running.add(testIntensity, liteMillers[i].weight);
     }
 
-    mean = weighted_mean(&intensities, &weights);
-    stdev = standard_deviation(&intensities, NULL, mean);
+    mean = running.weightedMean();
+    stdev = running.deviationAbout(mean);
   }
 
-  stdev /= sqrt(intensities.size());
+  stdev /= sqrt(running.observations);
 
-  if (intensities.size() == 1) {
+  if (running.observations == 1) {
     stdev = -1;
   }
 
   *intensity = mean;
   *countingSigma = stdev;
-  *sigma = totalWeight;
+  *sigma = running.totalWeight;
 }
 
 void Reflection::clearLiteMillers() {
@@ -925,8 +980,7 @@ void Reflection::detailedDescription() {
   std::cout << std::endl;
 }
 
-int Reflection::checkSpotOverlaps(std::vector<SpotPtr> *spots,
-                                  bool actuallyDelete) {
+int Reflection::checkSpotOverlaps(SpotHash *spots, bool actuallyDelete) {
   int count = 0;
 
   for (int i = 0; i < millerCount(); i++) {
@@ -951,7 +1005,8 @@ int Reflection::checkOverlaps() {
   return count;
 }
 
-void Reflection::addLiteMiller(MillerPtr miller) {
+LiteMiller Reflection::makeLiteMiller(MillerPtr miller,
+                                      unsigned char halfSet) {
   double intensity = miller->intensity();
   double weight = miller->getWeight();
   int isSpecial = miller->is(3, 2, 5);
@@ -969,10 +1024,7 @@ void Reflection::addLiteMiller(MillerPtr miller) {
   liteMiller.intensity = intensity;
   miller->positiveFriedel(&(liteMiller.friedel));
   liteMiller.weight = weight;
+  liteMiller.halfSet = halfSet;
 
-  millerMutex->lock();
-
-  liteMillers.push_back(liteMiller);
-
-  millerMutex->unlock();
+  return liteMiller;
 }
@@ -21,6 +21,7 @@ struct LiteMiller {
   double intensity;
   double weight;
   bool friedel;
+  unsigned char halfSet;
 };
 
 class Reflection {
@@ -43,7 +44,6 @@ class Reflection {
   static bool shouldReject;
   unsigned char activeAmbiguity;
   vector<unsigned int> reflectionIds;
-  MutexPtr millerMutex;
 
  public:
   Reflection();
@@ -54,8 +54,14 @@ class Reflection {
   MillerPtr miller(int i);
   void printDescription();
   void addMiller(MillerPtr miller);
-  void addMillerCarefully(MillerPtr miller);
-  void addLiteMiller(MillerPtr miller);
+  static LiteMiller makeLiteMiller(MillerPtr miller,
+                                   unsigned char halfSet = 0);
+
+  /* Not thread-safe: MtzMerger buffers lite millers per crystal and adds
+   * them to each reflection in crystal order after grouping. */
+  void addLiteMiller(LiteMiller liteMiller) {
+    liteMillers.push_back(liteMiller);
+  }
 
   int millerCount();
   ReflectionPtr copy(bool copyMillers = false);
@@ -66,8 +72,7 @@ class Reflection {
   static int reflectionIdForCoordinates(int h, int k, int l);
 
   int checkOverlaps();
-  int checkSpotOverlaps(std::vector<SpotPtr> *spots,
-                        bool actuallyDelete = true);
+  int checkSpotOverlaps(SpotHash *spots, bool actuallyDelete = true);
   void reflectionDescription();
   void calculateResolution(MtzManager *mtz);
   void clearMillers();
@@ -92,9 +97,10 @@ class Reflection {
   void merge(WeightType weighting, double *intensity, double *sigma,
              bool calculateRejections);
   void medianMerge(double *intensity, double *sigma, int *rejected,
-                   signed char friedel);
+                   signed char friedel, signed char halfSet = -1);
   void liteMerge(double *intensity, double *countingSigma, double *sigma,
-                 int *rejected, signed char friedel = -1);
+                 int *rejected, signed char friedel = -1,
+                 signed char halfSet = -1);
   void clearLiteMillers();
   double standardDeviation(WeightType weighting);
 
@@ -138,6 +144,10 @@ class Reflection {
     return reflectionIds[activeAmbiguity];
   }
 
+  long unsigned int getReflId(int ambiguity) {
+    return reflectionIds[ambiguity];
+  }
+
   double getResolution() const { return resolution; }
 
   void setResolution(double resolution) { this->resolution = resolution; }
@@ -0,0 +1,139 @@
+//
+//  ScratchArena.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "ScratchArena.h"
+#include <algorithm>
+#include "FileParser.h"
+
+std::mutex ScratchArena::poolMutex;
+std::vector<ScratchArena *> ScratchArena::pool;
+
+ScratchArena::ScratchArena() {
+  epoch = 0;
+  allocations = 0;
+}
+
+ScratchArena *ScratchArena::borrow() {
+  ScratchArena *arena = NULL;
+
+  {
+    std::lock_guard<std::mutex> lock(poolMutex);
+
+    if (pool.size()) {
+      arena = pool.back();
+      pool.pop_back();
+    }
+  }
+
+  if (arena == NULL) {
+    arena = new ScratchArena();
+  }
+
+  arena->allocations = 0;
+
+  return arena;
+}
+
+template <class Value>
+void ScratchArena::trim(std::vector<Value> &buffer) {
+  if (buffer.capacity() * sizeof(Value) > SCRATCH_KEEP_BYTES) {
+    std::vector<Value>().swap(buffer);
+  }
+}
+
+int ScratchArena::giveBack(ScratchArena *arena) {
+  int allocations = arena->allocations;
+
+  trim(arena->stamps);
+  trim(arena->intBuffer);
+  trim(arena->indexBuffer);
+
+  for (int i = 0; i < SCRATCH_DOUBLE_BUFFERS; i++) {
+    trim(arena->doubleBuffers[i]);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(poolMutex);
+
+    if (pool.size() < FileParser::getMaxThreads()) {
+      pool.push_back(arena);
+      return allocations;
+    }
+  }
+
+  delete arena;
+
+  return allocations;
+}
+
+ScratchArena *ScratchArena::forThread() {
+  /* Freed when the thread finishes */
+  static thread_local ScratchArena arena;
+  arena.allocations = 0;
+
+  return &arena;
+}
+
+void ScratchArena::emptyPool() {
+  std::lock_guard<std::mutex> lock(poolMutex);
+
+  for (int i = 0; i < pool.size(); i++) {
+    delete pool[i];
+  }
+
+  std::vector<ScratchArena *>().swap(pool);
+}
+
+template <class Value>
+std::vector<Value> &ScratchArena::fit(std::vector<Value> &buffer,
+                                      size_t size) {
+  if (size > buffer.capacity()) {
+    allocations++;
+  }
+
+  buffer.resize(size);
+
+  return buffer;
+}
+
+void ScratchArena::beginMask(size_t size) {
+  if (size > stamps.size()) {
+    fit(stamps, size);
+  }
+
+  epoch++;
+
+  /* Stamps from 2^32 masks ago would look current again */
+  if (epoch == 0) {
+    std::fill(stamps.begin(), stamps.end(), 0);
+    epoch = 1;
+  }
+}
+
+std::vector<double> &ScratchArena::doubles(int which, size_t size) {
+  return fit(doubleBuffers[which], size);
+}
+
+std::vector<int> &ScratchArena::ints(size_t size) {
+  return fit(intBuffer, size);
+}
+
+std::vector<size_t> &ScratchArena::indices(size_t size) {
+  return fit(indexBuffer, size);
+}
@@ -0,0 +1,80 @@
+//
+//  ScratchArena.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __cppxfel__ScratchArena__
+#define __cppxfel__ScratchArena__
+
+#include <stdio.h>
+#include <mutex>
+#include <vector>
+
+#define SCRATCH_DOUBLE_BUFFERS 4
+#define SCRATCH_KEEP_BYTES (16 * 1024 * 1024)
+
+/* Working buffers for spot finding and integration which are kept between
+ * frames and reflections. A thread borrows an arena from a shared pool for
+ * as long as it needs it, so arenas outlive the short-lived panel threads.
+ * The pool keeps at most one arena per thread, and buffers larger than
+ * SCRATCH_KEEP_BYTES are freed when an arena is given back, so full-frame
+ * tables are not held between frames. A thread which needs an arena many
+ * times over, such as for each reflection, keeps its own instead.
+ * Each growth of a buffer is counted as an allocation. Buffers come back
+ * at the size asked for, holding whatever they held before.
+ *
+ * The mask is epoch-stamped: a pixel is marked if its stamp matches the
+ * current epoch, so starting a fresh mask costs one increment. */
+
+class ScratchArena {
+ private:
+  static std::mutex poolMutex;
+  static std::vector<ScratchArena *> pool;
+
+  std::vector<unsigned int> stamps;
+  unsigned int epoch;
+  int allocations;
+
+  std::vector<double> doubleBuffers[SCRATCH_DOUBLE_BUFFERS];
+  std::vector<int> intBuffer;
+  std::vector<size_t> indexBuffer;
+
+  template <class Value>
+  std::vector<Value> &fit(std::vector<Value> &buffer, size_t size);
+  template <class Value>
+  static void trim(std::vector<Value> &buffer);
+
+  ScratchArena();
+
+ public:
+  static ScratchArena *borrow();
+  static int giveBack(ScratchArena *arena);
+  static ScratchArena *forThread();
+  static void emptyPool();
+
+  void beginMask(size_t size);
+
+  bool isMarked(size_t position) { return stamps[position] == epoch; }
+
+  void mark(size_t position) { stamps[position] = epoch; }
+
+  std::vector<double> &doubles(int which, size_t size);
+  std::vector<int> &ints(size_t size);
+  std::vector<size_t> &indices(size_t size);
+};
+
+#endif /* defined(__cppxfel__ScratchArena__) */
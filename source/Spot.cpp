@@ -15,6 +15,7 @@
 #include "Detector.h"
 #include "FileParser.h"
 #include "Image.h"
+#include "ScratchArena.h"
 #include "Shoebox.h"
 #include "Vector.h"
 
@@ -53,6 +54,29 @@ Spot::Spot(ImagePtr image) {
 
 Spot::~Spot() {}
 
+SpotPtr Spot::copyForDetector(DetectorPtr detector) {
+  ImagePtr image = getParentImage();
+
+  if (!image) {
+    return SpotPtr();
+  }
+
+  SpotPtr newSpot = SpotPtr(new Spot(image));
+  newSpot->x = x;
+  newSpot->y = y;
+  newSpot->correctedX = correctedX;
+  newSpot->correctedY = correctedY;
+  newSpot->intensity = intensity;
+  newSpot->storedRadius = storedRadius;
+  newSpot->_isBeamCentre = _isBeamCentre;
+  newSpot->_isFake = _isFake;
+  newSpot->_estimatedVec = _estimatedVec;
+  newSpot->rejected = rejected;
+  newSpot->lastDetector = detector;
+
+  return newSpot;
+}
+
 bool Spot::isAcceptable(ImagePtr image) {
   int length = (int)probe.size();
   int tolerance = (length - 1) / 2;
@@ -83,11 +107,8 @@ double Spot::focusOnNearbySpot(double maxShift, double trialX, double trialY,
     return false;
   }
 
-  if (checkRes) {
-    double resol = this->resolution();
-
-    if (resol > (1. / maxResolution)) return false;
-    if (resol < 0) return false;
+  if (!withinResolution()) {
+    return false;
   }
 
   std::vector<double> probeIntensities, realIntensities;
@@ -196,6 +217,19 @@ double Spot::resolution() {
   return length_of_vector(spotVec);
 }
 
+bool Spot::withinResolution() {
+  if (!checkRes) {
+    return true;
+  }
+
+  double resol = this->resolution();
+
+  if (resol > (1. / maxResolution)) return false;
+  if (resol < 0) return false;
+
+  return true;
+}
+
 double Spot::angleFromSpotToCentre(double centreX, double centreY) {
   double beamX = getParentImage()->getBeamX();
   double beamY = getParentImage()->getBeamY();
@@ -362,21 +396,24 @@ vec Spot::estimatedVector() {
     return reciprocalPos;
   }
 
+  /* Worked out locally, as indexing threads may ask at the same time */
+  vec estimated;
+
   if (hasDetector()) {
-    getDetector()->spotCoordToAbsoluteVec(x, y, &_estimatedVec);
+    getDetector()->spotCoordToAbsoluteVec(x, y, &estimated);
   } else {
     DetectorPtr det = Detector::getMaster()->spotToAbsoluteVec(
-        shared_from_this(), &_estimatedVec);
+        shared_from_this(), &estimated);
 
     if (!det) {
       return new_vector(0, 0, 0);
     }
   }
 
-  scale_vector_to_distance(&_estimatedVec, storedRadius);
-  _estimatedVec.l -= storedRadius;
+  scale_vector_to_distance(&estimated, storedRadius);
+  estimated.l -= storedRadius;
 
-  return _estimatedVec;
+  return estimated;
 }
 
 double Spot::integrate() {
@@ -462,7 +499,7 @@ void Spot::spotsAndVectorsToResolution(
   }
 }
 
-void Spot::addToMask(int *mask, int width, int height) {
+void Spot::addToMask(ScratchArena *arena, int width, int height) {
   int padding = (backgroundPadding - 1) / 2 + 2;
 
   for (int j = -padding; j < padding + 1; j++) {
@@ -475,11 +512,11 @@ void Spot::addToMask(int *mask, int width, int height) {
 
       int position = width * yShifted + xShifted;
 
-      if (position > width * height || position < 0) {
+      if (position >= width * height || position < 0) {
         continue;
       }
 
-      mask[position] = 1;
+      arena->mark(position);
     }
   }
 }
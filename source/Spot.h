@@ -49,18 +49,21 @@ class Spot : LoggableObject, public boost::enable_shared_from_this<Spot> {
   Spot(ImagePtr image);
   virtual ~Spot();
 
+  SpotPtr copyForDetector(DetectorPtr detector);
+
   static void spotsAndVectorsToResolution(
       double lowRes, double highRes, std::vector<SpotPtr> spots,
       std::vector<SpotVectorPtr> spotVectors, std::vector<SpotPtr> *lowResSpots,
       std::vector<SpotVectorPtr> *lowResSpotVectors);
   void makeProbe(int height, int background, int size, int backPadding = 0);
-  void addToMask(int *mask, int width, int height);
+  void addToMask(ScratchArena *arena, int width, int height);
   void setXY(double x, double y);
   bool isAcceptable(ImagePtr image);
   double angleFromSpotToCentre(double centreX, double centreY);
   double angleInPlaneOfDetector(double centreX = 0, double centreY = 0,
                                 vec upBeam = new_vector(0, 1, 0));
   double resolution();
+  bool withinResolution();
   bool isOnSameLineAsSpot(SpotPtr otherSpot, double toleranceDegrees);
   static void writeDatFromSpots(std::string filename,
                                 std::vector<SpotPtr> spots);
@@ -83,6 +86,8 @@ class Spot : LoggableObject, public boost::enable_shared_from_this<Spot> {
   static void recentreInWindow(ImagePtr thisImage, double *x, double *y,
                                int windowPadding);
 
+  static vector<vector<double> > &getProbe() { return probe; }
+
   void storeEstimatedVector() { _estimatedVec = estimatedVector(); }
 
   vec storedVector() { return _estimatedVec; }
@@ -8,16 +8,65 @@
 //
 
 #include "SpotFinder.h"
+#include "Detector.h"
 #include "Spot.h"
 
+void SpotFinder::findPanelBounds(int xDim, int yDim,
+                                 std::vector<PanelBounds> *bounds) {
+  bounds->clear();
+
+  DetectorPtr master = Detector::getMaster();
+
+  if (Detector::isActive() && master && master->hasChildren()) {
+    std::vector<DetectorPtr> detectors;
+    master->getAllSubDetectors(detectors, false);
+
+    for (int i = 0; i < detectors.size(); i++) {
+      if (detectors[i]->hasChildren()) {
+        continue;
+      }
+
+      PanelBounds panel;
+      detectors[i]->getUnarrangedBounds(&panel.minX, &panel.minY,
+                                        &panel.maxX, &panel.maxY);
+
+      panel.minX = std::max(panel.minX, 0);
+      panel.minY = std::max(panel.minY, 0);
+      panel.maxX = std::min(panel.maxX, xDim - 1);
+      panel.maxY = std::min(panel.maxY, yDim - 1);
+
+      if (panel.maxX < panel.minX || panel.maxY < panel.minY) {
+        continue;
+      }
+
+      bounds->push_back(panel);
+    }
+  }
+
+  /* No panels known, so the whole image is one */
+  if (bounds->empty()) {
+    PanelBounds panel;
+    panel.minX = 0;
+    panel.minY = 0;
+    panel.maxX = xDim - 1;
+    panel.maxY = yDim - 1;
+    bounds->push_back(panel);
+  }
+}
+
 std::vector<SpotPtr> SpotFinder::findSpots() {
   std::vector<SpotPtr> spots;
 
   peaks = NULL;
   totalPeaks = 0;
+  scratchAllocations = 0;
 
   findSpecificSpots(&spots);
 
+  logged << "Scratch buffer allocations for this frame: " << scratchAllocations
+         << std::endl;
+  sendLog(LogLevelDebug);
+
   // now peaks is full of information
 
   for (int i = 0; i < totalPeaks; i++) {
@@ -14,6 +14,7 @@
 #include "parameters.h"
 
 #include <stdio.h>
+#include <atomic>
 
 class SpotFinder : public LoggableObject {
  protected:
@@ -23,10 +24,20 @@ class SpotFinder : public LoggableObject {
     float totalSignal;
   } Peak;
 
+  typedef struct {
+    int minX;
+    int minY;
+    int maxX;
+    int maxY;
+  } PanelBounds;
+
   ImagePtr image;
   Peak *peaks;
   size_t totalPeaks;
   int threshold;
+  std::atomic<int> scratchAllocations;
+
+  void findPanelBounds(int xDim, int yDim, std::vector<PanelBounds> *bounds);
 
  public:
   SpotFinder(ImagePtr anImage) {
@@ -35,6 +46,7 @@ class SpotFinder : public LoggableObject {
     image = anImage;
     peaks = NULL;
     totalPeaks = 0;
+    scratchAllocations = 0;
   }
 
   virtual void findSpecificSpots(std::vector<SpotPtr> *spots = NULL){};
@@ -9,16 +9,236 @@
 
 #include "SpotFinderCorrelation.h"
 #include <float.h>
+#include <boost/thread/thread.hpp>
+#include <chrono>
 #include "Image.h"
+#include "Spot.h"
+
+void SpotFinderCorrelation::makeProbe() {
+  std::vector<std::vector<double> > &model = Spot::getProbe();
+  int length = (int)model.size();
+  padding = (length - 1) / 2;
+
+  /* Stored row by row, x fastest, less its mean */
+  probe.resize(length * length);
+  double mean = 0;
+
+  for (int j = 0; j < length; j++) {
+    for (int i = 0; i < length; i++) {
+      probe[j * length + i] = model[i][j];
+      mean += model[i][j];
+    }
+  }
+
+  mean /= probe.size();
+  probeSquares = 0;
+
+  for (int i = 0; i < probe.size(); i++) {
+    probe[i] -= mean;
+    probeSquares += probe[i] * probe[i];
+  }
+}
+
+/* Tables cover image rows from top up to but not including bottom */
+void SpotFinderCorrelation::makeTables(int top, int bottom) {
+  int width = xDim + 1;
+  int rows = bottom - top;
+  size_t tableSize = (size_t)width * (rows + 1);
+
+  tableTop = top;
+  tableBottom = bottom;
+  values = &arena->ints((size_t)xDim * rows);
+  rejectTable = &arena->doubles(0, tableSize);
+  sumTable = &arena->doubles(1, tableSize);
+  squareTable = &arena->doubles(2, tableSize);
+
+  /* Only the leading row and column need clearing, the rest is written */
+  for (int x = 0; x < width; x++) {
+    (*rejectTable)[x] = 0;
+    (*sumTable)[x] = 0;
+    (*squareTable)[x] = 0;
+  }
+
+  for (int y = 0; y < rows; y++) {
+    double rowRejects = 0;
+    double rowSum = 0;
+    double rowSquares = 0;
+    size_t above = (size_t)y * width;
+    size_t here = above + width;
+
+    (*rejectTable)[here] = 0;
+    (*sumTable)[here] = 0;
+    (*squareTable)[here] = 0;
+
+    for (int x = 0; x < xDim; x++) {
+      int value = image->valueAt(x, y + top);
+      (*values)[(size_t)y * xDim + x] = value;
+
+      rowRejects += !image->accepted(x, y + top);
+      rowSum += value;
+      rowSquares += (double)value * value;
+
+      (*rejectTable)[here + x + 1] = (*rejectTable)[above + x + 1] + rowRejects;
+      (*sumTable)[here + x + 1] = (*sumTable)[above + x + 1] + rowSum;
+      (*squareTable)[here + x + 1] =
+          (*squareTable)[above + x + 1] + rowSquares;
+    }
+  }
+}
+
+double SpotFinderCorrelation::windowSum(std::vector<double> &table, int x,
+                                        int y) {
+  int width = xDim + 1;
+  size_t left = x - padding;
+  size_t right = x + padding + 1;
+  size_t top = (size_t)(y - padding - tableTop) * width;
+  size_t bottom = (size_t)(y + padding + 1 - tableTop) * width;
+
+  return table[bottom + right] - table[bottom + left] - table[top + right] +
+         table[top + left];
+}
+
+void SpotFinderCorrelation::storeCorrelation(int x, int y, double cross) {
+  if (windowSum(*rejectTable, x, y) > 0) return;
+
+  double count = (padding * 2 + 1) * (padding * 2 + 1);
+  double sum = windowSum(*sumTable, x, y);
+  double sumSq = windowSum(*squareTable, x, y);
+
+  double variance = sumSq - sum * sum / count;
+  double correlation = cross / sqrt(probeSquares * variance);
+
+  (*correlations)[(size_t)(y - bandMinY) * xDim + x] = correlation;
+}
+
+/* The arguments are the range of window corners, which are a padding up
+ * and to the left of the window centres */
+void SpotFinderCorrelation::correlateDirect(int minX, int minY, int maxX,
+                                            int maxY) {
+  int length = padding * 2 + 1;
+
+  for (int y = minY; y <= maxY; y++) {
+    for (int x = minX; x <= maxX; x++) {
+      double cross = 0;
+
+      for (int j = 0; j < length; j++) {
+        int *row = &(*values)[(size_t)(y + j - tableTop) * xDim + x];
+
+        for (int i = 0; i < length; i++) {
+          cross += probe[j * length + i] * row[i];
+        }
+      }
+
+      storeCorrelation(x + padding, y + padding, cross);
+    }
+  }
+}
+
+void SpotFinderCorrelation::correlateTiled(int minX, int minY, int maxX,
+                                           int maxY) {
+  int length = padding * 2 + 1;
+  int size = kernel->getNx();
+
+  /* Windows with their corner in the first step pixels of a tile lie
+   * wholly within it, so their correlations do not wrap */
+  int step = size - length + 1;
+  FFT tile(size, size);
+
+  for (int tileY = minY; tileY <= maxY; tileY += step) {
+    for (int tileX = minX; tileX <= maxX; tileX += step) {
+      int width = std::min(size, xDim - tileX);
+      int height = std::min(size, tableBottom - tileY);
+
+      tile.clear();
+
+      for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+          size_t position = (size_t)(y + tileY - tableTop) * xDim + x + tileX;
+          tile.element(x, y) = (*values)[position];
+        }
+      }
+
+      tile.forward();
+      tile.multiplyConjugate(*kernel);
+      tile.inverse();
+
+      int lastY = std::min(tileY + step - 1, maxY);
+      int lastX = std::min(tileX + step - 1, maxX);
+
+      for (int y = tileY; y <= lastY; y++) {
+        for (int x = tileX; x <= lastX; x++) {
+          double cross = tile.element(x - tileX, y - tileY).real();
+          storeCorrelation(x + padding, y + padding, cross);
+        }
+      }
+    }
+  }
+}
+
+void SpotFinderCorrelation::correlatePanel(PanelBounds *panel) {
+  /* Windows are centred on the panel's pixels but may straddle its edge,
+   * as they could when each window was correlated separately; they may
+   * not run off the image. Only centres in the current band are done. */
+  int panelMinY = std::max(panel->minY, bandMinY);
+  int panelMaxY = std::min(panel->maxY, bandMaxY);
+
+  int minX = std::max(panel->minX, padding) - padding;
+  int minY = std::max(panelMinY, padding) - padding;
+  int maxX = std::min(panel->maxX, xDim - 1 - padding) - padding;
+  int maxY = std::min(panelMaxY, yDim - 1 - padding) - padding;
+
+  if (minX > maxX || minY > maxY) {
+    return;
+  }
+
+  if (kernel) {
+    correlateTiled(minX, minY, maxX, maxY);
+  } else {
+    correlateDirect(minX, minY, maxX, maxY);
+  }
+}
+
+void SpotFinderCorrelation::correlateThread(SpotFinderCorrelation *me,
+                                            int offset) {
+  int maxThreads = me->panelThreads;
+
+  for (int i = offset; i < me->panels.size(); i += maxThreads) {
+    me->correlatePanel(&me->panels[i]);
+  }
+}
+
+/* Correlates every window centred in rows minY to maxY inclusive */
+void SpotFinderCorrelation::correlateBand(int minY, int maxY) {
+  bandMinY = minY;
+  bandMaxY = maxY;
+
+  makeTables(std::max(0, minY - padding), std::min(yDim, maxY + padding + 1));
+
+  correlations = &arena->doubles(3, (size_t)xDim * (maxY - minY + 1));
+  std::fill(correlations->begin(), correlations->end(), 0);
+
+  if (panelThreads == 1) {
+    correlateThread(this, 0);
+    return;
+  }
+
+  boost::thread_group threads;
+
+  for (int i = 0; i < panelThreads; i++) {
+    boost::thread *thr = new boost::thread(correlateThread, this, i);
+    threads.add_thread(thr);
+  }
+
+  threads.join_all();
+}
 
 void SpotFinderCorrelation::findSpecificSpots(std::vector<SpotPtr> *spots) {
   bool verbose = (FileParser::getKey("VERBOSITY_LEVEL", 0) > 1);
 
-  int xDim = this->image->getXDim();
-  int yDim = this->image->getYDim();
+  xDim = this->image->getXDim();
+  yDim = this->image->getYDim();
 
-  int *mask = new int[xDim * yDim];
-  memset(mask, 0, sizeof(int) * xDim * yDim);
+  arena = ScratchArena::borrow();
 
   SpotPtr spot = SpotPtr(new Spot(image));
 
@@ -47,43 +267,101 @@ void SpotFinderCorrelation::findSpecificSpots(std::vector<SpotPtr> *spots) {
     maxResolution = FLT_MAX;
   }
 
-  for (int y = 0; y < yDim; y++) {
-    for (int x = 0; x < xDim; x++) {
-      if (mask[y * xDim + x]) {
-        continue;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  makeProbe();
+
+  int length = padding * 2 + 1;
+  int bandRows = CORRELATION_BAND_ROWS;
+
+  if (length > DIRECT_CORRELATION_MAX_LENGTH) {
+    /* Shared by every panel, and only read by the panel threads */
+    int size = FFT::nextPowerOfTwo(std::max(length * 4, 64));
+    kernel = new FFT(size, size);
+
+    for (int j = 0; j < length; j++) {
+      for (int i = 0; i < length; i++) {
+        kernel->element(i, j) = probe[j * length + i];
       }
+    }
 
-      double value = this->image->valueAt(x, y);
+    kernel->forward();
 
-      if (value < threshold) continue;
+    /* Whole tiles to a band */
+    int step = size - length + 1;
+    bandRows = ((bandRows + step - 1) / step) * step;
+  }
 
-      double correlation = spot->focusOnNearbySpot(0, x, y);
+  /* Pixels around accepted spots are marked */
+  arena->beginMask((size_t)xDim * yDim);
+  findPanelBounds(xDim, yDim, &panels);
 
-      bool success = false;
+  panelThreads = std::max(1, std::min(panelThreads, (int)panels.size()));
+  std::chrono::duration<double> correlationTime(0);
 
-      if (!acceptableValue.size()) {
-        success = (correlation > minCorrelation);
-      } else {
-        double correlThresh = offset + value * gradient;
-        success = (correlation > correlThresh);
-      }
+  for (int bandY = 0; bandY < yDim; bandY += bandRows) {
+    int lastY = std::min(bandY + bandRows, yDim) - 1;
 
-      if (success) {
-        spot->recentreInWindow();
-        spots->push_back(spot);
-        spot->addToMask(mask, xDim, yDim);
-      }
+    std::chrono::steady_clock::time_point bandStart =
+        std::chrono::steady_clock::now();
+    correlateBand(bandY, lastY);
+    correlationTime += std::chrono::steady_clock::now() - bandStart;
 
-      if (verbose) {
-        logged << "Pixel at (" << x << ", " << y << ") intensity " << value
-               << ", correlation " << correlation
-               << (success ? " - success" : " - abandoned") << std::endl;
-        sendLog(LogLevelDetailed);
-      }
+    for (int y = bandY; y <= lastY; y++) {
+      for (int x = 0; x < xDim; x++) {
+        if (arena->isMarked(y * xDim + x)) {
+          continue;
+        }
+
+        double value = (*values)[(size_t)(y - tableTop) * xDim + x];
 
-      spot = SpotPtr(new Spot(image));
+        if (value < threshold) continue;
+
+        spot->setXY(x, y);
+
+        if (!spot->withinResolution()) continue;
+
+        double correlation = (*correlations)[(size_t)(y - bandY) * xDim + x];
+
+        bool success = false;
+
+        if (!acceptableValue.size()) {
+          success = (correlation > minCorrelation);
+        } else {
+          double correlThresh = offset + value * gradient;
+          success = (correlation > correlThresh);
+        }
+
+        if (success) {
+          spot->recentreInWindow();
+          spots->push_back(spot);
+          spot->addToMask(arena, xDim, yDim);
+        }
+
+        if (verbose) {
+          logged << "Pixel at (" << x << ", " << y << ") intensity " << value
+                 << ", correlation " << correlation
+                 << (success ? " - success" : " - abandoned") << std::endl;
+          sendLog(LogLevelDetailed);
+        }
+
+        spot = SpotPtr(new Spot(image));
+      }
     }
   }
 
-  delete[] mask;
+  delete kernel;
+  kernel = NULL;
+
+  scratchAllocations += ScratchArena::giveBack(arena);
+  arena = NULL;
+
+  std::chrono::duration<double> totalTime =
+      std::chrono::steady_clock::now() - start;
+
+  logged << "Correlated " << panels.size() << " panel(s) in "
+         << correlationTime.count() << " s, spot finding took "
+         << totalTime.count() << " s." << std::endl;
+  sendLog(LogLevelDetailed);
 }
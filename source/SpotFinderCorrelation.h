@@ -12,14 +12,60 @@
 
 #include <stdio.h>
 #include "FileParser.h"
+#include "FFT.h"
+#include "ScratchArena.h"
 #include "SpotFinder.h"
 
+#define DIRECT_CORRELATION_MAX_LENGTH 9
+#define CORRELATION_BAND_ROWS 64
+
+/* The image is searched in bands of rows, from the top down. Correlations
+ * between the model spot and every probe-sized window centred in a band are
+ * found up front for each detector panel, with window sums and sums of
+ * squares taken from summed-area tables covering the band and its padding.
+ * Small model spots are correlated directly; larger ones by FFT over small
+ * overlapping tiles, against a transform of the model spot made once per
+ * image. Band tables stay small enough to be kept in a scratch arena between
+ * frames, as is the mask of pixels near accepted spots. */
+
 class SpotFinderCorrelation : public SpotFinder {
  private:
+  int xDim;
+  int yDim;
+  int padding;
+  int panelThreads;
+  int bandMinY;
+  int bandMaxY;
+  int tableTop;
+  int tableBottom;
+  std::vector<double> probe;
+  double probeSquares;
+  ScratchArena *arena;
+  std::vector<int> *values;
+  std::vector<double> *rejectTable;
+  std::vector<double> *sumTable;
+  std::vector<double> *squareTable;
+  std::vector<double> *correlations;
+  std::vector<PanelBounds> panels;
+  FFT *kernel;
+
   void focusOnMax(int *x, int *y);
+  void makeProbe();
+  void makeTables(int top, int bottom);
+  double windowSum(std::vector<double> &table, int x, int y);
+  void storeCorrelation(int x, int y, double cross);
+  void correlateDirect(int minX, int minY, int maxX, int maxY);
+  void correlateTiled(int minX, int minY, int maxX, int maxY);
+  void correlatePanel(PanelBounds *panel);
+  static void correlateThread(SpotFinderCorrelation *me, int offset);
+  void correlateBand(int minY, int maxY);
 
  public:
-  SpotFinderCorrelation(ImagePtr image) : SpotFinder(image) {}
+  SpotFinderCorrelation(ImagePtr image) : SpotFinder(image) {
+    kernel = NULL;
+    /* Images are already found on separate threads */
+    panelThreads = FileParser::getKey("SPOT_FINDING_PANEL_THREADS", 1);
+  }
 
   virtual void findSpecificSpots(std::vector<SpotPtr> *spots);
 };
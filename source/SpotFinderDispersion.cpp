@@ -0,0 +1,280 @@
+//
+//  SpotFinderDispersion.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "SpotFinderDispersion.h"
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include "Image.h"
+
+typedef struct {
+  int pixels;
+  double totalSignal;
+  double sumX;
+  double sumY;
+} DispersionBlob;
+
+template <class Value>
+static void addWindowRow(Value *data, std::vector<unsigned char> &valid,
+                         int xDim, int y, int sign, std::vector<int> *counts,
+                         std::vector<long long> *sums,
+                         std::vector<long long> *squares) {
+  size_t row = (size_t)y * xDim;
+
+  for (int x = 0; x < xDim; x++) {
+    long long value = valid[row + x] ? (long long)data[row + x] : 0;
+
+    (*counts)[x] += sign * valid[row + x];
+    (*sums)[x] += sign * value;
+    (*squares)[x] += sign * value * value;
+  }
+}
+
+template <class Value>
+void SpotFinderDispersion::findSignalPixels(
+    Value *data, std::vector<unsigned char> &valid,
+    std::vector<SignalPixel> *signalPixels) {
+  int xDim = image->getXDim();
+  int yDim = image->getYDim();
+
+  /* Unmasked pixel count, value and value squared of each column over the
+   * rows of the window */
+  std::vector<int> counts(xDim, 0);
+  std::vector<long long> sums(xDim, 0);
+  std::vector<long long> squares(xDim, 0);
+
+  for (int y = 0; y < std::min(kernelSize, yDim); y++) {
+    addWindowRow(data, valid, xDim, y, 1, &counts, &sums, &squares);
+  }
+
+  double dispersionFactor = sigmaBackground * sqrt(2.);
+  double minimum = threshold;
+
+  for (int y = 0; y < yDim; y++) {
+    if (y + kernelSize < yDim) {
+      addWindowRow(data, valid, xDim, y + kernelSize, 1, &counts, &sums,
+                   &squares);
+    }
+
+    if (y - kernelSize - 1 >= 0) {
+      addWindowRow(data, valid, xDim, y - kernelSize - 1, -1, &counts, &sums,
+                   &squares);
+    }
+
+    long long n = 0;
+    long long sum = 0;
+    long long sumSq = 0;
+    size_t row = (size_t)y * xDim;
+
+    for (int x = 0; x < std::min(kernelSize, xDim); x++) {
+      n += counts[x];
+      sum += sums[x];
+      sumSq += squares[x];
+    }
+
+    for (int x = 0; x < xDim; x++) {
+      if (x + kernelSize < xDim) {
+        n += counts[x + kernelSize];
+        sum += sums[x + kernelSize];
+        sumSq += squares[x + kernelSize];
+      }
+
+      if (x - kernelSize - 1 >= 0) {
+        n -= counts[x - kernelSize - 1];
+        sum -= sums[x - kernelSize - 1];
+        sumSq -= squares[x - kernelSize - 1];
+      }
+
+      if (!valid[row + x] || n < minCount) {
+        continue;
+      }
+
+      double value = data[row + x];
+
+      if (value < minimum) {
+        continue;
+      }
+
+      double mean = (double)sum / (double)n;
+      double variance = (double)(n * sumSq - sum * sum) / (double)(n * (n - 1));
+
+      bool dispersed =
+          variance > mean * (1 + dispersionFactor / sqrt((double)(n - 1)));
+      bool strong = value > mean + sigmaStrong * sqrt(std::max(mean, 0.));
+
+      if (dispersed && strong) {
+        SignalPixel pixel;
+        pixel.x = x;
+        pixel.y = y;
+        pixel.value = value - mean;
+        signalPixels->push_back(pixel);
+      }
+    }
+  }
+}
+
+int SpotFinderDispersion::findRoot(std::vector<int> &parents, int pixel) {
+  while (parents[pixel] != pixel) {
+    parents[pixel] = parents[parents[pixel]];
+    pixel = parents[pixel];
+  }
+
+  return pixel;
+}
+
+void SpotFinderDispersion::joinPixels(std::vector<int> &parents, int one,
+                                      int two) {
+  int rootOne = findRoot(parents, one);
+  int rootTwo = findRoot(parents, two);
+
+  /* The first pixel in raster order stays the root */
+  if (rootOne < rootTwo) {
+    parents[rootTwo] = rootOne;
+  } else if (rootTwo < rootOne) {
+    parents[rootOne] = rootTwo;
+  }
+}
+
+void SpotFinderDispersion::findSpecificSpots(std::vector<SpotPtr> *spots) {
+  int xDim = image->getXDim();
+  int yDim = image->getYDim();
+  size_t pixels = (size_t)xDim * yDim;
+
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  std::vector<unsigned char> valid(pixels);
+
+  for (int y = 0; y < yDim; y++) {
+    for (int x = 0; x < xDim; x++) {
+      valid[(size_t)y * xDim + x] = image->accepted(x, y);
+    }
+  }
+
+  std::vector<SignalPixel> signalPixels;
+  short int *shortData = image->getShortDataPtr();
+
+  if (shortData) {
+    findSignalPixels(shortData, valid, &signalPixels);
+  } else {
+    findSignalPixels(image->getDataPtr(), valid, &signalPixels);
+  }
+
+  std::chrono::duration<double> thresholdTime =
+      std::chrono::steady_clock::now() - start;
+
+  /* Connected components of signal pixels, which are listed in raster
+   * order; only the signal pixels of this row and the row above are
+   * looked up by position */
+  int signalCount = (int)signalPixels.size();
+  std::vector<int> parents(signalCount);
+  std::vector<int> above(xDim, -1);
+  std::vector<int> here(xDim, -1);
+  int row = -1;
+
+  for (int i = 0; i < signalCount; i++) {
+    SignalPixel &pixel = signalPixels[i];
+
+    if (pixel.y != row) {
+      if (pixel.y == row + 1) {
+        above.swap(here);
+      } else {
+        std::fill(above.begin(), above.end(), -1);
+      }
+
+      std::fill(here.begin(), here.end(), -1);
+      row = pixel.y;
+    }
+
+    parents[i] = i;
+    here[pixel.x] = i;
+
+    if (pixel.x > 0 && here[pixel.x - 1] >= 0) {
+      joinPixels(parents, i, here[pixel.x - 1]);
+    }
+
+    if (above[pixel.x] >= 0) {
+      joinPixels(parents, i, above[pixel.x]);
+    }
+  }
+
+  /* Blobs are numbered by their first pixel in raster order */
+  std::vector<DispersionBlob> blobs;
+  std::vector<int> blobForRoot(signalCount, -1);
+
+  for (int i = 0; i < signalCount; i++) {
+    int root = findRoot(parents, i);
+
+    if (blobForRoot[root] < 0) {
+      DispersionBlob blob;
+      blob.pixels = 0;
+      blob.totalSignal = 0;
+      blob.sumX = 0;
+      blob.sumY = 0;
+
+      blobForRoot[root] = (int)blobs.size();
+      blobs.push_back(blob);
+    }
+
+    DispersionBlob &blob = blobs[blobForRoot[root]];
+    double value = signalPixels[i].value;
+
+    blob.pixels++;
+    blob.totalSignal += value;
+    blob.sumX += signalPixels[i].x * value;
+    blob.sumY += signalPixels[i].y * value;
+  }
+
+  int tooBig = 0;
+  int tooSmall = 0;
+
+  peaks = (Peak *)malloc(sizeof(Peak) * std::max(blobs.size(), (size_t)1));
+  totalPeaks = 0;
+
+  for (int i = 0; i < blobs.size(); i++) {
+    if (blobs[i].pixels > maxPixels) {
+      tooBig++;
+      continue;
+    }
+
+    if (blobs[i].pixels < minPixels) {
+      tooSmall++;
+      continue;
+    }
+
+    Peak *peak = &peaks[totalPeaks];
+    peak->centreX = blobs[i].sumX / blobs[i].totalSignal;
+    peak->centreY = blobs[i].sumY / blobs[i].totalSignal;
+    peak->totalSignal = blobs[i].totalSignal;
+    totalPeaks++;
+  }
+
+  std::chrono::duration<double> totalTime =
+      std::chrono::steady_clock::now() - start;
+
+  std::ostringstream logged;
+  logged << "Signal pixels: " << signalCount << std::endl;
+  logged << "Blobs found: " << blobs.size() << std::endl;
+  logged << "Spot had too many pixels: " << tooBig << std::endl;
+  logged << "Spot had too few pixels: " << tooSmall << std::endl;
+  logged << "Dispersion spot finding took " << totalTime.count() << " s ("
+         << thresholdTime.count() << " s thresholding)." << std::endl;
+
+  Logger::log(logged);
+}
@@ -0,0 +1,70 @@
+//
+//  SpotFinderDispersion.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __cppxfel__SpotFinderDispersion__
+#define __cppxfel__SpotFinderDispersion__
+
+#include <stdio.h>
+#include <vector>
+#include "FileParser.h"
+#include "SpotFinder.h"
+
+/* Dispersion spot finding as in DIALS: a pixel is signal if the
+ * variance/mean of the unmasked pixels in the window around it is too
+ * high for Poisson background, and it stands out from that mean by enough
+ * sigma. Window sums are exact integers, kept for each column over the
+ * window rows and moved along each row, so each pixel costs the same
+ * whatever the window size and only a few rows are held. Signal pixels are
+ * listed and joined into spots by union-find over their four neighbours. */
+
+typedef struct {
+  int x;
+  int y;
+  float value;
+} SignalPixel;
+
+class SpotFinderDispersion : public SpotFinder {
+ private:
+  int kernelSize;
+  int minPixels;
+  int maxPixels;
+  int minCount;
+  double sigmaBackground;
+  double sigmaStrong;
+
+  template <class Value>
+  void findSignalPixels(Value *data, std::vector<unsigned char> &valid,
+                        std::vector<SignalPixel> *signalPixels);
+  static int findRoot(std::vector<int> &parents, int pixel);
+  static void joinPixels(std::vector<int> &parents, int one, int two);
+
+ public:
+  SpotFinderDispersion(ImagePtr image) : SpotFinder(image) {
+    kernelSize = FileParser::getKey("SPOT_FINDING_KERNEL_SIZE", 3);
+    minPixels = FileParser::getKey("SPOT_FINDING_MIN_PIXELS", 2);
+    maxPixels = FileParser::getKey("SPOT_FINDING_MAX_PIXELS", 40);
+    minCount = 2;
+    sigmaBackground = FileParser::getKey("SPOT_FINDING_SIGMA_BACKGROUND", 6.);
+    sigmaStrong = FileParser::getKey("SPOT_FINDING_SIGMA_STRONG", 3.);
+  }
+
+  virtual void findSpecificSpots(std::vector<SpotPtr> *spots);
+};
+
+#endif /* defined(__cppxfel__SpotFinderDispersion__) */
@@ -8,7 +8,10 @@
 //
 
 #include "SpotFinderQuick.h"
+#include <boost/thread/thread.hpp>
+#include <chrono>
 #include "Image.h"
+#include "ScratchArena.h"
 
 template <class Value>
 void SpotFinderQuick::findSignalToNoise(Value *data, size_t position, int xDim,
@@ -38,37 +41,122 @@ void SpotFinderQuick::findSignalToNoise(Value *data, size_t position, int xDim,
   *signalToNoiseRatio = data[position] / *backgroundVariance;
 }
 
-void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots) {
+/* The background ring is a square of maxRadius less a square of minRadius,
+ * with shifts taken along the image as one long row (so they wrap onto the
+ * neighbouring line and are dropped off either end). Both squares are runs
+ * of pixels on consecutive lines, so with the running sum of prefix sums
+ * down each column, every square costs four lookups. */
+
+template <class Value>
+void SpotFinderQuick::makeIntegralTables(Value *data, int xDim, int yDim) {
+  size_t pixels = (size_t)xDim * yDim;
+  integralPadding = (size_t)(maxRadius + 2) * (xDim + 1);
+  size_t total = pixels + 2 * integralPadding;
+
+  integralSums.resize(total);
+  integralSquares.resize(total);
+
+  long long prefix = 0;
+  long long prefixSquared = 0;
+
+  for (size_t e = 0; e < total; e++) {
+    /* prefix sums of pixels before e, clamped to the image */
+    if (e > integralPadding && e <= integralPadding + pixels) {
+      long long value = data[e - integralPadding - 1];
+      prefix += value;
+      prefixSquared += value * value;
+    }
+
+    integralSums[e] = prefix;
+    integralSquares[e] = prefixSquared;
+
+    if (e >= xDim) {
+      integralSums[e] += integralSums[e - xDim];
+      integralSquares[e] += integralSquares[e - xDim];
+    }
+  }
+}
+
+long long SpotFinderQuick::boxSum(std::vector<long long> &table,
+                                  size_t position, int xDim, int low,
+                                  int high) {
+  /* lines and columns from low to high inclusive around position */
+  size_t centre = position + integralPadding;
+  size_t lastLine = centre + (long)high * xDim;
+  size_t beforeLine = centre + (long)(low - 1) * xDim;
+
+  return table[lastLine + high + 1] - table[beforeLine + high + 1] -
+         table[lastLine + low] + table[beforeLine + low];
+}
+
+template <class Value>
+void SpotFinderQuick::findIntegralSignalToNoise(Value *data, size_t position,
+                                                int xDim,
+                                                float *signalToNoiseRatio,
+                                                float *background,
+                                                float *backgroundVariance) {
+  long long sum =
+      boxSum(integralSums, position, xDim, -maxRadius, maxRadius) -
+      boxSum(integralSums, position, xDim, 1 - minRadius, minRadius);
+  long long squares =
+      boxSum(integralSquares, position, xDim, -maxRadius, maxRadius) -
+      boxSum(integralSquares, position, xDim, 1 - minRadius, minRadius);
+
+  /* Same integer arithmetic as findSignalToNoise from here on */
+  int backgroundSum = (int)sum;
+  int backgroundSumSquared = (int)squares;
+
+  backgroundSum /= backgroundShifts.size();
+  *background = backgroundSum;
+  backgroundSumSquared /= backgroundShifts.size();
+
+  *backgroundVariance = backgroundSumSquared - pow(backgroundSum, 2);
+  *signalToNoiseRatio = data[position] / *backgroundVariance;
+}
+
+void SpotFinderQuick::makeRegions(int xDim, int yDim) {
+  std::vector<PanelBounds> panels;
+  findPanelBounds(xDim, yDim, &panels);
+
+  regions.resize(panels.size());
+
+  for (int i = 0; i < regions.size(); i++) {
+    regions[i].minX = panels[i].minX;
+    regions[i].minY = panels[i].minY;
+    regions[i].maxX = panels[i].maxX;
+    regions[i].maxY = panels[i].maxY;
+    regions[i].peaks.clear();
+    regions[i].reachedThreshold = 0;
+    regions[i].reachedSNRThreshold = 0;
+    regions[i].tooBig = 0;
+    regions[i].tooSmall = 0;
+    regions[i].backgroundSeconds = 0;
+  }
+}
+
+void SpotFinderQuick::findSpotsInRegion(SpotRegion *region) {
   int xDim = image->getXDim();
   int yDim = image->getYDim();
   float minSeparationSquared = minSeparation * minSeparation;
   int peakToEnter = 0;
+  bool useShort = (shortData != NULL);
 
-  bool useShort = true;
-  int *data = NULL;
-  short int *shortData = image->getShortDataPtr();
-
-  size_t *pixelTracker = (size_t *)malloc(maxPixels * sizeof(size_t));
-  peaks = (Peak *)malloc(sizeof(Peak) * maxHits);
+  int width = region->maxX - region->minX + 1;
+  int height = region->maxY - region->minY + 1;
+  ScratchArena *arena = ScratchArena::borrow();
+  std::vector<size_t> &pixelTracker = arena->indices(maxPixels);
+  std::vector<Peak> &regionPeaks = region->peaks;
 
-  // calloc sets mem to 0... 1 will be used as masked
-  int *trackerMask = (int *)calloc(xDim * yDim, sizeof(int));
+  // marked pixels are masked
+  arena->beginMask((size_t)width * height);
 
-  int reachedSNRThreshold = 0;
-  int reachedThreshold = 0;
-  int tooBig = 0;
-  int tooSmall = 0;
-
-  if (shortData == NULL) {
-    useShort = false;
-    data = image->getDataPtr();
-  }
+  std::chrono::duration<double> backgroundTime(0);
 
   int shifts[] = {-xDim - 1, -xDim,     -xDim + 1, -1,
                   1,         +xDim + 1, +xDim,     +xDim + 1};
 
-  for (int i = 0; i < yDim; i++) {
-    for (int j = 0; j < xDim; j++) {
+  for (int i = region->minY; i <= region->maxY; i++) {
+    for (int j = region->minX; j <= region->maxX; j++) {
       if (peakToEnter + 1 > maxHits) {
         break;
       }
@@ -82,7 +170,7 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots) {
         continue;
       }
 
-      reachedThreshold++;
+      region->reachedThreshold++;
 
       for (int k = 0; k < 8; k++) {
         size_t otherPosition = position + shifts[k];
@@ -106,7 +194,19 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots) {
       float background = 0;
       float backgroundVariance = 0;
 
-      if (shortData) {
+      std::chrono::steady_clock::time_point backgroundStart =
+          std::chrono::steady_clock::now();
+
+      if (integralBackground) {
+        if (shortData) {
+          findIntegralSignalToNoise(shortData, position, xDim,
+                                    &signalToNoiseRatio, &background,
+                                    &backgroundVariance);
+        } else {
+          findIntegralSignalToNoise(data, position, xDim, &signalToNoiseRatio,
+                                    &background, &backgroundVariance);
+        }
+      } else if (shortData) {
         findSignalToNoise(shortData, position, xDim, yDim, &signalToNoiseRatio,
                           &background, &backgroundVariance);
       } else {
@@ -114,11 +214,13 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots) {
                           &background, &backgroundVariance);
       }
 
+      backgroundTime += std::chrono::steady_clock::now() - backgroundStart;
+
       if (signalToNoiseRatio < signalToNoiseThreshold) {
         continue;
       }
 
-      reachedSNRThreshold++;
+      region->reachedSNRThreshold++;
 
       float backgroundSigma = sqrt(backgroundVariance);
 
@@ -141,7 +243,19 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots) {
             continue;
           }
 
-          if (trackerMask[relativeToCurrentPixel] == 1) {
+          size_t currentY = relativeToCurrentPixel / xDim;
+          size_t currentX = relativeToCurrentPixel % xDim;
+
+          /* Spots do not grow beyond their panel */
+          if (currentX < region->minX || currentX > region->maxX ||
+              currentY < region->minY || currentY > region->maxY) {
+            continue;
+          }
+
+          size_t maskPosition =
+              (currentY - region->minY) * width + (currentX - region->minX);
+
+          if (arena->isMarked(maskPosition)) {
             continue;
           }
 
@@ -151,7 +265,7 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots) {
               (currentPixelValue - background) / backgroundSigma;
 
           if (currentSignalToNoise > signalToNoiseThreshold) {
-            trackerMask[relativeToCurrentPixel] = 1;
+            arena->mark(maskPosition);
 
             if (totalPixelsToCheck == maxPixels) {
               mustBreak = true;
@@ -163,15 +277,6 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots) {
 
             float signal = currentPixelValue - background;
             totalSignal += signal;
-            size_t currentY = relativeToCurrentPixel / xDim;
-
-            if (xDim == 0) {
-              logged << "Warning! xDim is zero - something is very wrong"
-                     << std::endl;
-              sendLogAndExit();
-            }
-
-            size_t currentX = relativeToCurrentPixel % xDim;
 
             centreOfMassX += currentX * signal;
             centreOfMassY += currentY * signal;
@@ -189,15 +294,13 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots) {
         lastCheckedIndex++;
       } while (lastCheckedIndex != totalPixelsToCheck);
 
-      //    std::cout << totalPixelsToCheck << std::endl;
-
       if (totalPixelsToCheck >= maxPixels) {
-        tooBig++;
+        region->tooBig++;
         continue;
       }
 
       if (totalPixelsToCheck < minPixels) {
-        tooSmall++;
+        region->tooSmall++;
         continue;
       }
 
@@ -205,8 +308,9 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots) {
       centreOfMassY /= totalSignal;
 
       for (int k = 0; k < peakToEnter; k++) {
-        float distanceSquared = pow(centreOfMassX - peaks[k].centreX, 2) +
-                                pow(centreOfMassY - peaks[k].centreY, 2);
+        float distanceSquared =
+            pow(centreOfMassX - regionPeaks[k].centreX, 2) +
+            pow(centreOfMassY - regionPeaks[k].centreY, 2);
 
         if (distanceSquared < minSeparationSquared) {
           mustContinue = true;
@@ -217,14 +321,103 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots) {
         continue;
       }
 
-      peaks[peakToEnter].centreX = centreOfMassX;
-      peaks[peakToEnter].centreY = centreOfMassY;
-      peaks[peakToEnter].totalSignal = totalSignal;
+      Peak peak;
+      peak.centreX = centreOfMassX;
+      peak.centreY = centreOfMassY;
+      peak.totalSignal = totalSignal;
+      regionPeaks.push_back(peak);
 
       peakToEnter++;
     }
   }
 
+  region->backgroundSeconds = backgroundTime.count();
+  scratchAllocations += ScratchArena::giveBack(arena);
+}
+
+void SpotFinderQuick::findSpotsThread(SpotFinderQuick *me, int offset) {
+  int maxThreads = me->panelThreads;
+
+  for (int i = offset; i < me->regions.size(); i += maxThreads) {
+    me->findSpotsInRegion(&me->regions[i]);
+  }
+}
+
+void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots) {
+  int xDim = image->getXDim();
+  int yDim = image->getYDim();
+
+  if (xDim == 0) {
+    logged << "Warning! xDim is zero - something is very wrong" << std::endl;
+    sendLogAndExit();
+  }
+
+  shortData = image->getShortDataPtr();
+  data = NULL;
+
+  if (shortData == NULL) {
+    data = image->getDataPtr();
+  }
+
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  if (integralBackground) {
+    if (shortData) {
+      makeIntegralTables(shortData, xDim, yDim);
+    } else {
+      makeIntegralTables(data, xDim, yDim);
+    }
+  }
+
+  std::chrono::duration<double> tableTime =
+      std::chrono::steady_clock::now() - start;
+
+  /* Each leaf panel is searched separately, with its own limit on hits */
+  makeRegions(xDim, yDim);
+
+  panelThreads = std::max(1, std::min(panelThreads, (int)regions.size()));
+
+  if (panelThreads == 1) {
+    findSpotsThread(this, 0);
+  } else {
+    boost::thread_group threads;
+
+    for (int i = 0; i < panelThreads; i++) {
+      boost::thread *thr = new boost::thread(findSpotsThread, this, i);
+      threads.add_thread(thr);
+    }
+
+    threads.join_all();
+  }
+
+  /* Gathered in panel order, whichever thread finished first */
+  int reachedSNRThreshold = 0;
+  int reachedThreshold = 0;
+  int tooBig = 0;
+  int tooSmall = 0;
+  double backgroundSeconds = 0;
+  size_t peakCount = 0;
+
+  for (int i = 0; i < regions.size(); i++) {
+    reachedThreshold += regions[i].reachedThreshold;
+    reachedSNRThreshold += regions[i].reachedSNRThreshold;
+    tooBig += regions[i].tooBig;
+    tooSmall += regions[i].tooSmall;
+    backgroundSeconds += regions[i].backgroundSeconds;
+    peakCount += regions[i].peaks.size();
+  }
+
+  peaks = (Peak *)malloc(sizeof(Peak) * std::max(peakCount, (size_t)1));
+  totalPeaks = 0;
+
+  for (int i = 0; i < regions.size(); i++) {
+    for (int j = 0; j < regions[i].peaks.size(); j++) {
+      peaks[totalPeaks] = regions[i].peaks[j];
+      totalPeaks++;
+    }
+  }
+
   std::ostringstream logged;
   logged << "Pixels reaching intensity threshold: " << reachedThreshold
          << std::endl;
@@ -233,12 +426,18 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots) {
   logged << "Spot had too many pixels: " << tooBig << std::endl;
   logged << "Spot had too few pixels: " << tooSmall << std::endl;
 
-  Logger::log(logged);
+  std::chrono::duration<double> totalTime =
+      std::chrono::steady_clock::now() - start;
+  logged << "Spot finding in " << regions.size() << " panel(s) took "
+         << totalTime.count() << " s: " << tableTime.count()
+         << " s building background tables, " << backgroundSeconds
+         << " s on background (summed over threads)." << std::endl;
 
-  totalPeaks = peakToEnter + 1;
+  Logger::log(logged);
 
-  free(pixelTracker);
-  free(trackerMask);
+  regions.clear();
+  std::vector<long long>().swap(integralSums);
+  std::vector<long long>().swap(integralSquares);
 }
 
 void SpotFinderQuick::calculateBackgroundShifts() {
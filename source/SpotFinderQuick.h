@@ -15,21 +15,58 @@
 
 class SpotFinderQuick : public SpotFinder {
  private:
+  /* Pixels (inclusive) of one panel, searched on its own thread, with the
+   * peaks it found and its statistics */
+  typedef struct {
+    int minX;
+    int minY;
+    int maxX;
+    int maxY;
+    std::vector<Peak> peaks;
+    int reachedThreshold;
+    int reachedSNRThreshold;
+    int tooBig;
+    int tooSmall;
+    double backgroundSeconds;
+  } SpotRegion;
+
   int minRadius;
   int maxRadius;
   int minPixels;
   int maxPixels;
   int maxHits;
   int minSeparation;
+  int panelThreads;
   float signalToNoiseThreshold;
 
   std::vector<int> backgroundShifts;
+  std::vector<SpotRegion> regions;
+  short int *shortData;
+  int *data;
+
+  /* Running sums of pixel values (and squares) down every column of the
+   * image taken as one long row, padded either side of the image */
+  bool integralBackground;
+  size_t integralPadding;
+  std::vector<long long> integralSums;
+  std::vector<long long> integralSquares;
 
   template <class Value>
   void findSignalToNoise(Value *data, size_t position, int xDim, int yDim,
                          float *signalToNoiseRatio, float *background,
                          float *backgroundVariance);
+  template <class Value>
+  void makeIntegralTables(Value *data, int xDim, int yDim);
+  long long boxSum(std::vector<long long> &table, size_t position, int xDim,
+                   int low, int high);
+  template <class Value>
+  void findIntegralSignalToNoise(Value *data, size_t position, int xDim,
+                                 float *signalToNoiseRatio, float *background,
+                                 float *backgroundVariance);
   void calculateBackgroundShifts();
+  void makeRegions(int xDim, int yDim);
+  void findSpotsInRegion(SpotRegion *region);
+  static void findSpotsThread(SpotFinderQuick *me, int offset);
 
  public:
   SpotFinderQuick(ImagePtr image) : SpotFinder(image) {
@@ -40,12 +77,19 @@ class SpotFinderQuick : public SpotFinder {
     minPixels = FileParser::getKey("SPOT_FINDING_MIN_PIXELS", 2);
     minSeparation = 3;
     maxPixels = FileParser::getKey("SPOT_FINDING_MAX_PIXELS", 40);
-    maxHits = 500;
+    maxHits = FileParser::getKey("SPOT_FINDING_MAX_HITS", 500);
+    /* Images are already found on separate threads */
+    panelThreads = FileParser::getKey("SPOT_FINDING_PANEL_THREADS", 1);
+    shortData = NULL;
+    data = NULL;
 
     // For cheetah, Takanori Nakane says:
     // "In LCLS, 4. For SACLA, 4 leads to many false positives"
     signalToNoiseThreshold =
         FileParser::getKey("SPOT_FINDING_SIGNAL_TO_NOISE", 5.);
+    integralBackground =
+        FileParser::getKey("SPOT_FINDING_INTEGRAL_BACKGROUND", false);
+    integralPadding = 0;
 
     calculateBackgroundShifts();
   }
@@ -0,0 +1,124 @@
+//
+//  SpotHash.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "SpotHash.h"
+#include <math.h>
+#include <algorithm>
+#include "Spot.h"
+#include "Vector.h"
+
+/* Cell indices are packed 21 bits to an axis. Indices beyond that range
+ * are clamped to the outermost cells, which only makes those cells hold
+ * more candidates; callers check the actual distances. */
+#define SPOT_HASH_AXIS_OFFSET (1 << 20)
+
+SpotHash::SpotHash(std::vector<vec> &somePositions, double aCellSize) {
+  positions = somePositions;
+  cellSize = aCellSize;
+  makeCells();
+}
+
+SpotHash::SpotHash(std::vector<SpotPtr> &spots, double aCellSize) {
+  positions.resize(spots.size());
+
+  for (int i = 0; i < spots.size(); i++) {
+    Coord xy = spots[i]->getRawXY();
+    positions[i] = new_vector(xy.first, xy.second, 0);
+  }
+
+  cellSize = aCellSize;
+  makeCells();
+}
+
+int SpotHash::cellIndex(double value) {
+  if (value != value) {
+    return 0;
+  }
+
+  double index = floor(value / cellSize);
+  index = std::max(index, (double)-SPOT_HASH_AXIS_OFFSET);
+  index = std::min(index, (double)(SPOT_HASH_AXIS_OFFSET - 1));
+
+  return (int)index;
+}
+
+long long SpotHash::cellKey(int x, int y, int z) {
+  long long key = (long long)(x + SPOT_HASH_AXIS_OFFSET) << 42;
+  key |= (long long)(y + SPOT_HASH_AXIS_OFFSET) << 21;
+  key |= (long long)(z + SPOT_HASH_AXIS_OFFSET);
+
+  return key;
+}
+
+void SpotHash::makeCells() {
+  cells.resize(positions.size());
+  kept.assign(positions.size(), true);
+
+  for (int i = 0; i < positions.size(); i++) {
+    long long key =
+        cellKey(cellIndex(positions[i].h), cellIndex(positions[i].k),
+                cellIndex(positions[i].l));
+    cells[i] = std::make_pair(key, i);
+  }
+
+  /* Spots in one cell end up together, in their original order */
+  std::sort(cells.begin(), cells.end());
+}
+
+void SpotHash::findNear(vec position, double tolerance,
+                        std::vector<int> *indices) {
+  indices->clear();
+
+  int minX = cellIndex(position.h - tolerance);
+  int maxX = cellIndex(position.h + tolerance);
+  int minY = cellIndex(position.k - tolerance);
+  int maxY = cellIndex(position.k + tolerance);
+  int minZ = cellIndex(position.l - tolerance);
+  int maxZ = cellIndex(position.l + tolerance);
+
+  for (int x = minX; x <= maxX; x++) {
+    for (int y = minY; y <= maxY; y++) {
+      for (int z = minZ; z <= maxZ; z++) {
+        long long key = cellKey(x, y, z);
+
+        std::vector<std::pair<long long, int> >::iterator it = std::lower_bound(
+            cells.begin(), cells.end(), std::make_pair(key, 0));
+
+        for (; it != cells.end() && it->first == key; it++) {
+          if (kept[it->second]) {
+            indices->push_back(it->second);
+          }
+        }
+      }
+    }
+  }
+}
+
+void SpotHash::compact(std::vector<SpotPtr> *spots) {
+  int next = 0;
+
+  for (int i = 0; i < spots->size(); i++) {
+    if (kept[i]) {
+      (*spots)[next] = (*spots)[i];
+      next++;
+    }
+  }
+
+  spots->resize(next);
+}
@@ -0,0 +1,63 @@
+//
+//  SpotHash.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __cppxfel__SpotHash__
+#define __cppxfel__SpotHash__
+
+#include <stdio.h>
+#include <vector>
+#include "parameters.h"
+
+/* Pixels either way within which a prediction overlaps a strong spot */
+#define SPOT_OVERLAP_TOLERANCE 2.5
+
+/* Spatial hash of spot positions, either raw detector coordinates or
+ * reciprocal space vectors, on a uniform grid of cubic cells. Occupied
+ * cells are kept as a sorted list, so memory follows the spot count and
+ * not the extent of the grid. Spots may be struck off as they are used
+ * up and the spot list compacted once at the end. */
+
+class SpotHash {
+ private:
+  double cellSize;
+  std::vector<vec> positions;
+  std::vector<std::pair<long long, int> > cells;
+  std::vector<char> kept;
+
+  int cellIndex(double value);
+  long long cellKey(int x, int y, int z);
+  void makeCells();
+
+ public:
+  SpotHash(std::vector<vec> &somePositions, double aCellSize);
+  SpotHash(std::vector<SpotPtr> &spots, double aCellSize);
+
+  void findNear(vec position, double tolerance, std::vector<int> *indices);
+  void compact(std::vector<SpotPtr> *spots);
+
+  int positionCount() { return (int)positions.size(); }
+
+  vec &position(int i) { return positions[i]; }
+
+  bool isKept(int i) { return kept[i]; }
+
+  void remove(int i) { kept[i] = false; }
+};
+
+#endif /* defined(__cppxfel__SpotHash__) */
@@ -12,6 +12,7 @@
 #include "FileParser.h"
 #include "Matrix.h"
 #include "PNGFile.h"
+#include "UnitCellLattice.h"
 #include "misc.h"
 
 double SpotVector::trustComparedToStandardVector(SpotVectorPtr standardVector) {
@@ -130,6 +131,17 @@ SpotVectorPtr SpotVector::copy() {
   return newPtr;
 }
 
+SpotVectorPtr SpotVector::copyWithSpots(SpotPtr first, SpotPtr second) {
+  SpotVectorPtr newPtr = SpotVectorPtr(new SpotVector(first, second));
+  newPtr->hkl = copy_vector(hkl);
+  newPtr->update = update;
+  newPtr->firstDistance = firstDistance;
+  newPtr->_isIntraPanelVector = _isIntraPanelVector;
+  newPtr->sameLengthStandardVectors = sameLengthStandardVectors;
+
+  return newPtr;
+}
+
 SpotVectorPtr SpotVector::vectorRotatedByMatrix(MatrixPtr mat) {
   SpotVectorPtr newVec = copy();
 
@@ -192,16 +204,40 @@ std::string SpotVector::description() {
          f_to_str(spotDiff.l) + ")";
 }
 
-void SpotVector::addSimilarLengthStandardVectors(
-    std::vector<SpotVectorPtr> standardVectors, double tolerance) {
+void SpotVector::standardVectorCandidates(UnitCellLatticePtr lattice,
+                                          std::vector<int> *indices) {
+  double tolerance = getMinDistanceTolerance();
+
+  /* Trust is one over the difference in length, so only standard vectors
+   * within 1 / tolerance of this length can pass */
+  if (tolerance > 0) {
+    double window = 1 / tolerance;
+    lattice->standardVectorsInRange(distance() - window, distance() + window,
+                                    indices);
+    return;
+  }
+
+  indices->clear();
+
+  for (int i = 0; i < lattice->standardVectorCount(); i++) {
+    indices->push_back(i);
+  }
+}
+
+void SpotVector::addSimilarLengthStandardVectors(UnitCellLatticePtr lattice,
+                                                 double tolerance) {
   sameLengthStandardVectors.clear();
   tolerance = this->getMinDistanceTolerance();
 
-  for (int i = 0; i < standardVectors.size(); i++) {
-    double trust = trustComparedToStandardVector(standardVectors[i]);
+  std::vector<int> indices;
+  standardVectorCandidates(lattice, &indices);
+
+  for (int i = 0; i < indices.size(); i++) {
+    SpotVectorPtr standardVector = lattice->standardVector(indices[i]);
+    double trust = trustComparedToStandardVector(standardVector);
 
     if (trust > tolerance) {
-      sameLengthStandardVectors.push_back(standardVectors[i]);
+      sameLengthStandardVectors.push_back(standardVector);
     }
   }
 
@@ -316,6 +352,19 @@ bool SpotVector::isIntraPanelVector() {
   return _isIntraPanelVector;
 }
 
+/* Works out every value which is otherwise cached on first use, so that
+ * threads sharing this vector only ever read it */
+void SpotVector::fillCaches() {
+  distance();
+
+  if (!firstSpot || !secondSpot) {
+    return;
+  }
+
+  getMinAngleTolerance();
+  isIntraPanelVector();
+}
+
 bool SpotVector::spansChildrenOfDetector(DetectorPtr parent) {
   DetectorPtr onePanel = firstSpot->getDetector();
   DetectorPtr twoPanel = secondSpot->getDetector();
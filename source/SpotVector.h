@@ -51,15 +51,19 @@ class SpotVector : public LoggableObject {
   double getMinDistanceTolerance();
   double getMinAngleTolerance();
   bool isIntraPanelVector();
+  void fillCaches();
   double angleWithVector(SpotVectorPtr spotVector2);
   double similarityToSpotVector(SpotVectorPtr spotVector2);
   bool isCloseToSpotVector(SpotVectorPtr spotVector2, double maxDistance);
   double trustComparedToStandardVector(SpotVectorPtr standardVector);
   SpotVectorPtr copy();
+  SpotVectorPtr copyWithSpots(SpotPtr first, SpotPtr second);
   SpotVectorPtr vectorRotatedByMatrix(MatrixPtr mat);
   std::string description();
-  void addSimilarLengthStandardVectors(
-      std::vector<SpotVectorPtr> standardVectors, double tolerance);
+  void standardVectorCandidates(UnitCellLatticePtr lattice,
+                                std::vector<int> *indices);
+  void addSimilarLengthStandardVectors(UnitCellLatticePtr lattice,
+                                       double tolerance);
   double cosineWithVector(SpotVectorPtr spotVector2);
   double cosineWithVertical();
   SpotVectorPtr differenceFromVector(SpotVectorPtr spotVec);
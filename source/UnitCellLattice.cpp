@@ -234,6 +234,7 @@ void UnitCellLattice::updateUnitCellData() {
     spotVec->setUpdate();
   }
 
+  sortStandardVectors();
   orderedDistances.clear();
 
   for (int i = 0; i < uniqueSymVectorCount(); i++) {
@@ -245,6 +246,34 @@ void UnitCellLattice::updateUnitCellData() {
             std::less<double>());
 }
 
+void UnitCellLattice::sortStandardVectors() {
+  sortedStandardVectors.resize(standardVectorCount());
+
+  for (int i = 0; i < standardVectorCount(); i++) {
+    double distance = standardVector(i)->distance();
+    sortedStandardVectors[i] = std::make_pair(distance, i);
+  }
+
+  std::sort(sortedStandardVectors.begin(), sortedStandardVectors.end());
+}
+
+void UnitCellLattice::standardVectorsInRange(double minLength,
+                                             double maxLength,
+                                             std::vector<int> *indices) {
+  indices->clear();
+
+  std::pair<double, int> lowest = std::make_pair(minLength, -1);
+  std::vector<std::pair<double, int> >::iterator it = std::lower_bound(
+      sortedStandardVectors.begin(), sortedStandardVectors.end(), lowest);
+
+  for (; it != sortedStandardVectors.end() && it->first <= maxLength; it++) {
+    indices->push_back(it->second);
+  }
+
+  /* Callers see the vectors in the order the lattice made them */
+  std::sort(indices->begin(), indices->end());
+}
+
 void UnitCellLattice::setup() {
   setupLock.lock();
 
@@ -343,6 +372,8 @@ void UnitCellLattice::setup() {
   std::sort(orderedDistances.begin(), orderedDistances.end(),
             std::less<double>());
 
+  sortStandardVectors();
+
   minDistance = FLT_MAX;
 
   for (int i = 0; i < 3; i++) {
@@ -35,10 +35,12 @@ class UnitCellLattice : public FreeLattice,
   double powderStep;
   PowderHistogram histogram;
   std::vector<SpotVectorPtr> uniqueSymVectors;
+  std::vector<std::pair<double, int> > sortedStandardVectors;
   CSVPtr weightedUnitCell;
   CSVPtr weightedAngles;
   CSVPtr angleCSV;
   void updateUnitCellData();
+  void sortStandardVectors();
   double distanceToAngleRatio;
   std::mutex setupLock;
   static bool setupLattice;
@@ -90,6 +92,9 @@ class UnitCellLattice : public FreeLattice,
 
   std::vector<SpotVectorPtr> getStandardVectors() { return spotVectors; }
 
+  void standardVectorsInRange(double minLength, double maxLength,
+                              std::vector<int> *indices);
+
   void refineMtzs(std::vector<MtzPtr> newMtzs);
 
   CSVPtr getWeightedUnitCell() { return weightedUnitCell; }
@@ -141,6 +141,7 @@ typedef enum {
   MinimizationMethodStepSearch = 0,
   MinimizationMethodNelderMead = 1,
   MinimizationMethodGridSearch = 2,
+  MinimizationMethodDifferentialEvolution = 3,
 } MinimizationMethod;
 
 typedef enum {
@@ -175,6 +176,8 @@ class Shoebox;
 class Matrix;
 class MtzManager;
 class Spot;
+class ScratchArena;
+class SpotHash;
 class SpotVector;
 class IndexingSolution;
 class UnitCellLattice;
@@ -196,12 +199,18 @@ class SpotFinderQuick;
 class SpotFinder;
 class Reflection;
 class NelderMead;
+class DifferentialEvolution;
+class MergeSpill;
+class MergeState;
+class BatchScaler;
+class MtzWriter;
 
 typedef boost::shared_ptr<SpectrumBeam> SpectrumBeamPtr;
 typedef boost::shared_ptr<RefinementStepSearch> RefinementStepSearchPtr;
 typedef boost::shared_ptr<RefinementGridSearch> RefinementGridSearchPtr;
 typedef boost::shared_ptr<RefinementStrategy> RefinementStrategyPtr;
 typedef boost::shared_ptr<NelderMead> NelderMeadPtr;
+typedef boost::shared_ptr<DifferentialEvolution> DifferentialEvolutionPtr;
 typedef boost::shared_ptr<Beam> BeamPtr;
 typedef boost::shared_ptr<GaussianBeam> GaussianBeamPtr;
 typedef boost::shared_ptr<Miller> MillerPtr;
@@ -227,6 +236,10 @@ typedef boost::weak_ptr<IndexManager> IndexManagerWeakPtr;
 typedef boost::shared_ptr<IndexingSolution> IndexingSolutionPtr;
 typedef boost::shared_ptr<std::mutex> MutexPtr;
 typedef boost::shared_ptr<UnitCellLattice> UnitCellLatticePtr;
+typedef boost::shared_ptr<MergeSpill> MergeSpillPtr;
+typedef boost::shared_ptr<MergeState> MergeStatePtr;
+typedef boost::shared_ptr<BatchScaler> BatchScalerPtr;
+typedef boost::shared_ptr<MtzWriter> MtzWriterPtr;
 typedef boost::shared_ptr<Hdf5ManagerProcessing> Hdf5ManagerProcessingPtr;
 typedef std::shared_ptr<PNGFile> PNGFilePtr;
 typedef std::shared_ptr<CSV> CSVPtr;
@@ -253,6 +266,18 @@ typedef std::pair<std::pair<SpotVectorPtr, VectorDistance>, double> Match;
 typedef double (*Getter)(void *);
 typedef void (*Setter)(void *, double newValue);
 
+/* Independent copies of an evaluated object and of its refined parameter
+ * objects, so that trial parameters can be scored in parallel without
+ * touching the live objects. The owner keeps the copies alive. */
+typedef struct {
+  void *evaluateObject;
+  std::vector<void *> objects;
+  boost::shared_ptr<void> owner;
+} EvaluationContext;
+
+typedef bool (*ContextMaker)(void *evaluatedObject, std::vector<void *> objects,
+                             EvaluationContext *context);
+
 typedef std::map<int, std::pair<int, int> > PowderHistogram;
 
 typedef enum {
@@ -0,0 +1,111 @@
+//
+//  RefinementStrategyTest.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+/* Checks that cached refinement leaves the evaluated object as its score
+ * function last saw it at the accepted parameters. Score functions such as
+ * MtzManager::refineParameterScore refresh state as a side effect, so the
+ * final evaluation must really call them. */
+
+#include <math.h>
+#include <iostream>
+#include "../Logger.h"
+#include "../NelderMead.h"
+#include "../RefinementStepSearch.h"
+
+class RecordingTarget {
+ public:
+  double x;
+  double y;
+  double scoredX;
+  double scoredY;
+  int calls;
+
+  RecordingTarget() {
+    x = 0;
+    y = 0;
+    scoredX = HUGE_VAL;
+    scoredY = HUGE_VAL;
+    calls = 0;
+  }
+
+  static double getX(void *object) {
+    return static_cast<RecordingTarget *>(object)->x;
+  }
+
+  static void setX(void *object, double newX) {
+    static_cast<RecordingTarget *>(object)->x = newX;
+  }
+
+  static double getY(void *object) {
+    return static_cast<RecordingTarget *>(object)->y;
+  }
+
+  static void setY(void *object, double newY) {
+    static_cast<RecordingTarget *>(object)->y = newY;
+  }
+
+  static double score(void *object) {
+    RecordingTarget *me = static_cast<RecordingTarget *>(object);
+    me->scoredX = me->x;
+    me->scoredY = me->y;
+    me->calls++;
+
+    return pow(me->x - 3.2, 2) + pow(me->y + 1.7, 2);
+  }
+};
+
+static int failures = 0;
+
+static void checkRefinement(RefinementStrategy *strategy, std::string name) {
+  RecordingTarget target;
+
+  strategy->setEvaluationFunction(RecordingTarget::score, &target);
+  strategy->setCacheEvaluations(true);
+  strategy->setCycles(30);
+  strategy->addParameter(&target, RecordingTarget::getX,
+                         RecordingTarget::setX, 1.0, 0.01, "x");
+  strategy->addParameter(&target, RecordingTarget::getY,
+                         RecordingTarget::setY, 1.0, 0.01, "y");
+  strategy->refine();
+
+  bool moved = strategy->didChange();
+  bool consistent = (target.scoredX == target.x && target.scoredY == target.y);
+
+  std::cout << name << ": " << target.calls << " calls, accepted (" << target.x
+            << ", " << target.y << "), last scored (" << target.scoredX
+            << ", " << target.scoredY << ") - "
+            << (moved && consistent ? "ok" : "FAILED") << std::endl;
+
+  if (!moved || !consistent) {
+    failures++;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  /* Messages are queued but never printed, as no printing thread runs */
+  Logger::mainLogger = LoggerPtr(new Logger());
+
+  RefinementStepSearch stepSearch;
+  checkRefinement(&stepSearch, "Step search");
+
+  NelderMead nelderMead;
+  checkRefinement(&nelderMead, "Nelder-Mead");
+
+  return (failures > 0) ? 1 : 0;
+}